@@ -37,16 +37,387 @@
 
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "http_lib.h"
 
+/* batch mode: default and max number of requests in progress */
+#define BATCH_CONCURRENCY 4
+#define BATCH_MAX 256
+
+/* operation of a batch file */
+typedef struct {
+	char *method;
+	char *url;
+	char *body;		/* file sent by PUT and POST, NULL if none */
+	char *output;		/* file the answer is written to, NULL if none */
+} batch_op;
+
+typedef struct {
+	batch_op *ops;
+	int n;
+	int next;		/* next operation to run */
+	int ok, failed;
+	long long bytes;	/* data sent and received */
+	char *proxy;
+	pthread_mutex_t lock;	/* of next, counters and stdout */
+} batch;
+
+static long long
+batch_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * value of the string field name of a JSON object on one line, unescaped
+ * in place in the line. Only the escapes of plain text are known.
+ * returns NULL if there is none
+ */
+static char *
+batch_json(char *line, const char *name)
+{
+	char *p, *q, *value;
+	size_t len = strlen(name);
+
+	for (p = line; (p = strchr(p, '"')) != NULL; ) {
+		p++;
+		if (strncmp(p, name, len) || p[len] != '"') {
+			/* skip the string */
+			while (*p && *p != '"')
+				p += (*p == '\\' && p[1]) ? 2 : 1;
+			if (*p)
+				p++;
+			continue;
+		}
+		p += len + 1;
+		while (isspace((unsigned char) *p))
+			p++;
+		/* a value, not a name */
+		if (*p != ':')
+			continue;
+		p++;
+		while (isspace((unsigned char) *p))
+			p++;
+		if (*p++ != '"')
+			return NULL;
+		for (value = q = p; *p && *p != '"'; p++) {
+			if (*p == '\\' && p[1]) {
+				p++;
+				switch (*p) {
+				case 'n': *q++ = '\n'; break;
+				case 't': *q++ = '\t'; break;
+				case 'r': *q++ = '\r'; break;
+				default: *q++ = *p; break;
+				}
+			} else {
+				*q++ = *p;
+			}
+		}
+		if (*p != '"')
+			return NULL;
+		/* the field may end where the next one starts */
+		*q = '\0';
+		*p = '\0';
+		return value;
+	}
+	return NULL;
+}
+
+/*
+ * parse a line of a batch file, a JSON object with method, url, body
+ * and output fields, or the same separated by spaces, "-" for none
+ * returns 1, 0 for an empty or comment line, -1 if invalid
+ */
+static int
+batch_parse(char *line, batch_op *op)
+{
+	static const char *names[4] = { "method", "url", "body", "output" };
+	char *f[4], *copy;
+	int n;
+
+	line[strcspn(line, "\r\n")] = '\0';
+	while (isspace((unsigned char) *line))
+		line++;
+	if (*line == '\0' || *line == '#')
+		return 0;
+
+	memset(f, 0, sizeof(f));
+	if (*line == '{') {
+		/* each field is taken from its own copy, the value is cut
+		 * out of the line */
+		for (n = 0; n < 4; n++) {
+			if ((copy = strdup(line)) == NULL)
+				return -1;
+			if ((f[n] = batch_json(copy, names[n])) != NULL)
+				f[n] = strdup(f[n]);
+			free(copy);
+		}
+	} else {
+		for (n = 0; n < 4 && (f[n] = strtok(n ? NULL : line, " \t")); n++)
+			f[n] = strcmp(f[n], "-") ? strdup(f[n]) : NULL;
+	}
+
+	if (f[0] == NULL || f[1] == NULL) {
+		for (n = 0; n < 4; n++)
+			free(f[n]);
+		return -1;
+	}
+	op->method = f[0];
+	op->url = f[1];
+	op->body = f[2];
+	op->output = f[3];
+	return 1;
+}
+
+/* the end of the data of a PUT or POST without body */
+static int
+batch_nobody(char *buffer, int size, void *arg)
+{
+	return 0;
+}
+
+/* data of a GET without output file, counted and dropped */
+static int
+batch_drop(const char *data, int length, void *arg)
+{
+	return 0;
+}
+
+/*
+ * run an operation of a batch on the ctx of a worker
+ * returns the result of the query, bytes sent and received in *pbytes
+ */
+static int
+batch_run(http_ctx *ctx, batch_op *op, long long *pbytes)
+{
+	char *filename = NULL, *url, *data = NULL;
+	struct stat st;
+	off_t olg = 0;
+	int ret, fd = -1, out = -1, lg = 0, answer;
+
+	*pbytes = 0;
+	if (strcasecmp(op->method, "get") && strcasecmp(op->method, "head") &&
+			strcasecmp(op->method, "delete") &&
+			strcasecmp(op->method, "put") &&
+			strcasecmp(op->method, "post"))
+		return ERR501;
+	/* the output file is only for the data of an answer */
+	answer = (!strcasecmp(op->method, "get") ||
+		!strcasecmp(op->method, "post"));
+	if ((url = strdup(op->url)) == NULL)
+		return ERRMEM;
+	ret = httpmt_parse_url(ctx, url, &filename);
+	free(url);
+	if (ret < 0)
+		return ret;
+
+	if (op->body) {
+		if ((fd = open(op->body, O_RDONLY)) < 0) {
+			httpmt_free(ctx, filename);
+			return ERRNULL;
+		}
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+			*pbytes = st.st_size;
+	}
+	if (answer && op->output && (out = open(op->output, 
+			O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		if (fd >= 0)
+			close(fd);
+		httpmt_free(ctx, filename);
+		return ERRWRFD;
+	}
+
+	if (!strcasecmp(op->method, "get")) {
+		if (out >= 0)
+			ret = httpmt_get_to_fd(ctx, filename, out, &olg, NULL);
+		else
+			ret = httpmt_get_stream(ctx, filename, batch_drop, NULL,
+				NULL, 0, &olg, NULL);
+		*pbytes += olg;
+	} else if (!strcasecmp(op->method, "head")) {
+		ret = httpmt_head(ctx, filename, &lg, NULL);
+	} else if (!strcasecmp(op->method, "delete")) {
+		ret = httpmt_delete(ctx, filename);
+	} else if (!strcasecmp(op->method, "put")) {
+		if (fd >= 0)
+			ret = httpmt_put_fd(ctx, filename, fd, -1, 0, NULL);
+		else
+			ret = httpmt_put_producer(ctx, filename, batch_nobody,
+				NULL, 0, 0, NULL);
+	} else if (!strcasecmp(op->method, "post")) {
+		if (fd >= 0)
+			ret = httpmt_post_fd(ctx, filename, fd, -1, NULL, &data,
+				&lg, NULL);
+		else
+			ret = httpmt_post_producer(ctx, filename, batch_nobody,
+				NULL, 0, NULL, &data, &lg, NULL);
+		if (data && out >= 0 && write(out, data, lg) != lg)
+			ret = ERRWRFD;
+		*pbytes += lg;
+		httpmt_free(ctx, data);
+	}
+
+	if (fd >= 0)
+		close(fd);
+	if (out >= 0)
+		close(out);
+	httpmt_free(ctx, filename);
+	return ret;
+}
+
+/*
+ * worker of a batch, with a ctx of its own whose connections are kept
+ * from an operation to the next
+ */
+static void *
+batch_worker(void *arg)
+{
+	batch *b = (batch *) arg;
+	http_ctx ctx;
+	long long start, bytes;
+	int i, ret;
+
+	memset(&ctx, 0, sizeof(ctx));
+	httpmt_set_keepalive(&ctx, 4, 30);
+	if (b->proxy && httpmt_proxy_url(&ctx, b->proxy) < 0)
+		fprintf(stderr, "invalid http_proxy '%s'\n", b->proxy);
+
+	for (;;) {
+		pthread_mutex_lock(&b->lock);
+		i = b->next < b->n ? b->next++ : -1;
+		pthread_mutex_unlock(&b->lock);
+		if (i < 0)
+			break;
+
+		start = batch_usec();
+		ret = batch_run(&ctx, &b->ops[i], &bytes);
+
+		pthread_mutex_lock(&b->lock);
+		if (ret >= 200 && ret < 300)
+			b->ok++;
+		else
+			b->failed++;
+		b->bytes += bytes;
+		printf("%d\t%s\t%s\t%d\t%lld\t%.3f\n", i + 1, b->ops[i].method,
+			b->ops[i].url, ret, bytes, (batch_usec() - start) / 1000.0);
+		fflush(stdout);
+		pthread_mutex_unlock(&b->lock);
+	}
+
+	httpmt_cleanup(&ctx);
+	return NULL;
+}
+
+static void
+batch_free(batch *b)
+{
+	int i;
+
+	for (i = 0; i < b->n; i++) {
+		free(b->ops[i].method);
+		free(b->ops[i].url);
+		free(b->ops[i].body);
+		free(b->ops[i].output);
+	}
+	free(b->ops);
+}
+
+/*
+ * batch mode: run the operations of a file ("-" for stdin), concurrency
+ * at a time. A line is printed on stdout for each, when it is over:
+ * its number, method, url, result, bytes, milliseconds. The
+ * totals go to stderr.
+ * returns 0 if all succeeded, 6 if some failed, 1 on a bad file
+ */
+static int
+batch_main(char *file, int concurrency)
+{
+	batch b;
+	batch_op *ops;
+	pthread_t tid[BATCH_MAX];
+	FILE *f;
+	char *line = NULL;
+	size_t size = 0;
+	int i, r, lineno = 0, started = 0;
+	long long start;
+	double secs;
+
+	memset(&b, 0, sizeof(b));
+	if (!strcmp(file, "-"))
+		f = stdin;
+	else if ((f = fopen(file, "r")) == NULL) {
+		perror(file);
+		return 1;
+	}
+	while (getline(&line, &size, f) > 0) {
+		lineno++;
+		if (b.n % 64 == 0) {
+			if ((ops = (batch_op *) realloc(b.ops,
+					(b.n + 64) * sizeof(batch_op))) == NULL) {
+				fprintf(stderr, "out of memory\n");
+				free(line);
+				if (f != stdin)
+					fclose(f);
+				batch_free(&b);
+				return 1;
+			}
+			b.ops = ops;
+		}
+		if ((r = batch_parse(line, &b.ops[b.n])) < 0)
+			fprintf(stderr, "%s:%d: invalid line ignored\n", file,
+				lineno);
+		else if (r > 0)
+			b.n++;
+	}
+	free(line);
+	if (f != stdin)
+		fclose(f);
+
+	b.proxy = getenv("http_proxy");
+	pthread_mutex_init(&b.lock, NULL);
+	if (concurrency > b.n)
+		concurrency = b.n;
+
+	start = batch_usec();
+	for (i = 0; i < concurrency; i++) {
+		if (pthread_create(&tid[i], NULL, batch_worker, &b) != 0)
+			break;
+		started++;
+	}
+	/* no thread at all: the caller's runs them */
+	if (started == 0 && b.n > 0)
+		batch_worker(&b);
+	for (i = 0; i < started; i++)
+		pthread_join(tid[i], NULL);
+	secs = (batch_usec() - start) / 1e6;
+
+	fprintf(stderr, "%d requests, %d ok, %d failed, %lld bytes in %.3f s, "
+		"%.1f requests/s, %.3f MB/s\n", b.n, b.ok, b.failed, b.bytes,
+		secs, secs > 0 ? b.n / secs : 0.0,
+		secs > 0 ? b.bytes / secs / 1e6 : 0.0);
+
+	batch_free(&b);
+	pthread_mutex_destroy(&b.lock);
+	return b.failed ? 6 : 0;
+}
+
 int main(int argc,char* argv[]) 
 {
-	int  ret,lg,blocksize,r,i;
+	int  ret,lg,i;
+	off_t olg;
 	char typebuf[70];
 	char *data=NULL,*filename=NULL,*proxy=NULL;
 	int data_len = 0;
@@ -60,8 +431,19 @@ int main(int argc,char* argv[])
 		DOPOST
 	} todo=ERR;
 	
+	if ((argc==3 || argc==4) && !strcasecmp(argv[1],"batch")) {
+		i = argc==4 ? atoi(argv[3]) : BATCH_CONCURRENCY;
+		if (i<1 || i>BATCH_MAX) {
+			fprintf(stderr,"concurrency must be 1 to %d\n",BATCH_MAX);
+			return 1;
+		}
+		return batch_main(argv[2],i);
+	}
+
 	if (argc!=3) {
-		fprintf(stderr,"usage: http <cmd> <url>\n\tby <L@Demailly.com>\n");
+		fprintf(stderr,"usage: http <cmd> <url>\n"
+			"       http batch <file> [<concurrency>]\n"
+			"\tby <L@Demailly.com>\n");
 		return 1;
 	}
 
@@ -105,40 +487,17 @@ int main(int argc,char* argv[])
 	switch (todo) {
 	/* *** PUT  *** */
 	case DOPUT:
-		fprintf(stderr,"reading stdin...\n");
-		/* read stdin into memory */
-		blocksize=16384;
-		lg=0;  
-
-		if (!(data=(char *) malloc(blocksize))) {
-			return 3;
-		}
-
-		while (1) {
-			r=read(0,data+lg,blocksize-lg);
-			if (r<=0) break; 
-			lg+=r;
-			if ((3*lg/2)>blocksize) {
-				blocksize *= 4;
-				fprintf(stderr,
-				"read to date: %9d bytes, reallocating buffer to %9d\n",
-				lg,blocksize);	
-				if (!(data=(char *) realloc(data,blocksize))) {
-					return 4;
-				}
-			}
-		}
-
-		fprintf(stderr,"read %d bytes\n",lg);
-		ret=http_put(filename,data,lg,0,NULL);
+		/* stdin is sent as it is read */
+		fprintf(stderr,"sending stdin...\n");
+		ret=http_put_fd(filename,0,-1,0,NULL);
 		fprintf(stderr,"res=%d\n",ret);
 		break;
 	/* *** GET  *** */
 	case DOGET:
-		ret=http_get(filename,&data,&lg,typebuf);
-		fprintf(stderr,"res=%d,type='%s',lg=%d\n",ret,typebuf,lg);
-		fwrite(data,lg,1,stdout);
-		fprintf(stderr, "%s\n", data);
+		/* data goes straight to stdout as it is received */
+		ret=http_get_to_fd(filename,1,&olg,typebuf);
+		fprintf(stderr,"res=%d,type='%s',lg=%lld\n",ret,typebuf,
+			(long long) olg);
 		break;
 	/* *** HEAD  *** */
 	case DOHEA:
@@ -163,14 +522,14 @@ int main(int argc,char* argv[])
 	}
 	
 	if (type) {
-		free(type);
+		http_free(type);
 	}
 
 	if (data) {
-		 free(data);
+		 http_free(data);
 	}
 
-	free(filename);
+	http_free(filename);
 	 
 	return ( (ret==201) || (ret==200) ) ? 0 : ret;
 }
@@ -0,0 +1,560 @@
+/*
+ *  Http mini lib benchmark, against an in process loopback server
+ *  see LICENSE for terms, conditions and DISCLAIMER OF ALL WARRANTIES
+ *
+ *  Runs GET/HEAD/PUT/POST/DELETE workloads through the http_* and the
+ *  httpmt_* functions, for several body sizes, answers with or without
+ *  Content-Length and several threads, and prints one JSON object per
+ *  workload on stdout. GET answers are compared with the data sent, a
+ *  wrong one counts as an error:
+ *
+ *  {"api":"httpmt","method":"GET","size":65536,"framing":"length",
+ *   "threads":4,"requests":1000,"errors":0,"seconds":0.084,
+ *   "req_per_s":11904.8,"mb_per_s":780.2,"p50_us":301.2,"p99_us":622.0,
+ *   "p999_us":1040.5,"allocs_per_req":3.00}
+ *
+ *  usage: http_bench [-n requests] [-b bytes] [-s sizes] [-t threads] [-k]
+ *	-n	requests per workload (default 1000)
+ *	-b	at most this many body bytes per workload (default 256m)
+ *	-s	body sizes, comma separated, k/m/g suffixes
+ *		(default 0,1k,64k,1m,16m, up to 1g)
+ *	-t	thread counts of the httpmt_* workloads (default 1,4), the
+ *		http_* functions share one ctx and run on one thread
+ *	-k	no keep-alive
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "http_lib.h"
+
+#define MAXSIZES 16
+#define MAXTHREADS 64
+/* GET answers bigger than this are checked as they come, not kept */
+#define BIGBODY (64L << 20)
+/* loopback server buffers */
+#define SRVBUF 65536
+
+enum { GET, HEAD, PUT, POST, DELETE };
+static const char *methods[] = { "GET", "HEAD", "PUT", "POST", "DELETE" };
+enum { LENGTH, EOFCLOSE };
+static const char *framings[] = { "length", "eof" };
+
+/* a workload */
+typedef struct {
+	int method;
+	int mt;			/* httpmt_* or http_* functions */
+	long size;
+	int framing;
+	int threads;
+	int count;		/* requests, for all threads */
+} bench_run;
+
+/* a thread of a workload */
+typedef struct {
+	bench_run *run;
+	pthread_t tid;
+	http_ctx ctx;
+	int count;
+	double *lat;		/* latencies, in microseconds */
+	int errors;
+	long allocs;
+	long bytes;
+} bench_thread;
+
+static int port;
+static int keepalive = 1;
+static char *body;		/* PUT and POST data */
+static char pattern[SRVBUF];	/* answers data */
+
+/*
+ * Loopback server
+ * /len/N answers N bytes with a Content-Length, /eof/N without and
+ * closes the connection; PUT answers 201, DELETE an empty 200, request
+ * bodies are dropped.
+ */
+
+static int
+srv_send(int fd, const char *p, long n)
+{
+	long r;
+
+	while (n > 0) {
+		if ((r = send(fd, p, n > SRVBUF ? SRVBUF : n, MSG_NOSIGNAL)) <= 0)
+			return -1;
+		p += r;
+		n -= r;
+	}
+	return 0;
+}
+
+static void *
+srv_conn(void *arg)
+{
+	int fd = (int) (long) arg;
+	char *buf, *end, *p, head[256], method[16], mode[8];
+	long have = 0, n, skip, size;
+	int close_it, r, one = 1;
+
+	/* the header and small bodies are separate writes */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	buf = (char *) malloc(SRVBUF + 1);
+	while (buf) {
+		/* header */
+		buf[have] = '\0';
+		while ((end = strstr(buf, "\r\n\r\n")) == NULL) {
+			if (have == SRVBUF ||
+			    (r = recv(fd, buf + have, SRVBUF - have, 0)) <= 0)
+				goto out;
+			have += r;
+			buf[have] = '\0';
+		}
+		end += 4;
+		size = 0;
+		mode[0] = '\0';
+		if (sscanf(buf, "%15s /%7[a-z]/%ld", method, mode, &size) < 1)
+			goto out;
+		skip = 0;
+		if ((p = strcasestr(buf, "\ncontent-length:")) && p < end)
+			skip = atol(p + 16);
+		close_it = ((p = strcasestr(buf, "\nconnection: close")) &&
+				p < end) || !strcmp(mode, "eof");
+
+		/* drop the request body */
+		n = have - (end - buf);
+		if (n >= skip) {
+			memmove(buf, end + skip, n - skip);
+			have = n - skip;
+		} else {
+			for (skip -= n, have = 0; skip > 0; skip -= r)
+				if ((r = recv(fd, buf, skip > SRVBUF ?
+						SRVBUF : skip, 0)) <= 0)
+					goto out;
+		}
+
+		/* answer */
+		if (!strcmp(method, "PUT")) {
+			n = snprintf(head, sizeof(head), "HTTP/1.1 201 Created\r\n"
+				"Content-Length: 0\r\n%s\r\n",
+				close_it ? "Connection: close\r\n" : "");
+			size = 0;
+		} else if (!strcmp(method, "DELETE")) {
+			n = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n"
+				"Content-Length: 0\r\n%s\r\n",
+				close_it ? "Connection: close\r\n" : "");
+			size = 0;
+		} else if (!strcmp(mode, "eof")) {
+			n = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n"
+				"Content-Type: application/octet-stream\r\n"
+				"Connection: close\r\n\r\n");
+		} else {
+			n = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n"
+				"Content-Type: application/octet-stream\r\n"
+				"Content-Length: %ld\r\n%s\r\n", size,
+				close_it ? "Connection: close\r\n" : "");
+		}
+		if (!strcmp(method, "HEAD"))
+			size = 0;
+		if (srv_send(fd, head, n) < 0)
+			break;
+		for (; size > 0; size -= n) {
+			n = size > SRVBUF ? SRVBUF : size;
+			if (srv_send(fd, pattern, n) < 0)
+				goto out;
+		}
+		if (close_it)
+			break;
+	}
+ out:
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+static void *
+srv_accept(void *arg)
+{
+	int lfd = (int) (long) arg, fd;
+	pthread_t tid;
+
+	while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+		if (pthread_create(&tid, NULL, srv_conn, (void *) (long) fd))
+			close(fd);
+		else
+			pthread_detach(tid);
+	}
+	return NULL;
+}
+
+/* starts the server on 127.0.0.1, returns its port or -1 */
+static int
+srv_start(void)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	pthread_t tid;
+	int lfd, one = 1;
+
+	if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(lfd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+	    listen(lfd, 1024) < 0 ||
+	    getsockname(lfd, (struct sockaddr *) &sin, &len) < 0 ||
+	    pthread_create(&tid, NULL, srv_accept, (void *) (long) lfd)) {
+		close(lfd);
+		return -1;
+	}
+	pthread_detach(tid);
+	return ntohs(sin.sin_port);
+}
+
+/*
+ * Client
+ */
+
+/* allocator hooks counting the allocations of a ctx */
+static void *
+count_malloc(size_t size, void *opaque)
+{
+	__atomic_add_fetch((long *) opaque, 1, __ATOMIC_RELAXED);
+	return malloc(size);
+}
+
+static void *
+count_realloc(void *ptr, size_t size, void *opaque)
+{
+	__atomic_add_fetch((long *) opaque, 1, __ATOMIC_RELAXED);
+	return realloc(ptr, size);
+}
+
+static void
+count_free(void *ptr, void *opaque)
+{
+	free(ptr);
+}
+
+/* tells if data is the answer data from offset off, see srv_conn */
+static int
+check_data(const char *data, long off, long n)
+{
+	long k;
+
+	for (; n > 0; off += k, data += k, n -= k) {
+		k = SRVBUF - off % SRVBUF;
+		if (k > n)
+			k = n;
+		if (memcmp(data, pattern + off % SRVBUF, k))
+			return 0;
+	}
+	return 1;
+}
+
+/* http_get_stream callback of large GET answers, checked as they come */
+static int
+check_piece(const char *data, int length, void *arg)
+{
+	long *off = (long *) arg;
+
+	if (!check_data(data, *off, length))
+		return 1;
+	*off += length;
+	return 0;
+}
+
+static double
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* one request of a workload, returns the body bytes moved or -1 if it
+ * failed or the data is wrong */
+static long
+bench_one(bench_thread *t, char *filename)
+{
+	bench_run *run = t->run;
+	http_ctx *ctx = run->mt ? &t->ctx : NULL;
+	char typebuf[70], *data = NULL, *type = NULL;
+	http_retcode ret;
+	off_t olength;
+	int length = -1;
+	long n = -1, off;
+
+	switch (run->method) {
+	case GET:
+		if (run->size > BIGBODY) {
+			off = 0;
+			ret = ctx ? httpmt_get_stream(ctx, filename, check_piece,
+					&off, NULL, 0, &olength, typebuf) :
+				http_get_stream(filename, check_piece, &off,
+					NULL, 0, &olength, typebuf);
+			if (ret == 200 && olength == run->size)
+				n = olength;
+			break;
+		}
+		ret = ctx ? httpmt_get(ctx, filename, &data, &length, typebuf) :
+			http_get(filename, &data, &length, typebuf);
+		if (ret == 200 && length == run->size &&
+				check_data(data, 0, length))
+			n = length;
+		break;
+	case HEAD:
+		ret = ctx ? httpmt_head(ctx, filename, &length, typebuf) :
+			http_head(filename, &length, typebuf);
+		if (ret == 200)
+			n = 0;
+		break;
+	case PUT:
+		ret = ctx ? httpmt_put(ctx, filename, body, run->size, 1, NULL) :
+			http_put(filename, body, run->size, 1, NULL);
+		if (ret == 201)
+			n = run->size;
+		break;
+	case POST:
+		ret = ctx ? httpmt_post(ctx, filename, body, run->size, NULL,
+				&data, &length, &type) :
+			http_post(filename, body, run->size, NULL, &data, &length,
+				&type);
+		if (ret == 200)
+			n = run->size;
+		break;
+	case DELETE:
+		ret = ctx ? httpmt_delete(ctx, filename) : http_delete(filename);
+		if (ret == 200)
+			n = 0;
+		break;
+	}
+
+	if (ctx) {
+		httpmt_free(ctx, data);
+		httpmt_free(ctx, type);
+	} else {
+		http_free(data);
+		http_free(type);
+	}
+	return n;
+}
+
+static void *
+bench_thread_run(void *arg)
+{
+	bench_thread *t = (bench_thread *) arg;
+	bench_run *run = t->run;
+	char url[128], *filename = NULL;
+	double start;
+	long n;
+	int i;
+
+	/* GET/HEAD/POST answers have the size asked, PUT/DELETE none */
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/%s/%ld", port,
+		run->framing == EOFCLOSE ? "eof" : "len",
+		run->method == POST ? 0 : run->size);
+
+	if (run->mt) {
+		httpmt_set_allocator(&t->ctx, count_malloc, count_realloc,
+			count_free, &t->allocs);
+		httpmt_set_keepalive(&t->ctx, keepalive, 0);
+		httpmt_parse_url(&t->ctx, url, &filename);
+	} else {
+		http_set_allocator(count_malloc, count_realloc, count_free,
+			&t->allocs);
+		http_set_keepalive(keepalive, 0);
+		http_parse_url(url, &filename);
+	}
+
+	t->allocs = 0;
+	for (i = 0; i < t->count; i++) {
+		start = now_us();
+		n = bench_one(t, filename);
+		t->lat[i] = now_us() - start;
+		if (n < 0)
+			t->errors++;
+		else
+			t->bytes += n;
+	}
+
+	if (run->mt) {
+		httpmt_free(&t->ctx, filename);
+		httpmt_cleanup(&t->ctx);
+	} else {
+		http_free(filename);
+		http_set_keepalive(0, 0);
+	}
+	return NULL;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+bench(bench_run *run)
+{
+	bench_thread t[MAXTHREADS];
+	double *lat, start, secs;
+	long allocs = 0, bytes = 0;
+	int i, j, n = 0, errors = 0;
+
+	lat = (double *) malloc(run->count * sizeof(double));
+	if (lat == NULL)
+		return;
+
+	memset(t, 0, sizeof(t));
+	start = now_us();
+	for (i = 0; i < run->threads; i++) {
+		t[i].run = run;
+		t[i].count = run->count / run->threads +
+			(i < run->count % run->threads);
+		t[i].lat = lat + n;
+		n += t[i].count;
+		pthread_create(&t[i].tid, NULL, bench_thread_run, &t[i]);
+	}
+	for (i = 0; i < run->threads; i++) {
+		pthread_join(t[i].tid, NULL);
+		errors += t[i].errors;
+		allocs += t[i].allocs;
+		bytes += t[i].bytes;
+	}
+	secs = (now_us() - start) / 1e6;
+
+	qsort(lat, n, sizeof(double), cmp_double);
+	j = n - 1;
+	printf("{\"api\":\"%s\",\"method\":\"%s\",\"size\":%ld,"
+		"\"framing\":\"%s\",\"threads\":%d,\"requests\":%d,"
+		"\"errors\":%d,\"seconds\":%.3f,\"req_per_s\":%.1f,"
+		"\"mb_per_s\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+		"\"p999_us\":%.1f,\"allocs_per_req\":%.2f}\n",
+		run->mt ? "httpmt" : "http", methods[run->method], run->size,
+		framings[run->framing], run->threads, n, errors, secs,
+		n / secs, bytes / secs / 1e6, lat[n / 2], lat[n * 99 / 100],
+		lat[n * 999 / 1000 < j ? n * 999 / 1000 : j],
+		(double) allocs / n);
+	fflush(stdout);
+	free(lat);
+}
+
+/* parses a comma separated list of sizes with k/m/g suffixes */
+static int
+parse_list(char *s, long *list, int max)
+{
+	char *end;
+	int n = 0;
+
+	while (*s && n < max) {
+		list[n] = strtol(s, &end, 10);
+		switch (*end) {
+		case 'k': case 'K': list[n] <<= 10; end++; break;
+		case 'm': case 'M': list[n] <<= 20; end++; break;
+		case 'g': case 'G': list[n] <<= 30; end++; break;
+		}
+		if (end == s || list[n] < 0 || list[n] > (1L << 30))
+			return -1;
+		n++;
+		s = *end == ',' ? end + 1 : end;
+		if (*end && *end != ',')
+			return -1;
+	}
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	long sizes[MAXSIZES] = { 0, 1L << 10, 64L << 10, 1L << 20, 16L << 20 };
+	long threads[MAXSIZES] = { 1, 4 };
+	long budget = 256L << 20, maxsize = 0;
+	int nsizes = 5, nthreads = 2, count = 1000;
+	int c, m, s, f, th, mt;
+	bench_run run;
+
+	while ((c = getopt(argc, argv, "n:b:s:t:k")) != -1) {
+		switch (c) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'b':
+			if (parse_list(optarg, &budget, 1) != 1)
+				count = 0;
+			break;
+		case 's':
+			nsizes = parse_list(optarg, sizes, MAXSIZES);
+			break;
+		case 't':
+			nthreads = parse_list(optarg, threads, MAXSIZES);
+			break;
+		case 'k':
+			keepalive = 0;
+			break;
+		default:
+			count = 0;
+		}
+	}
+	for (th = 0; th < nthreads; th++)
+		if (threads[th] < 1 || threads[th] > MAXTHREADS)
+			nthreads = -1;
+	if (count <= 0 || nsizes <= 0 || nthreads <= 0 || optind != argc) {
+		fprintf(stderr, "usage: http_bench [-n requests] [-b bytes] "
+			"[-s sizes] [-t threads] [-k]\n");
+		return 1;
+	}
+
+	for (s = 0; s < nsizes; s++)
+		if (sizes[s] > maxsize)
+			maxsize = sizes[s];
+	/* untouched pages are not even allocated */
+	body = (char *) calloc(1, maxsize + 1);
+	for (c = 0; c < SRVBUF; c++)
+		pattern[c] = (c * 7 + 3) % 251;
+	if (body == NULL || (port = srv_start()) < 0) {
+		perror("http_bench");
+		return 2;
+	}
+
+	for (mt = 0; mt < 2; mt++)
+	for (m = GET; m <= DELETE; m++)
+	for (s = 0; s < nsizes; s++)
+	for (f = LENGTH; f <= EOFCLOSE; f++)
+	for (th = 0; th < (mt ? nthreads : 1); th++) {
+		run.method = m;
+		run.mt = mt;
+		run.size = sizes[s];
+		run.framing = f;
+		run.threads = mt ? threads[th] : 1;
+		/* HEAD and DELETE have no body, PUT answers have no data,
+		 * http_post needs some */
+		if ((m == HEAD || m == DELETE) && s > 0)
+			continue;
+		if (m == POST && run.size == 0)
+			continue;
+		if ((m == HEAD || m == PUT || m == DELETE) && f == EOFCLOSE)
+			continue;
+		run.count = count;
+		if (run.size > 0 && budget / run.size < count)
+			run.count = budget / run.size;
+		if (run.count < run.threads)
+			run.count = run.threads;
+		bench(&run);
+	}
+
+	return 0;
+}
@@ -0,0 +1,535 @@
+/*
+ *  Http put/get/post mini lib
+ *  response cache
+ *  see LICENSE for terms, conditions and DISCLAIMER OF ALL WARRANTIES
+ *
+ * Description : answers of http_get kept in memory, see http_cache_new.
+ *
+ * An answer is fresh for its Cache-Control max-age less its Age, or up
+ * to its Expires date, and returned without asking the server. Once
+ * stale, it is asked again with If-None-Match and If-Modified-Since
+ * from its ETag and Last-Modified date, and a 304 answer returns it
+ * without the body being sent again.
+ *
+ * Like the resolver cache, entries are split in shards, each with its
+ * own lock, hash table and least recently used list, so that threads
+ * getting different ressources rarely wait for each other. Each shard
+ * holds at most a part of the bytes of the cache, the least recently
+ * used entries are dropped above.
+ */
+
+#include <sys/types.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "http_lib.h"
+#include "http_private.h"
+
+#define CACHE_SHARDS 16
+/* hash chains of a shard */
+#define CACHE_BUCKETS 256
+
+typedef struct _cache_entry {
+	char *key;		/* server:port/filename */
+	unsigned hash;
+	char *data;		/* the body, malloc(3)ed */
+	int length;
+	char type[MAXTYPE];
+	char *etag;		/* validators, NULL if none */
+	char *modified;
+	time_t expires;		/* fresh until then, monotonic seconds */
+	size_t size;		/* counted against the size of the shard */
+	struct _cache_entry *next;	/* in its hash chain */
+	struct _cache_entry *newer;	/* least recently used list */
+	struct _cache_entry *older;
+} cache_entry;
+
+typedef struct {
+	pthread_mutex_t lock;
+	cache_entry *bucket[CACHE_BUCKETS];
+	cache_entry *newest;
+	cache_entry *oldest;
+	size_t bytes;
+	int count;
+	long long hits, misses, revalidations, not_modified, stored, evicted;
+} cache_shard;
+
+struct _http_cache {
+	size_t shard_max;	/* bytes held by a shard at most */
+	cache_shard shards[CACHE_SHARDS];
+};
+
+static time_t
+cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/* FNV-1a of the key */
+static unsigned
+cache_hash(const char *key)
+{
+	unsigned h = 2166136261u;
+
+	for (; *key; key++)
+		h = (h ^ (unsigned char) *key) * 16777619u;
+	return h;
+}
+
+static cache_shard *
+cache_shard_of(http_cache *cache, unsigned hash)
+{
+	return &cache->shards[hash % CACHE_SHARDS];
+}
+
+static cache_entry **
+cache_chain(cache_shard *sh, unsigned hash)
+{
+	return &sh->bucket[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+}
+
+static cache_entry *
+cache_find(cache_shard *sh, const char *key, unsigned hash)
+{
+	cache_entry *e;
+
+	for (e = *cache_chain(sh, hash); e; e = e->next)
+		if (e->hash == hash && !strcmp(e->key, key))
+			return e;
+	return NULL;
+}
+
+static void
+cache_entry_free(cache_entry *e)
+{
+	free(e->key);
+	free(e->data);
+	free(e->etag);
+	free(e->modified);
+	free(e);
+}
+
+static void
+cache_unlink_lru(cache_shard *sh, cache_entry *e)
+{
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		sh->newest = e->older;
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		sh->oldest = e->newer;
+	e->newer = e->older = NULL;
+}
+
+/* e, not in the list, becomes the most recently used entry */
+static void
+cache_push_lru(cache_shard *sh, cache_entry *e)
+{
+	e->older = sh->newest;
+	if (sh->newest)
+		sh->newest->newer = e;
+	sh->newest = e;
+	if (sh->oldest == NULL)
+		sh->oldest = e;
+}
+
+/* e becomes the most recently used entry of its shard */
+static void
+cache_touch(cache_shard *sh, cache_entry *e)
+{
+	if (sh->newest == e)
+		return;
+	cache_unlink_lru(sh, e);
+	cache_push_lru(sh, e);
+}
+
+/* take an entry out of its shard and free it */
+static void
+cache_remove(cache_shard *sh, cache_entry *e)
+{
+	cache_entry **pe;
+
+	for (pe = cache_chain(sh, e->hash); *pe != e; pe = &(*pe)->next)
+		;
+	*pe = e->next;
+	cache_unlink_lru(sh, e);
+	sh->bytes -= e->size;
+	sh->count--;
+	cache_entry_free(e);
+}
+
+/*
+ * conditional header lines revalidating e, "" if it has no validator or
+ * they do not fit
+ *	char *cond	placeholder, MAXCOND long
+ */
+static void
+cache_cond(cache_entry *e, char *cond)
+{
+	int n;
+
+	n = snprintf(cond, MAXCOND, "%s%s%s%s%s%s",
+		e->etag ? "If-None-Match: " : "", e->etag ? e->etag : "",
+		e->etag ? "\r\n" : "",
+		e->modified ? "If-Modified-Since: " : "",
+		e->modified ? e->modified : "", e->modified ? "\r\n" : "");
+	if (n < 0 || n >= (int) MAXCOND)
+		cond[0] = '\0';
+}
+
+/* body of e copied in memory of ctx, for http_get */
+static http_retcode
+cache_copy(http_ctx *ctx, cache_entry *e, char **pdata, int *plength,
+	char *typebuf)
+{
+	if (!(*pdata = (char *) http_alloc(ctx, e->length > 0 ? e->length : 1)))
+		return ERRMEM;
+	memcpy(*pdata, e->data, e->length);
+	if (plength)
+		*plength = e->length;
+	if (typebuf)
+		strcpy(typebuf, e->type);
+	return OK200;
+}
+
+/*
+ * look for directive name in a Cache-Control value, its value is set in
+ * *pvalue if it has one and pvalue is not NULL
+ * returns 1 if found, 0 if not
+ */
+static int
+cache_directive(const char *cc, const char *name, long *pvalue)
+{
+	size_t len = strlen(name);
+	const char *p;
+
+	for (p = cc; *p; ) {
+		while (*p == ',' || isspace((unsigned char) *p))
+			p++;
+		if (!strncasecmp(p, name, len) && (p[len] == '\0' ||
+				p[len] == '=' || p[len] == ',' ||
+				isspace((unsigned char) p[len]))) {
+			if (pvalue && p[len] == '=')
+				*pvalue = strtol(p + len + 1 + (p[len + 1] == '"'),
+					NULL, 10);
+			return 1;
+		}
+		while (*p && *p != ',')
+			p++;
+	}
+	return 0;
+}
+
+/* HTTP date (RFC 1123 form) to a time, -1 if it can't be parsed */
+static time_t
+cache_date(const char *s)
+{
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	if (s == NULL || strptime(s, "%a, %d %b %Y %H:%M:%S", &tm) == NULL)
+		return -1;
+	return timegm(&tm);
+}
+
+/*
+ * seconds the last answer of ctx stays fresh: its Cache-Control s-maxage
+ * or max-age less its Age, or from its Date to its Expires date, 0 if it
+ * must be revalidated at once
+ * returns -1 if it must not be kept: the caches are shared by several
+ * ctx, answers private to a user or to the credentials of ctx are not
+ * kept unless public
+ */
+extern long
+http_cache_lifetime(http_ctx *ctx)
+{
+	char *v;
+	long age = 0, life = 0;
+	time_t expires, date;
+
+	v = httpmt_header_known(ctx, HTTP_H_VARY);
+	if (v && strchr(v, '*'))
+		return -1;
+	if ((v = httpmt_header_known(ctx, HTTP_H_AGE)) != NULL &&
+			(age = strtol(v, NULL, 10)) < 0)
+		age = 0;
+
+	v = httpmt_header_known(ctx, HTTP_H_CACHE_CONTROL);
+	if (ctx->b64_auth && (v == NULL || (!cache_directive(v, "public",
+			NULL) && !cache_directive(v, "s-maxage", NULL))))
+		return -1;
+	if (v != NULL) {
+		if (cache_directive(v, "no-store", NULL) ||
+				cache_directive(v, "private", NULL))
+			return -1;
+		if (cache_directive(v, "no-cache", NULL))
+			return 0;
+		if (cache_directive(v, "s-maxage", &life) ||
+				cache_directive(v, "max-age", &life))
+			return life > age ? life - age : 0;
+	}
+
+	if ((v = httpmt_header_known(ctx, HTTP_H_EXPIRES)) != NULL) {
+		expires = cache_date(v);
+		date = cache_date(httpmt_header_known(ctx, HTTP_H_DATE));
+		if (date < 0)
+			date = time(NULL);
+		if (expires > date + age)
+			return (long) (expires - date - age);
+	}
+	return 0;
+}
+
+/* a validator of the last answer worth keeping, NULL if none */
+extern char *
+http_cache_validator(http_ctx *ctx, http_hdr id)
+{
+	char *v = httpmt_header_known(ctx, id);
+
+	if (v == NULL || *v == '\0' || strlen(v) >= MAXVALIDATOR)
+		return NULL;
+	return v;
+}
+
+/*
+ * key of filename on the server of ctx
+ * returns 1, or 0 if it is too long to be cached
+ *	char *key	placeholder, MAXBUF long
+ */
+extern int
+http_cache_key(http_ctx *ctx, char *filename, char *key)
+{
+	int n;
+
+	n = snprintf(key, MAXBUF, "%s:%d/%s",
+		ctx->server ? ctx->server : SERVER_DEFAULT, ctx->port, filename);
+	return n > 0 && n < MAXBUF;
+}
+
+/*
+ * look for the answer of a GET in the cache of ctx
+ * returns OK200 with a copy of a fresh answer as http_get, OK0 if there
+ * is none, with the header lines of a conditional request in cond if a
+ * stale one can be revalidated ("" if not), or ERRMEM
+ *
+ *	char *key	see http_cache_key
+ *	char *cond	placeholder, MAXCOND long
+ */
+extern http_retcode
+http_cache_lookup(http_ctx *ctx, char *key, char **pdata, int *plength,
+		char *typebuf, char *cond)
+{
+	http_cache *cache = ctx->cache;
+	cache_shard *sh;
+	cache_entry *e;
+	unsigned hash;
+	http_retcode ret = OK0;
+
+	cond[0] = '\0';
+	hash = cache_hash(key);
+	sh = cache_shard_of(cache, hash);
+
+	pthread_mutex_lock(&sh->lock);
+	if ((e = cache_find(sh, key, hash)) == NULL) {
+		sh->misses++;
+	} else if (e->expires > cache_now()) {
+		cache_touch(sh, e);
+		ret = cache_copy(ctx, e, pdata, plength, typebuf);
+		sh->hits++;
+	} else {
+		cache_cond(e, cond);
+		sh->revalidations++;
+	}
+	pthread_mutex_unlock(&sh->lock);
+	return ret;
+}
+
+/*
+ * the server answered 304 to the conditional request cond, the header of
+ * its answer is the last one of ctx
+ * returns OK200 with a copy of the cached answer, OK0 if it was dropped
+ * or replaced meanwhile and must be asked again, or ERRMEM
+ */
+extern http_retcode
+http_cache_revalidated(http_ctx *ctx, char *key, char *cond, char **pdata,
+		int *plength, char *typebuf)
+{
+	http_cache *cache = ctx->cache;
+	char sent[MAXCOND];
+	cache_shard *sh;
+	cache_entry *e;
+	unsigned hash;
+	http_retcode ret = OK0;
+	long life;
+
+	hash = cache_hash(key);
+	sh = cache_shard_of(cache, hash);
+	life = http_cache_lifetime(ctx);
+
+	pthread_mutex_lock(&sh->lock);
+	if ((e = cache_find(sh, key, hash)) != NULL) {
+		cache_cond(e, sent);
+		if (!strcmp(sent, cond)) {
+			e->expires = cache_now() + (life > 0 ? life : 0);
+			cache_touch(sh, e);
+			ret = cache_copy(ctx, e, pdata, plength, typebuf);
+			sh->not_modified++;
+		}
+	}
+	pthread_mutex_unlock(&sh->lock);
+	return ret;
+}
+
+/*
+ * keep the answer of a GET in the cache of ctx, if its header (the last
+ * one of ctx) allows it. Any older answer of key is dropped.
+ *
+ *	char *data	the body, copied
+ *	int length	its length
+ *	char *type	its type
+ */
+extern void
+http_cache_store(http_ctx *ctx, char *key, char *data, int length,
+		char *type)
+{
+	http_cache *cache = ctx->cache;
+	cache_shard *sh;
+	cache_entry *e, *old;
+	char *etag, *modified;
+	unsigned hash;
+	long life;
+
+	hash = cache_hash(key);
+	sh = cache_shard_of(cache, hash);
+
+	e = NULL;
+	life = http_cache_lifetime(ctx);
+	etag = http_cache_validator(ctx, HTTP_H_ETAG);
+	modified = http_cache_validator(ctx, HTTP_H_LAST_MODIFIED);
+	/* useless if it can't be returned nor revalidated */
+	if (life > 0 || (life == 0 && (etag || modified))) {
+		e = (cache_entry *) calloc(1, sizeof(cache_entry));
+		if (e == NULL)
+			goto drop;
+		e->hash = hash;
+		e->length = length;
+		e->size = sizeof(cache_entry) + strlen(key) + length;
+		if (e->size > cache->shard_max ||
+				(e->key = strdup(key)) == NULL ||
+				(e->data = (char *) malloc(length > 0 ? length : 1)) == NULL ||
+				(etag && (e->etag = strdup(etag)) == NULL) ||
+				(modified && (e->modified = strdup(modified)) == NULL)) {
+			cache_entry_free(e);
+			e = NULL;
+			goto drop;
+		}
+		memcpy(e->data, data, length);
+		if (type) {
+			strncpy(e->type, type, MAXTYPE - 1);
+			e->type[MAXTYPE - 1] = '\0';
+		}
+		e->expires = cache_now() + life;
+	}
+
+drop:
+	pthread_mutex_lock(&sh->lock);
+	if ((old = cache_find(sh, key, hash)) != NULL)
+		cache_remove(sh, old);
+	if (e) {
+		while (sh->oldest && sh->bytes + e->size > cache->shard_max) {
+			cache_remove(sh, sh->oldest);
+			sh->evicted++;
+		}
+		e->next = *cache_chain(sh, hash);
+		*cache_chain(sh, hash) = e;
+		cache_push_lru(sh, e);
+		sh->bytes += e->size;
+		sh->count++;
+		sh->stored++;
+	}
+	pthread_mutex_unlock(&sh->lock);
+}
+
+/*
+ * New response cache
+ *
+ * The answers of http_get are kept in memory by a cache set on a ctx
+ * with http_set_cache, it can be shared by the ctx of several threads.
+ * Only answers with a Cache-Control max-age, an Expires date, an ETag
+ * or a Last-Modified date are kept, and never those with no-store or
+ * private, nor those to a ctx with credentials unless public.
+ * The data is copied with malloc(3), not the allocator of a ctx.
+ *
+ * returns the cache or NULL if it can't be allocated
+ *
+ *	size_t max_bytes	bytes of data kept at most, the least
+ *				recently used answers are dropped above
+ */
+extern http_cache *
+http_cache_new(size_t max_bytes)
+{
+	http_cache *cache;
+	int i;
+
+	if ((cache = (http_cache *) calloc(1, sizeof(http_cache))) == NULL)
+		return NULL;
+	cache->shard_max = max_bytes / CACHE_SHARDS;
+	for (i = 0; i < CACHE_SHARDS; i++)
+		pthread_mutex_init(&cache->shards[i].lock, NULL);
+	return cache;
+}
+
+/**
+ * free a response cache, no ctx must use it anymore
+ */
+extern void
+http_cache_free(http_cache *cache)
+{
+	int i;
+
+	if (cache == NULL)
+		return;
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		while (cache->shards[i].oldest)
+			cache_remove(&cache->shards[i], cache->shards[i].oldest);
+		pthread_mutex_destroy(&cache->shards[i].lock);
+	}
+	free(cache);
+}
+
+/**
+ * counters of a response cache, since it was created
+ */
+extern void
+http_cache_get_stats(http_cache *cache, http_cache_stats *stats)
+{
+	cache_shard *sh;
+	int i;
+
+	memset(stats, 0, sizeof(http_cache_stats));
+	if (cache == NULL)
+		return;
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		sh = &cache->shards[i];
+		pthread_mutex_lock(&sh->lock);
+		stats->hits += sh->hits;
+		stats->misses += sh->misses;
+		stats->revalidations += sh->revalidations;
+		stats->not_modified += sh->not_modified;
+		stats->stored += sh->stored;
+		stats->evicted += sh->evicted;
+		stats->bytes += sh->bytes;
+		stats->entries += sh->count;
+		pthread_mutex_unlock(&sh->lock);
+	}
+}
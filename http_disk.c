@@ -0,0 +1,859 @@
+/*
+ *  Http put/get/post mini lib
+ *  disk response cache
+ *  see LICENSE for terms, conditions and DISCLAIMER OF ALL WARRANTIES
+ *
+ * Description : answers of http_get_view kept in a directory, see
+ * http_disk_cache_open. Unlike the memory cache it outlives the process
+ * and can be shared by several processes.
+ *
+ * The directory holds an index file, one text line per answer with its
+ * key, body file, length, expiry, type and validators, and the bodies,
+ * in files named after the SHA-256 and the length of their data so that
+ * answers with the same data share a file. Files are written under a
+ * temporary name and renamed: readers never see a partial one and take
+ * no lock. Writers lock the lock file with flock(2), read the index
+ * again if another process replaced it, and write all of it. Cached
+ * bodies are returned mapped with mmap(2), without a copy.
+ *
+ * Freshness and revalidation are those of the memory cache, expiry
+ * dates are from time(2) since they are shared.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "http_lib.h"
+#include "http_private.h"
+
+#define DISK_BUCKETS 1024
+#define DISK_INDEX "index"
+#define DISK_LOCK "lock"
+/* first line of the index, the format of the others */
+#define DISK_MAGIC "http-tiny-cache 1"
+/* body file name: SHA-256 of the data and length, in hex */
+#define DISK_NAME 96
+
+typedef struct _disk_entry {
+	char *key;		/* server:port/filename */
+	unsigned hash;
+	char body[DISK_NAME];	/* file holding the data */
+	off_t length;
+	time_t expires;		/* fresh until then */
+	time_t stored;		/* written then, oldest dropped first */
+	char type[MAXTYPE];
+	char etag[MAXVALIDATOR];	/* validators, "" if none */
+	char modified[MAXVALIDATOR];
+	struct _disk_entry *next;
+} disk_entry;
+
+struct _http_disk_cache {
+	pthread_mutex_t lock;	/* threads of the process */
+	int lockfd;		/* other processes, flock(2) */
+	char *dir;
+	off_t max_bytes;
+
+	/* index as last read, its file told by dev, ino and mtime */
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	disk_entry *bucket[DISK_BUCKETS];
+	off_t bytes;
+	int count;
+
+	/* of this process */
+	long long hits, misses, revalidations, not_modified, stored, evicted;
+};
+
+/* FNV-1a of the key */
+static unsigned
+disk_key_hash(const char *key)
+{
+	unsigned h = 2166136261u;
+
+	for (; *key; key++)
+		h = (h ^ (unsigned char) *key) * 16777619u;
+	return h;
+}
+
+/* SHA-256 (FIPS 180-4) of a running hash */
+typedef struct {
+	unsigned h[8];
+	unsigned char block[64];
+	unsigned long long length;	/* bytes hashed */
+} disk_sha;
+
+static const unsigned disk_sha_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define DISK_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+disk_sha_block(disk_sha *s, const unsigned char *p)
+{
+	unsigned w[64], a[8], t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (unsigned) p[i * 4] << 24 | p[i * 4 + 1] << 16 |
+			p[i * 4 + 2] << 8 | p[i * 4 + 3];
+	for (; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+			(DISK_ROR(w[i - 15], 7) ^ DISK_ROR(w[i - 15], 18) ^
+			 (w[i - 15] >> 3)) +
+			(DISK_ROR(w[i - 2], 17) ^ DISK_ROR(w[i - 2], 19) ^
+			 (w[i - 2] >> 10));
+	memcpy(a, s->h, sizeof(a));
+	for (i = 0; i < 64; i++) {
+		t1 = a[7] + (DISK_ROR(a[4], 6) ^ DISK_ROR(a[4], 11) ^
+			DISK_ROR(a[4], 25)) + ((a[4] & a[5]) ^ (~a[4] & a[6])) +
+			disk_sha_k[i] + w[i];
+		t2 = (DISK_ROR(a[0], 2) ^ DISK_ROR(a[0], 13) ^
+			DISK_ROR(a[0], 22)) +
+			((a[0] & a[1]) ^ (a[0] & a[2]) ^ (a[1] & a[2]));
+		memmove(a + 1, a, 7 * sizeof(unsigned));
+		a[4] += t1;
+		a[0] = t1 + t2;
+	}
+	for (i = 0; i < 8; i++)
+		s->h[i] += a[i];
+}
+
+static void
+disk_sha_init(disk_sha *s)
+{
+	static const unsigned h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(s->h, h0, sizeof(h0));
+	s->length = 0;
+}
+
+static void
+disk_sha_update(disk_sha *s, const unsigned char *p, size_t n)
+{
+	size_t used = s->length % 64, k;
+
+	s->length += n;
+	if (used) {
+		k = 64 - used < n ? 64 - used : n;
+		memcpy(s->block + used, p, k);
+		p += k;
+		n -= k;
+		if (used + k < 64)
+			return;
+		disk_sha_block(s, s->block);
+	}
+	for (; n >= 64; p += 64, n -= 64)
+		disk_sha_block(s, p);
+	memcpy(s->block, p, n);
+}
+
+/* the hash in hex, 65 bytes with the NUL */
+static void
+disk_sha_final(disk_sha *s, char *hex)
+{
+	unsigned long long bits = s->length * 8;
+	unsigned char pad[72];
+	size_t n;
+	int i;
+
+	n = 64 - (s->length + 8) % 64;
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 8; i++)
+		pad[n + i] = (unsigned char) (bits >> (56 - 8 * i));
+	disk_sha_update(s, pad, n + 8);
+	for (i = 0; i < 8; i++)
+		sprintf(hex + i * 8, "%08x", s->h[i]);
+}
+
+/*
+ * name of the body file of some data: its SHA-256 and its length, so
+ * that no other data, even made on purpose, gets the name of a file
+ * another entry refers to
+ */
+static void
+disk_body_name(const char *data, off_t length, char *name)
+{
+	disk_sha s;
+	char hex[65];
+
+	disk_sha_init(&s);
+	disk_sha_update(&s, (const unsigned char *) data, length);
+	disk_sha_final(&s, hex);
+	snprintf(name, DISK_NAME, "%s-%llx", hex, (unsigned long long) length);
+}
+
+/* path of a file of the cache, in a PATH_MAX placeholder */
+static char *
+disk_path(http_disk_cache *dc, const char *name, char *path)
+{
+	snprintf(path, PATH_MAX, "%s/%s", dc->dir, name);
+	return path;
+}
+
+static disk_entry **
+disk_chain(http_disk_cache *dc, unsigned hash)
+{
+	return &dc->bucket[hash % DISK_BUCKETS];
+}
+
+static disk_entry *
+disk_find(http_disk_cache *dc, const char *key, unsigned hash)
+{
+	disk_entry *e;
+
+	for (e = *disk_chain(dc, hash); e; e = e->next)
+		if (e->hash == hash && !strcmp(e->key, key))
+			return e;
+	return NULL;
+}
+
+static void
+disk_insert(http_disk_cache *dc, disk_entry *e)
+{
+	e->hash = disk_key_hash(e->key);
+	e->next = *disk_chain(dc, e->hash);
+	*disk_chain(dc, e->hash) = e;
+	dc->bytes += e->length;
+	dc->count++;
+}
+
+/* take e out of the index, it is not freed */
+static void
+disk_remove(http_disk_cache *dc, disk_entry *e)
+{
+	disk_entry **pe;
+
+	for (pe = disk_chain(dc, e->hash); *pe != e; pe = &(*pe)->next)
+		;
+	*pe = e->next;
+	e->next = NULL;
+	dc->bytes -= e->length;
+	dc->count--;
+}
+
+static void
+disk_entry_free(disk_entry *e)
+{
+	free(e->key);
+	free(e);
+}
+
+static void
+disk_clear(http_disk_cache *dc)
+{
+	disk_entry *e;
+	int i;
+
+	for (i = 0; i < DISK_BUCKETS; i++) {
+		while ((e = dc->bucket[i]) != NULL) {
+			dc->bucket[i] = e->next;
+			disk_entry_free(e);
+		}
+	}
+	dc->bytes = 0;
+	dc->count = 0;
+}
+
+/* some entry of the index has its data in body */
+static int
+disk_referenced(http_disk_cache *dc, const char *body)
+{
+	disk_entry *e;
+	int i;
+
+	for (i = 0; i < DISK_BUCKETS; i++)
+		for (e = dc->bucket[i]; e; e = e->next)
+			if (!strcmp(e->body, body))
+				return 1;
+	return 0;
+}
+
+/* copy the string field of an index line up to the next tab */
+static char *
+disk_field(char **pline, char *buf, size_t size)
+{
+	char *f = strsep(pline, "\t");
+
+	if (f == NULL || strlen(f) >= size)
+		return NULL;
+	strcpy(buf, f);
+	return buf;
+}
+
+/*
+ * parse a line of the index
+ * returns the entry, or NULL if the line is not valid
+ */
+static disk_entry *
+disk_parse(char *line)
+{
+	disk_entry *e;
+	char *key, num[3][32];
+
+	line[strcspn(line, "\n")] = '\0';
+	if ((e = (disk_entry *) calloc(1, sizeof(disk_entry))) == NULL)
+		return NULL;
+	if ((key = strsep(&line, "\t")) == NULL || *key == '\0' ||
+			!disk_field(&line, e->body, DISK_NAME) ||
+			!disk_field(&line, num[0], sizeof(num[0])) ||
+			!disk_field(&line, num[1], sizeof(num[1])) ||
+			!disk_field(&line, num[2], sizeof(num[2])) ||
+			!disk_field(&line, e->type, MAXTYPE) ||
+			!disk_field(&line, e->etag, MAXVALIDATOR) ||
+			!disk_field(&line, e->modified, MAXVALIDATOR) ||
+			e->body[0] == '\0' || e->body[0] == '.' ||
+			strchr(e->body, '/') ||
+			(e->key = strdup(key)) == NULL) {
+		free(e);
+		return NULL;
+	}
+	e->length = strtoll(num[0], NULL, 10);
+	e->expires = strtoll(num[1], NULL, 10);
+	e->stored = strtoll(num[2], NULL, 10);
+	return e;
+}
+
+/*
+ * read the index again if it was replaced since it was last read
+ * the lock of dc is held
+ */
+static void
+disk_load(http_disk_cache *dc)
+{
+	char path[PATH_MAX], *line = NULL;
+	size_t size = 0;
+	struct stat st;
+	disk_entry *e, *old;
+	FILE *f;
+
+	if (stat(disk_path(dc, DISK_INDEX, path), &st) < 0) {
+		if (dc->ino != 0)
+			disk_clear(dc);
+		dc->ino = 0;
+		return;
+	}
+	if (st.st_ino == dc->ino && st.st_dev == dc->dev &&
+			st.st_mtim.tv_sec == dc->mtime.tv_sec &&
+			st.st_mtim.tv_nsec == dc->mtime.tv_nsec)
+		return;
+
+	disk_clear(dc);
+	if ((f = fopen(path, "r")) == NULL)
+		return;
+	/* the file read, which may have been replaced since the stat */
+	if (fstat(fileno(f), &st) == 0) {
+		dc->dev = st.st_dev;
+		dc->ino = st.st_ino;
+		dc->mtime = st.st_mtim;
+	}
+	if (getline(&line, &size, f) > 0 &&
+			!strncmp(line, DISK_MAGIC "\n", sizeof(DISK_MAGIC))) {
+		while (getline(&line, &size, f) > 0) {
+			if ((e = disk_parse(line)) == NULL)
+				continue;
+			if ((old = disk_find(dc, e->key, disk_key_hash(e->key)))) {
+				disk_remove(dc, old);
+				disk_entry_free(old);
+			}
+			disk_insert(dc, e);
+		}
+	}
+	free(line);
+	fclose(f);
+}
+
+/*
+ * write the index, to a temporary file renamed over it
+ * the lock of dc and the lock file are held
+ * returns 0 or -1
+ */
+static int
+disk_save(http_disk_cache *dc)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct stat st;
+	disk_entry *e;
+	FILE *f;
+	int i, r;
+
+	if ((f = fopen(disk_path(dc, DISK_INDEX ".tmp", tmp), "w")) == NULL)
+		return -1;
+	fprintf(f, "%s\n", DISK_MAGIC);
+	for (i = 0; i < DISK_BUCKETS; i++)
+		for (e = dc->bucket[i]; e; e = e->next)
+			fprintf(f, "%s\t%s\t%lld\t%lld\t%lld\t%s\t%s\t%s\n",
+				e->key, e->body, (long long) e->length,
+				(long long) e->expires, (long long) e->stored,
+				e->type, e->etag, e->modified);
+	r = (fflush(f) == 0 && fdatasync(fileno(f)) == 0) ? 0 : -1;
+	if (fclose(f) != 0)
+		r = -1;
+	if (r == 0 && rename(tmp, disk_path(dc, DISK_INDEX, path)) < 0)
+		r = -1;
+	if (r < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	/* our own write needs not be read again */
+	if (stat(path, &st) == 0) {
+		dc->dev = st.st_dev;
+		dc->ino = st.st_ino;
+		dc->mtime = st.st_mtim;
+	}
+	return 0;
+}
+
+/*
+ * replace the entry of key by ne (a copy of it is taken), or drop it if
+ * ne is NULL. If tmp is not NULL, it is the body of ne, renamed to its
+ * name. Older entries are dropped above the size of the cache, and the
+ * body files no entry refers to anymore.
+ * returns 0 or -1
+ */
+static int
+disk_update(http_disk_cache *dc, const char *key, disk_entry *ne,
+	const char *tmp)
+{
+	char path[PATH_MAX];
+	disk_entry *e, *old, *dropped = NULL, *oldest;
+	int i, r = 0;
+
+	e = NULL;
+	if (ne) {
+		if ((e = (disk_entry *) malloc(sizeof(disk_entry))) == NULL)
+			return -1;
+		*e = *ne;
+		if ((e->key = strdup(key)) == NULL) {
+			free(e);
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&dc->lock);
+	flock(dc->lockfd, LOCK_EX);
+	disk_load(dc);
+
+	if (tmp && (rename(tmp, disk_path(dc, e->body, path)) < 0)) {
+		disk_entry_free(e);
+		e = NULL;
+		r = -1;
+	}
+	if ((old = disk_find(dc, key, disk_key_hash(key))) != NULL) {
+		disk_remove(dc, old);
+		old->next = dropped;
+		dropped = old;
+	}
+	if (e) {
+		disk_insert(dc, e);
+		while (dc->bytes > dc->max_bytes && dc->count > 1) {
+			oldest = NULL;
+			for (i = 0; i < DISK_BUCKETS; i++)
+				for (old = dc->bucket[i]; old; old = old->next)
+					if (old != e && (oldest == NULL ||
+						old->stored < oldest->stored))
+						oldest = old;
+			disk_remove(dc, oldest);
+			oldest->next = dropped;
+			dropped = oldest;
+			dc->evicted++;
+		}
+		dc->stored++;
+	}
+	if ((e || dropped) && disk_save(dc) < 0)
+		r = -1;
+
+	while ((old = dropped) != NULL) {
+		dropped = old->next;
+		if (!disk_referenced(dc, old->body))
+			unlink(disk_path(dc, old->body, path));
+		disk_entry_free(old);
+	}
+
+	flock(dc->lockfd, LOCK_UN);
+	pthread_mutex_unlock(&dc->lock);
+	return r;
+}
+
+/*
+ * copy of the entry of key
+ * returns 1, or 0 if there is none
+ */
+static int
+disk_lookup(http_disk_cache *dc, const char *key, disk_entry *copy)
+{
+	disk_entry *e;
+
+	pthread_mutex_lock(&dc->lock);
+	disk_load(dc);
+	if ((e = disk_find(dc, key, disk_key_hash(key))) != NULL) {
+		*copy = *e;
+		copy->key = NULL;
+		copy->next = NULL;
+	}
+	pthread_mutex_unlock(&dc->lock);
+	return e != NULL;
+}
+
+static void
+disk_count(http_disk_cache *dc, long long *counter)
+{
+	pthread_mutex_lock(&dc->lock);
+	(*counter)++;
+	pthread_mutex_unlock(&dc->lock);
+}
+
+/* map the data of fd, length long, in view */
+static int
+disk_map_fd(int fd, off_t length, http_view *view)
+{
+	void *p;
+
+	if (length == 0) {
+		view->data = "";
+		return 0;
+	}
+	p = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	view->data = (const char *) p;
+	view->length = length;
+	view->map = p;
+	return 0;
+}
+
+/*
+ * map the body of e in view
+ * returns 0, or -1 if its file is gone (dropped by another process) or
+ * is not of the right length
+ */
+static int
+disk_map(http_disk_cache *dc, disk_entry *e, http_view *view)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int fd, r;
+
+	if ((fd = open(disk_path(dc, e->body, path), O_RDONLY)) < 0)
+		return -1;
+	r = -1;
+	if (fstat(fd, &st) == 0 && st.st_size == e->length)
+		r = disk_map_fd(fd, e->length, view);
+	close(fd);
+	return r;
+}
+
+/*
+ * conditional header lines revalidating e, "" if they do not fit
+ *	char *cond	placeholder, MAXCOND long
+ */
+static void
+disk_cond(disk_entry *e, char *cond)
+{
+	int n;
+
+	n = snprintf(cond, MAXCOND, "%s%s%s%s%s%s",
+		e->etag[0] ? "If-None-Match: " : "", e->etag,
+		e->etag[0] ? "\r\n" : "",
+		e->modified[0] ? "If-Modified-Since: " : "", e->modified,
+		e->modified[0] ? "\r\n" : "");
+	if (n < 0 || n >= (int) MAXCOND)
+		cond[0] = '\0';
+}
+
+/* copy a header value to a field of the index, left "" if it would
+ * break the line in other fields */
+static void
+disk_value(char *field, const char *v)
+{
+	if (v && !strpbrk(v, "\t\r\n"))
+		strcpy(field, v);
+}
+
+/*
+ * answer of a GET on connection c whose header was read, written to a
+ * body file of the cache and mapped in view
+ * returns OK0 or a negative error code
+ */
+static http_retcode
+disk_store(http_ctx *ctx, http_conn *c, char *key, long life, char *type,
+	http_view *view)
+{
+	http_disk_cache *dc = ctx->disk_cache;
+	char tmp[PATH_MAX];
+	disk_entry e;
+	off_t length = 0;
+	http_retcode ret;
+	int fd;
+
+	memset(&e, 0, sizeof(e));
+	disk_value(e.type, type);
+	disk_value(e.etag, http_cache_validator(ctx, HTTP_H_ETAG));
+	disk_value(e.modified, http_cache_validator(ctx,
+		HTTP_H_LAST_MODIFIED));
+
+	/* the server closes the connection at the end of data */
+	if (!c->chunked && c->left < 0)
+		c->keep = 0;
+
+	if ((fd = mkstemp(disk_path(dc, "tmp.XXXXXX", tmp))) < 0) {
+		c->keep = 0;
+		return ERRWRFD;
+	}
+	/* for the other processes sharing the cache */
+	fchmod(fd, 0644);
+	ret = http_body_to_fd(c, fd, &length);
+	if (ret < 0)
+		c->keep = 0;
+	else if (fdatasync(fd) < 0 || disk_map_fd(fd, length, view) < 0)
+		ret = ERRWRFD;
+	close(fd);
+	if (ret < 0) {
+		unlink(tmp);
+		return ret;
+	}
+
+	disk_body_name(view->data, length, e.body);
+	e.length = length;
+	e.stored = time(NULL);
+	e.expires = e.stored + life;
+	/* the data is mapped, it stays readable if the file is not kept */
+	if (disk_update(dc, key, &e, tmp) < 0)
+		unlink(tmp);
+	return OK0;
+}
+
+/*
+ * Get data from the server, as a read only view
+ *
+ * Like http_get, but with a disk cache set (see http_set_disk_cache) the
+ * answer is kept in it, and returned mapped from its file without a
+ * copy, even if it was kept by another process. A stale answer is asked
+ * again with If-None-Match and If-Modified-Since. Without a disk cache,
+ * or for answers which can't be kept, the data is read in memory as by
+ * http_get. In any case the view must be given back with
+ * http_view_release.
+ *
+ * returns a negative error code or a positive code from the server
+ *
+ *	char *filename	name of the ressource to read
+ *	http_view *view	placeholder for the data
+ *	char *typebuf	allocated buffer where the read data type is returned.
+ *			If NULL, the type is not returned
+ */
+extern http_retcode
+httpmt_get_view(http_ctx *ctx, char *filename, http_view *view,
+		char *typebuf)
+{
+	http_disk_cache *dc;
+	http_retcode ret;
+	http_conn *c;
+	disk_entry e;
+	char key[MAXBUF], cond[MAXCOND], type[MAXTYPE];
+	char *data;
+	int n, length = -1, found;
+	long life;
+
+	if (ctx == NULL || view == NULL)
+		return ERRNULL;
+	memset(view, 0, sizeof(http_view));
+	if (typebuf) *typebuf = '\0';
+
+	dc = ctx->disk_cache;
+	if (dc == NULL || ctx->reader || !http_cache_key(ctx, filename, key) ||
+			strpbrk(key, "\t\r\n")) {
+		ret = httpmt_get(ctx, filename, &data, &length, typebuf);
+		view->data = data;
+		view->length = length;
+		view->ctx = ctx;
+		return ret;
+	}
+
+	/* a fresh answer has no header */
+	http_answer_release(ctx);
+	cond[0] = '\0';
+	if ((found = disk_lookup(dc, key, &e)) == 0) {
+		disk_count(dc, &dc->misses);
+	} else if (e.expires > time(NULL) && disk_map(dc, &e, view) == 0) {
+		disk_count(dc, &dc->hits);
+		if (typebuf)
+			strcpy(typebuf, e.type);
+		return OK200;
+	} else {
+		disk_cond(&e, cond);
+		disk_count(dc, &dc->revalidations);
+	}
+
+again:
+	ret = http_query(ctx, "GET", filename, cond, KEEP_OPEN, NULL, &c);
+	if (ret == (http_retcode) 304 && cond[0]) {
+		if (http_read_header(c, NULL, NULL) < 0) {
+			c->keep = 0;
+			http_release(ctx, c);
+			return http_expired(ctx, ERRRDHD);
+		}
+		http_release(ctx, c);
+		if (disk_map(dc, &e, view) < 0) {
+			/* dropped meanwhile, ask it again */
+			cond[0] = '\0';
+			goto again;
+		}
+		life = http_cache_lifetime(ctx);
+		e.expires = time(NULL) + (life > 0 ? life : 0);
+		disk_update(dc, key, &e, NULL);
+		disk_count(dc, &dc->not_modified);
+		if (typebuf)
+			strcpy(typebuf, e.type);
+		return OK200;
+	}
+	if (ret == OK200) {
+		if (http_read_header(c, &length, type) < 0) {
+			c->keep = 0;
+			http_release(ctx, c);
+			return http_expired(ctx, ERRRDHD);
+		}
+		if (typebuf)
+			strcpy(typebuf, type);
+
+		life = http_cache_lifetime(ctx);
+		if (life > 0 || (life == 0 &&
+				(http_cache_validator(ctx, HTTP_H_ETAG) ||
+				http_cache_validator(ctx, HTTP_H_LAST_MODIFIED)))) {
+			n = disk_store(ctx, c, key, life, type, view);
+		} else {
+			/* not kept, nor the older answer */
+			n = http_read_data(ctx, c, length, &data, &length);
+			if (n == OK0) {
+				view->data = data;
+				view->length = length;
+				view->ctx = ctx;
+			}
+			if (found)
+				disk_update(dc, key, NULL, NULL);
+		}
+		if (n < 0)
+			ret = (http_retcode) n;
+		http_release(ctx, c);
+	} else if (ret >= OK0) {
+		http_skip_answer(c);
+		http_release(ctx, c);
+	}
+
+	return http_expired(ctx, ret);
+}
+
+/**
+ * give back the data of http_get_view
+ */
+extern void
+http_view_release(http_view *view)
+{
+	if (view == NULL)
+		return;
+	if (view->map)
+		munmap(view->map, view->length);
+	else if (view->ctx && view->data)
+		httpmt_free(view->ctx, (void *) view->data);
+	memset(view, 0, sizeof(http_view));
+}
+
+/*
+ * Open a disk response cache
+ *
+ * The answers of http_get_view are kept in the directory dir by a cache
+ * set on a ctx with http_set_disk_cache, it can be shared by the ctx of
+ * several threads, and the directory by several processes. The same
+ * answers as in the memory cache are kept (see http_cache_new).
+ *
+ * returns the cache or NULL if the directory can't be created or used
+ *
+ *	const char *dir		directory of the cache, created if needed
+ *	off_t max_bytes		bytes of data kept at most, the oldest
+ *				answers are dropped above
+ */
+extern http_disk_cache *
+http_disk_cache_open(const char *dir, off_t max_bytes)
+{
+	http_disk_cache *dc;
+	char path[PATH_MAX];
+
+	if (dir == NULL || (mkdir(dir, 0755) < 0 && errno != EEXIST))
+		return NULL;
+	if ((dc = (http_disk_cache *) calloc(1, sizeof(http_disk_cache))) == NULL)
+		return NULL;
+	if ((dc->dir = strdup(dir)) == NULL ||
+			(dc->lockfd = open(disk_path(dc, DISK_LOCK, path),
+				O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+		free(dc->dir);
+		free(dc);
+		return NULL;
+	}
+	dc->max_bytes = max_bytes;
+	pthread_mutex_init(&dc->lock, NULL);
+	return dc;
+}
+
+/**
+ * close a disk response cache, no ctx must use it anymore. The views it
+ * returned stay valid and the directory is left as is.
+ */
+extern void
+http_disk_cache_close(http_disk_cache *dc)
+{
+	if (dc == NULL)
+		return;
+	disk_clear(dc);
+	close(dc->lockfd);
+	pthread_mutex_destroy(&dc->lock);
+	free(dc->dir);
+	free(dc);
+}
+
+/**
+ * counters of a disk response cache, of this process since it opened
+ * it, bytes and entries are those of the index
+ */
+extern void
+http_disk_cache_get_stats(http_disk_cache *dc, http_cache_stats *stats)
+{
+	memset(stats, 0, sizeof(http_cache_stats));
+	if (dc == NULL)
+		return;
+	pthread_mutex_lock(&dc->lock);
+	disk_load(dc);
+	stats->hits = dc->hits;
+	stats->misses = dc->misses;
+	stats->revalidations = dc->revalidations;
+	stats->not_modified = dc->not_modified;
+	stats->stored = dc->stored;
+	stats->evicted = dc->evicted;
+	stats->bytes = dc->bytes;
+	stats->entries = dc->count;
+	pthread_mutex_unlock(&dc->lock);
+}
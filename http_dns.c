@@ -0,0 +1,416 @@
+/*
+ *  Http put/get/post mini lib
+ *  resolver cache
+ *  see LICENSE for terms, conditions and DISCLAIMER OF ALL WARRANTIES
+ *
+ * Description : host name resolution with getaddrinfo(3), results
+ * (failures too) are kept in a cache shared by all threads and ctx.
+ *
+ * The cache is split in shards, each with its own lock, so that threads
+ * resolving different hosts rarely wait for each other. When several
+ * threads look up the same host while it is not cached, only the first
+ * one calls getaddrinfo and the others wait for its result.
+ *
+ * The addresses are returned IPv6 and IPv4 interleaved (RFC 8305), the
+ * ones which failed to connect recently moved after the others.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "http_lib.h"
+#include "http_private.h"
+
+#define DNS_SHARDS 16
+/* max entries of a shard, expired then oldest ones are dropped above */
+#define DNS_SHARD_MAX 64
+/* default seconds an answer (or a failure) is kept */
+#define DNS_TTL 60
+#define DNS_NEGATIVE_TTL 5
+/* seconds after which a connect failure of an address is forgotten */
+#define DNS_FAIL_FORGET 300
+
+/* connect history of an address */
+typedef struct {
+	unsigned short fails;	/* failures since the last success */
+	time_t failed;		/* time of the last one */
+} dns_hist;
+
+typedef struct _dns_entry {
+	char *host;
+	unsigned hash;
+	int pending;		/* being resolved by a thread */
+	time_t expires;
+	http_retcode ret;	/* OK0 or ERRHOST */
+	http_addrs addrs;	/* port not set */
+	dns_hist hist[HTTP_MAX_ADDRS];
+	struct _dns_entry *next;
+} dns_entry;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t done;	/* signaled when a pending entry is resolved */
+	dns_entry *entries;
+	int count;
+} dns_shard;
+
+static dns_shard dns_shards[DNS_SHARDS];
+static pthread_once_t dns_once = PTHREAD_ONCE_INIT;
+static volatile int dns_ttl = DNS_TTL;
+static volatile int dns_negative_ttl = DNS_NEGATIVE_TTL;
+
+static void
+dns_init(void)
+{
+	int i;
+
+	for (i = 0; i < DNS_SHARDS; i++) {
+		pthread_mutex_init(&dns_shards[i].lock, NULL);
+		pthread_cond_init(&dns_shards[i].done, NULL);
+	}
+}
+
+static time_t
+dns_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/* FNV-1a of the lower case host name */
+static unsigned
+dns_hash(const char *host)
+{
+	unsigned h = 2166136261u;
+
+	for (; *host; host++)
+		h = (h ^ (unsigned char) tolower(*host)) * 16777619u;
+	return h;
+}
+
+/*
+ * resolve host with getaddrinfo, IPv6 and IPv4 addresses
+ * returns OK0 or ERRHOST
+ */
+static http_retcode
+dns_lookup(const char *host, http_addrs *addrs)
+{
+	struct addrinfo hints, *res, *ai, *v6[HTTP_MAX_ADDRS], 
+		*v4[HTTP_MAX_ADDRS];
+	int n6 = 0, n4 = 0, i6 = 0, i4 = 0, six = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+
+	addrs->n = 0;
+	if (getaddrinfo(host, NULL, &hints, &res) != 0)
+		return ERRHOST;
+
+	/* in the order of getaddrinfo (RFC 6724), by family */
+	for (ai = res; ai; ai = ai->ai_next) {
+		if (ai->ai_addrlen > sizeof(struct sockaddr_storage))
+			continue;
+		if (ai->ai_family == AF_INET6 && n6 < HTTP_MAX_ADDRS)
+			v6[n6++] = ai;
+		else if (ai->ai_family == AF_INET && n4 < HTTP_MAX_ADDRS)
+			v4[n4++] = ai;
+		else
+			continue;
+		if (six < 0)
+			six = (ai->ai_family == AF_INET6);
+	}
+
+	/* families alternate, starting with the preferred one */
+	while (addrs->n < HTTP_MAX_ADDRS && (i6 < n6 || i4 < n4)) {
+		if (i6 < n6 && (six || i4 == n4))
+			ai = v6[i6++];
+		else
+			ai = v4[i4++];
+		six = !six;
+		memcpy(&addrs->addr[addrs->n], ai->ai_addr, ai->ai_addrlen);
+		addrs->len[addrs->n] = ai->ai_addrlen;
+		addrs->n++;
+	}
+	freeaddrinfo(res);
+
+	return addrs->n > 0 ? OK0 : ERRHOST;
+}
+
+static void
+dns_set_port(http_addrs *addrs, int port)
+{
+	int i;
+
+	for (i = 0; i < addrs->n; i++) {
+		if (addrs->addr[i].ss_family == AF_INET6)
+			((struct sockaddr_in6 *) &addrs->addr[i])->sin6_port =
+				htons(port);
+		else
+			((struct sockaddr_in *) &addrs->addr[i])->sin_port =
+				htons(port);
+	}
+}
+
+/* same address, ports aside */
+static int
+dns_same(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+	if (a->ss_family != b->ss_family)
+		return 0;
+	if (a->ss_family == AF_INET6)
+		return !memcmp(&((struct sockaddr_in6 *) a)->sin6_addr,
+			&((struct sockaddr_in6 *) b)->sin6_addr,
+			sizeof(struct in6_addr));
+	return ((struct sockaddr_in *) a)->sin_addr.s_addr ==
+		((struct sockaddr_in *) b)->sin_addr.s_addr;
+}
+
+/*
+ * addresses of an entry, the ones with recent connect failures last,
+ * fewest failures first. The order is otherwise kept.
+ */
+static void
+dns_order(dns_entry *e, http_addrs *addrs, time_t now)
+{
+	int key[HTTP_MAX_ADDRS], i, j, k;
+	struct sockaddr_storage sa;
+	socklen_t len;
+
+	*addrs = e->addrs;
+	for (i = 0; i < addrs->n; i++) {
+		k = (e->hist[i].fails && now - e->hist[i].failed <
+			DNS_FAIL_FORGET) ? e->hist[i].fails : 0;
+		sa = addrs->addr[i];
+		len = addrs->len[i];
+		for (j = i; j > 0 && key[j - 1] > k; j--) {
+			key[j] = key[j - 1];
+			addrs->addr[j] = addrs->addr[j - 1];
+			addrs->len[j] = addrs->len[j - 1];
+		}
+		key[j] = k;
+		addrs->addr[j] = sa;
+		addrs->len[j] = len;
+	}
+}
+
+static dns_entry *
+dns_find(dns_shard *sh, const char *host, unsigned hash)
+{
+	dns_entry *e;
+
+	for (e = sh->entries; e; e = e->next)
+		if (e->hash == hash && !strcasecmp(e->host, host))
+			return e;
+	return NULL;
+}
+
+/*
+ * make room in a full shard: drop expired entries, then the one
+ * expiring first. Pending entries are never dropped.
+ */
+static void
+dns_evict(dns_shard *sh, time_t now)
+{
+	dns_entry **pe, *e, **oldest = NULL;
+
+	for (pe = &sh->entries; (e = *pe) != NULL; ) {
+		if (!e->pending && e->expires <= now) {
+			*pe = e->next;
+			free(e->host);
+			free(e);
+			sh->count--;
+			continue;
+		}
+		if (!e->pending && (oldest == NULL || e->expires < (*oldest)->expires))
+			oldest = pe;
+		pe = &e->next;
+	}
+
+	if (sh->count >= DNS_SHARD_MAX && oldest) {
+		e = *oldest;
+		*oldest = e->next;
+		free(e->host);
+		free(e);
+		sh->count--;
+	}
+}
+
+/*
+ * resolve a host name to the addresses to connect to on port
+ * returns OK0 or ERRHOST (ERRMEM if the entry can't be allocated)
+ *
+ *	const char *host	host name or numeric address
+ *	int port		port set in the returned addresses
+ *	http_addrs *addrs	placeholder for the addresses
+ */
+extern http_retcode
+http_resolve(const char *host, int port, http_addrs *addrs)
+{
+	dns_shard *sh;
+	dns_entry *e;
+	unsigned hash;
+	http_retcode ret;
+	dns_hist hist[HTTP_MAX_ADDRS];
+	time_t now;
+	int ttl, i, j;
+
+	if (dns_ttl <= 0) {
+		ret = dns_lookup(host, addrs);
+		dns_set_port(addrs, port);
+		return ret;
+	}
+
+	pthread_once(&dns_once, dns_init);
+	hash = dns_hash(host);
+	sh = &dns_shards[hash % DNS_SHARDS];
+
+	pthread_mutex_lock(&sh->lock);
+	/* wait for a thread resolving the same name */
+	while ((e = dns_find(sh, host, hash)) != NULL && e->pending)
+		pthread_cond_wait(&sh->done, &sh->lock);
+
+	now = dns_now();
+	if (e && e->expires > now) {
+		dns_order(e, addrs, now);
+		ret = e->ret;
+		pthread_mutex_unlock(&sh->lock);
+		dns_set_port(addrs, port);
+		return ret;
+	}
+
+	if (e == NULL) {
+		if (sh->count >= DNS_SHARD_MAX)
+			dns_evict(sh, now);
+		e = (dns_entry *) calloc(1, sizeof(dns_entry));
+		if (e == NULL || (e->host = strdup(host)) == NULL) {
+			pthread_mutex_unlock(&sh->lock);
+			free(e);
+			return ERRMEM;
+		}
+		e->hash = hash;
+		e->next = sh->entries;
+		sh->entries = e;
+		sh->count++;
+	}
+	e->pending = 1;
+	pthread_mutex_unlock(&sh->lock);
+
+	ret = dns_lookup(host, addrs);
+
+	pthread_mutex_lock(&sh->lock);
+	/* the history of the addresses still there is kept */
+	for (i = 0; i < addrs->n; i++) {
+		hist[i].fails = 0;
+		for (j = 0; j < e->addrs.n; j++) {
+			if (dns_same(&addrs->addr[i], &e->addrs.addr[j])) {
+				hist[i] = e->hist[j];
+				break;
+			}
+		}
+	}
+	memcpy(e->hist, hist, sizeof(hist));
+	ttl = (ret == OK0) ? dns_ttl : dns_negative_ttl;
+	e->ret = ret;
+	e->addrs = *addrs;
+	now = dns_now();
+	e->expires = now + (ttl > 0 ? ttl : 0);
+	dns_order(e, addrs, now);
+	e->pending = 0;
+	pthread_cond_broadcast(&sh->done);
+	pthread_mutex_unlock(&sh->lock);
+
+	dns_set_port(addrs, port);
+	return ret;
+}
+
+/*
+ * record the outcome of a connection to an address of host, for the
+ * order of the next ones
+ *	const struct sockaddr_storage *addr	the address
+ *	int ok		1 if connected, 0 if it failed or timed out
+ */
+extern void
+http_dns_report(const char *host, const struct sockaddr_storage *addr, int ok)
+{
+	dns_shard *sh;
+	dns_entry *e;
+	unsigned hash;
+	int i;
+
+	if (dns_ttl <= 0)
+		return;
+
+	pthread_once(&dns_once, dns_init);
+	hash = dns_hash(host);
+	sh = &dns_shards[hash % DNS_SHARDS];
+
+	pthread_mutex_lock(&sh->lock);
+	if ((e = dns_find(sh, host, hash)) != NULL && !e->pending) {
+		for (i = 0; i < e->addrs.n; i++) {
+			if (!dns_same(addr, &e->addrs.addr[i]))
+				continue;
+			if (ok) {
+				e->hist[i].fails = 0;
+			} else {
+				if (e->hist[i].fails < 0xffff)
+					e->hist[i].fails++;
+				e->hist[i].failed = dns_now();
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sh->lock);
+}
+
+/**
+ * set how long resolved names are kept in the resolver cache, in seconds
+ * ttl for answers, negative_ttl for names that could not be resolved.
+ * ttl = 0 disables the cache.
+ */
+extern void
+http_set_dns_ttl(int ttl, int negative_ttl)
+{
+	dns_ttl = ttl;
+	dns_negative_ttl = negative_ttl;
+	if (ttl <= 0)
+		http_dns_flush();
+}
+
+/**
+ * empty the resolver cache
+ */
+extern void
+http_dns_flush(void)
+{
+	dns_entry **pe, *e;
+	int i;
+
+	pthread_once(&dns_once, dns_init);
+	for (i = 0; i < DNS_SHARDS; i++) {
+		pthread_mutex_lock(&dns_shards[i].lock);
+		for (pe = &dns_shards[i].entries; (e = *pe) != NULL; ) {
+			if (e->pending) {
+				/* its thread owns it */
+				e->expires = 0;
+				pe = &e->next;
+				continue;
+			}
+			*pe = e->next;
+			free(e->host);
+			free(e);
+			dns_shards[i].count--;
+		}
+		pthread_mutex_unlock(&dns_shards[i].lock);
+	}
+}
@@ -68,34 +68,112 @@ static char *rcsid="$Id: http_lib.c,v 3.5 1998/09/23 06:19:15 dl Exp $";
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <ctype.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
 #include <stdio.h>
 #include <errno.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "http_lib.h"
-
+#include "http_private.h"
 #define SERVER_DEFAULT "adonis"
-/* beware that filename+type+rest of header must not exceed MAXBUF */
-/* so we limit filename to 256 and type to 64 chars in put & get */
-#define MAXBUF 512
+/* default max idle seconds of a pooled connection */
+#define POOL_MAX_AGE 30
+/* buffer size when data from a file descriptor must be copied */
+#define XFER_BLOCK 65536
+/* max bytes moved by one sendfile/splice call */
+#define XFER_MAX (1 << 30)
+/* milliseconds before the next address is tried while connecting */
+#define HE_DELAY 250
+/* requests of a pipelined batch sent ahead of their answers */
+#define PIPE_DEPTH 16
+/* default size of a request arena block */
+#define ARENA_BLOCK (XFER_BLOCK + 4096)
 
-typedef enum 
-{
-	CLOSE,  /* Close the socket after the query (for put) */
-	KEEP_OPEN /* Keep it open */
-} querymode;
+/* block of a request arena, blocks are chained newest first */
+struct _http_arena {
+	http_arena *next;
+	size_t size;		/* size of data */
+	size_t used;		/* bytes of data handed out */
+	char data[1];
+};
 
-static http_retcode http_query(http_ctx *ctx, char *command, char *url,
-			 	char *additional_header, querymode mode, 
-		 		char *data, int length, int *pfd);
-static int http_read_line(int fd, char *buffer, int max);
-static int http_read_buffer(int fd, char *buffer, int max);
-static int http_read_buffer_eof(int fd, char **buffer, int *length);
+static http_retcode http_post_query(http_ctx *ctx, char *filename,
+				http_source *src, char *type, char **pdata,
+				int *plength, char **ptype);
+static http_retcode http_stream_query(http_ctx *ctx, const char *command,
+				char *filename, const char *header, http_source *src,
+				http_data_func fn, void *arg, char *buffer,
+				int size, off_t *plength, char *typebuf);
+static off_t http_fd_length(int fd, off_t length);
+static http_retcode http_source_header(http_ctx *ctx, http_source *src,
+				char *header, char *type, int overwrite);
+static http_conn *http_connect(http_ctx *ctx, char *server_name, int port,
+				http_retcode *pret);
+static int http_race(http_ctx *ctx, char *server_name, http_addrs *addrs,
+			http_retcode *pret);
+static int http_known_field(const char *name, unsigned hash);
+static int http_next_line(http_conn *c, char **pline);
+static int http_body_next(http_conn *c);
+static int http_read_wire(http_conn *c, char *buffer, int max);
+#ifdef HAVE_ZLIB
+static int http_inflate(http_conn *c, char *buffer, int max);
+static int http_inflate_fill(http_conn *c);
+static z_stream *http_deflater(http_ctx *ctx);
+static int http_send_gzip(http_conn *c, http_source *src);
+#endif
+static long http_send(http_conn *c, struct iovec *iov, int iovcnt,
+				int flags);
+static int http_send_fd(http_conn *c, int fd, off_t length);
+static int http_send_chunk(http_conn *c, char *buffer, int length);
+static int http_send_source(http_conn *c, http_source *src);
+static int http_send_producer(http_conn *c, http_source *src);
+static int http_send_buffer(http_conn *c, char *buffer, int length,
+				int flags);
+static int http_sigpipe_block(sigset_t *old);
+static void http_sigpipe_restore(sigset_t *old, int was_pending);
+static int http_zerocopy_wait(http_conn *c);
+static int http_find_lf(const char *p, int n);
+static int http_recv(http_conn *c, char *buffer, int length);
+static int http_read_line(http_conn *c, char *buffer, int max);
+static int http_read_buffer(http_conn *c, char *buffer, int max);
+static int http_read_buffer_eof(http_conn *c, char **buffer, int *length);
+static void *http_arena_alloc(http_ctx *ctx, size_t size);
+static void http_arena_reset(http_ctx *ctx);
+static long long http_nsec(void);
+static void http_stats_io(http_stats *st, int out, long n);
+static void http_stats_end(http_ctx *ctx, http_conn *c);
+static http_retcode http_begin(http_ctx *ctx);
+static int http_poll(http_ctx *ctx, int fd, short events, int timeout,
+			http_retcode why);
+static int http_poll_events(http_ctx *ctx, int fd, short events);
 
 /* user agent id string */
 static char *http_user_agent="adlib/3 ($Date: 1998/09/23 06:19:15 $)";
@@ -109,7 +187,43 @@ static http_ctx _ctx = {
 	.b64_enc = NULL,
 	.b64_auth = NULL,
 
-	.reader = NULL
+	.reader = NULL,
+
+	.pool_max_idle = 0,
+	.pool_max_age = 0,
+	.pool = NULL,
+
+	.zerocopy_min = 0,
+
+	.malloc_fn = NULL,
+	.realloc_fn = NULL,
+	.free_fn = NULL,
+	.alloc_opaque = NULL,
+	.arena = NULL,
+
+	.uring_entries = 0,
+
+	.answer = NULL,
+
+	.stats = NULL,
+	.stats_fn = NULL,
+	.stats_arg = NULL,
+
+	.timeouts = { 0, 0, 0, 0 },
+	.next_timeouts = { 0, 0, 0, 0 },
+	.next_set = 0,
+	.cur = { 0, 0, 0, 0 },
+	.deadline = 0,
+	.expired = OK0,
+	.cancelled = 0,
+	.cancel_fd = 0,
+
+	.compression = 0,
+	.upload_level = 0,
+	.deflate = NULL,
+
+	.cache = NULL,
+	.disk_cache = NULL
 };
 
 /* parses an url : setting the http_server and http_port global variables
@@ -119,7 +233,7 @@ static http_ctx _ctx = {
  *	char *url;  
  * address of a pointer that will be filled with allocated filename
  * the pointer must be equal to NULL before calling or it will be 
- * automatically freed (free(3))
+ * automatically freed (http_free)
  *	char **pfilename; 
  */
 extern http_retcode
@@ -138,11 +252,11 @@ httpmt_parse_url(http_ctx *ctx, char *url, char **pfilename)
 
 	ctx->port = 80;
 	if (ctx->server) {
-		free(ctx->server);
+		httpmt_free(ctx, ctx->server);
 		ctx->server = NULL;
 	}
 	if (*pfilename) {
-		free(*pfilename);
+		httpmt_free(ctx, *pfilename);
 		*pfilename = NULL;
 	}
 	 
@@ -154,8 +268,16 @@ httpmt_parse_url(http_ctx *ctx, char *url, char **pfilename)
 	}
 
 	url += 7;
-	for (pc = url, c = *pc; (c && c != ':' && c != '/');)
-		c = *pc++;
+	if (*url == '[' && (pc = strchr(url, ']')) != NULL) {
+		/* [IPv6 address] */
+		*pc++ = 0;
+		url++;
+		if ((c = *pc) != 0)
+			pc++;
+	} else {
+		for (pc = url, c = *pc; (c && c != ':' && c != '/');)
+			c = *pc++;
+	}
 	*(pc - 1) = 0;
 
 	if (c == ':') {
@@ -170,13 +292,13 @@ httpmt_parse_url(http_ctx *ctx, char *url, char **pfilename)
 		if (*pc) pc++;
 	}
 
-	ctx->server = strdup(url);
+	ctx->server = http_strdup(ctx, url);
 	if (ctx->server == NULL) 
 		return ERRMEM;
 
-	*pfilename = strdup(c ? pc : "");
+	*pfilename = http_strdup(ctx, c ? pc : "");
 	if (*pfilename == NULL) {
-		free(ctx->server);
+		httpmt_free(ctx, ctx->server);
 		ctx->server = NULL;
 		return ERRMEM;
 	}
@@ -211,7 +333,7 @@ httpmt_proxy_url(http_ctx *ctx, char *proxy)
 		return r;
 
 	if (ctx->proxy_server) {
-		free(ctx->proxy_server);
+		httpmt_free(ctx, ctx->proxy_server);
 		ctx->proxy_server = NULL;
 	}
 
@@ -219,7 +341,7 @@ httpmt_proxy_url(http_ctx *ctx, char *proxy)
 	ctx->server = NULL;
 	ctx->proxy_port = ctx->port;
 
-	free(filename);
+	httpmt_free(ctx, filename);
 
 	return r;
 }
@@ -250,22 +372,112 @@ extern http_retcode
 httpmt_put(http_ctx *ctx, char *filename, char *data, int length, int overwrite, char *type) 
 {
 	char header[MAXBUF];
+	http_source src;
+	http_retcode ret;
 
 	if (ctx == NULL)
 		return ERRNULL;
 
-	if (type) 
-		sprintf(header,"Content-length: %d\015\012Content-type: %.64s\015\012%s",
-			length,
-			type  ,
-			overwrite ? "Control: overwrite=1\015\012" : ""
-			);
-	else
-		sprintf(header,"Content-length: %d\015\012%s",length,
-			overwrite ? "Control: overwrite=1\015\012" : ""
-			);
+	src.data = data;
+	src.length = length;
+	src.fd = -1;
+	src.produce = NULL;
+	if ((ret = http_source_header(ctx, &src, header, type, overwrite)) < 0)
+		return ret;
+
+	ret = http_query(ctx, "PUT", filename, header, CLOSE, &src, NULL);
+	httpmt_free(ctx, src.copy);
+	return ret;
+}
+
+/*
+ * Put data read from a file descriptor on the server
+ *
+ * Like http_put, but the data is sent as it is read from fd, the whole
+ * of it is never in memory: with sendfile(2) for regular files and
+ * splice(2) for pipes, with read(2) otherwise.
+ * returns a negative error code or a positive code from the server
+ *
+ *	char *filename	name of the ressource to create 
+ *	int fd		file descriptor to read the data from, at its
+ *			current offset
+ *	off_t length	length of the data to send, -1 if unknown: 
+ *			the size of a regular file, else up to EOF sent
+ *			in chunks
+ *	int overwrite	flag to request to overwrite the ressource if it
+ *			 was already existing 
+ *	char *type	type of the data, if NULL default type is used
+ */
+extern http_retcode
+http_put_fd(char *filename, int fd, off_t length, int overwrite, char *type)
+{
+	return httpmt_put_fd(&_ctx, filename, fd, length, overwrite, type);
+}
+
+extern http_retcode
+httpmt_put_fd(http_ctx *ctx, char *filename, int fd, off_t length,
+		int overwrite, char *type)
+{
+	char header[MAXBUF];
+	http_source src;
+	http_retcode ret;
+
+	if (ctx == NULL || fd < 0)
+		return ERRNULL;
+
+	memset(&src, 0, sizeof(src));
+	src.fd = fd;
+	src.fd_length = http_fd_length(fd, length);
+	if ((ret = http_source_header(ctx, &src, header, type, overwrite)) < 0)
+		return ret;
+
+	return http_query(ctx, "PUT", filename, header, CLOSE, &src, NULL);
+}
+
+/*
+ * Put data made by a function on the server
+ *
+ * Like http_put, but the data is asked to fn block by block as it is
+ * sent, it is never all in memory.
+ * returns a negative error code or a positive code from the server
+ *
+ *	char *filename	name of the ressource to create 
+ *	http_producer fn	called for each block of the data
+ *	void *arg	passed to fn
+ *	off_t length	length of the data to send, -1 if unknown: sent
+ *			in chunks up to the end told by fn
+ *	int overwrite	flag to request to overwrite the ressource if it
+ *			 was already existing 
+ *	char *type	type of the data, if NULL default type is used
+ */
+extern http_retcode
+http_put_producer(char *filename, http_producer fn, void *arg, off_t length,
+		int overwrite, char *type)
+{
+	return httpmt_put_producer(&_ctx, filename, fn, arg, length, overwrite,
+			type);
+}
+
+extern http_retcode
+httpmt_put_producer(http_ctx *ctx, char *filename, http_producer fn,
+		void *arg, off_t length, int overwrite, char *type)
+{
+	char header[MAXBUF];
+	http_source src;
+	http_retcode ret;
 
-	return http_query(ctx, "PUT", filename, header, CLOSE, data, length, NULL);
+	if (ctx == NULL || fn == NULL)
+		return ERRNULL;
+
+	memset(&src, 0, sizeof(src));
+	src.fd = -1;
+	src.fd_length = length < 0 ? -1 : length;
+	src.produce = fn;
+	src.produce_arg = arg;
+	if ((ret = http_source_header(ctx, &src, header, type, overwrite)) < 0)
+		return ret;
+
+	return http_query(ctx, "PUT", filename, header, CLOSE, &src, NULL);
 }
 	
 /*
@@ -299,11 +511,10 @@ extern http_retcode
 httpmt_get(http_ctx *ctx, char *filename, char **pdata, int *plength, char *typebuf) 
 {
 	http_retcode ret;
-	 
-	char header[MAXBUF];
-	char *pc;
-	int fd;
+	http_conn *c;
 	int n, length = -1;
+	int cached;
+	char key[MAXBUF], cond[MAXCOND], type[MAXTYPE];
 
 	if (ctx == NULL)
 		return ERRNULL;
@@ -315,53 +526,211 @@ httpmt_get(http_ctx *ctx, char *filename, char **pdata, int *plength, char *type
 
 	if (plength) *plength = 0;
 	if (typebuf) *typebuf = '\0';
-	
-	ret = http_query(ctx, "GET", filename, "", KEEP_OPEN, NULL, 0, &fd);
+
+	cond[0] = '\0';
+	cached = (ctx->cache && !ctx->reader && 
+		http_cache_key(ctx, filename, key));
+	if (cached) {
+		/* a fresh answer has no header */
+		http_answer_release(ctx);
+		if ((ret = http_cache_lookup(ctx, key, pdata, plength, typebuf,
+				cond)) != OK0)
+			return ret;
+		/* the type is kept with the data */
+		if (typebuf == NULL)
+			typebuf = type;
+	}
+
+again:
+	ret = http_query(ctx, "GET", filename, cond, KEEP_OPEN, NULL, &c);
+	if (ret == (http_retcode) 304 && cond[0]) {
+		if (http_read_header(c, NULL, NULL) < 0) {
+			c->keep = 0;
+			http_release(ctx, c);
+			return http_expired(ctx, ERRRDHD);
+		}
+		http_release(ctx, c);
+		ret = http_cache_revalidated(ctx, key, cond, pdata, plength,
+			typebuf);
+		if (ret != OK0)
+			return ret;
+		/* dropped meanwhile, ask it again */
+		cond[0] = '\0';
+		goto again;
+	}
 	if (ret == OK200) {
-		while (1) {
-			n = http_read_line(fd, header , MAXBUF - 1);
-#ifdef _DEBUG
-			fputs(header, stderr);
-			putc('\n', stderr);
-#endif	
-			if (n <= 0) {
-				close(fd);
-				return ERRRDHD;
-			}
-			/* empty line ? (=> end of header) */
-			if (n > 0 && (*header) == '\0') break;
-			/* try to parse some keywords : */
-			/* convert to lower case 'till a : is found or end of string */
-			for (pc = header; (*pc != ':' && *pc); pc++)
-				*pc = tolower(*pc);
-			sscanf(header, "content-length: %d", &length);
-			if (typebuf)
-				sscanf(header, "content-type: %s", typebuf);
-		}
-
-		if (length <= 0) {
-			if (ctx->reader) {
-				(*ctx->reader)(fd);
-			} else {
-				if (http_read_buffer_eof(fd, pdata, plength) == -1)
-					ret = ERRNOLG;
-			}
-			close(fd);
+		if (http_read_header(c, &length, typebuf) < 0) {
+			c->keep = 0;
+			http_release(ctx, c);
+			return http_expired(ctx, ERRRDHD);
+		}
+
+		if (!c->chunked && length < 0 && ctx->reader) {
+			/* the server closes the connection at the end of data */
+			c->keep = 0;
+			http_nonblock(c, 0);
+			(*ctx->reader)(c->fd);
 		} else {
-			*plength = length;
-			if (!(*pdata = (char *) malloc(length))) {
-				close(fd);
-				return ERRMEM;
-			}
-			n = http_read_buffer(fd, *pdata, length);
-			close(fd);
-			if (n != length)
-				ret = ERRRDDT;
+			n = http_read_data(ctx, c, length, pdata, plength);
+			if (n < 0)
+				ret = (http_retcode) n;
+			else if (cached && plength)
+				http_cache_store(ctx, key, *pdata, *plength,
+					typebuf);
+		}
+		http_release(ctx, c);
+	} else if (ret >= OK0) {
+		http_skip_answer(c);
+		http_release(ctx, c);
+	}
+
+	return http_expired(ctx, ret);
+}
+	
+/*
+ * Get data from the server into a file descriptor
+ *
+ * Like http_get, but the data is written to fd as it is received instead
+ * of being returned in memory, with splice(2) when fd allows it.
+ *
+ * returns a negative error code or a positive code from the server
+ *
+ *	char *filename	name of the ressource to read 
+ *	int fd		file descriptor where the data is written
+ *	off_t *plength	address of variable which will be set to the 
+ *			length of the data written, may be NULL
+ *	char *typebuf	allocated buffer where the read data type is returned.
+ *			If NULL, the type is not returned
+ */
+extern http_retcode
+http_get_to_fd(char *filename, int fd, off_t *plength, char *typebuf)
+{
+	return httpmt_get_to_fd(&_ctx, filename, fd, plength, typebuf);
+}
+
+extern http_retcode
+httpmt_get_to_fd(http_ctx *ctx, char *filename, int fd, off_t *plength,
+		char *typebuf)
+{
+	http_retcode ret, r;
+	http_conn *c;
+	off_t length = 0;
+
+	if (ctx == NULL || fd < 0)
+		return ERRNULL;
+
+	if (plength) *plength = 0;
+	if (typebuf) *typebuf = '\0';
+
+	ret = http_query(ctx, "GET", filename, "", KEEP_OPEN, NULL, &c);
+	if (ret == OK200) {
+		if (http_read_header(c, NULL, typebuf) < 0) {
+			c->keep = 0;
+			http_release(ctx, c);
+			return http_expired(ctx, ERRRDHD);
+		}
+
+		/* the server closes the connection at the end of data */
+		if (!c->chunked && c->left < 0)
+			c->keep = 0;
+
+		r = http_body_to_fd(c, fd, &length);
+		if (r < 0) {
+			c->keep = 0;
+			ret = r;
 		}
+		if (plength)
+			*plength = length;
+		http_release(ctx, c);
 	} else if (ret >= OK0) {
-		close(fd);
+		http_skip_answer(c);
+		http_release(ctx, c);
 	}
 
+	return http_expired(ctx, ret);
+}
+
+/*
+ * Get data from the server, piece by piece
+ *
+ * Like http_get, but the data is not returned in one allocated block:
+ * fn is called with each piece of it as it is received (decoded from
+ * chunks and Content-Encoding), read in the same buffer each time, until
+ * the end or fn returns non zero. Nothing is called if the server does
+ * not answer 200.
+ *
+ * returns a negative error code, ERRABRT if fn stopped it, or a
+ * positive code from the server
+ *
+ *	char *filename	name of the ressource to read 
+ *	http_data_func fn	called with each piece of the data
+ *	void *arg	passed to fn
+ *	char *buffer	where the data is read, reused for each piece. If
+ *			NULL, a buffer of the ctx is used
+ *	int size	its size
+ *	off_t *plength	address of variable which will be set to the 
+ *			length of the data read, may be NULL
+ *	char *typebuf	allocated buffer where the read data type is returned.
+ *			If NULL, the type is not returned
+ */
+extern http_retcode
+http_get_stream(char *filename, http_data_func fn, void *arg, char *buffer,
+		int size, off_t *plength, char *typebuf)
+{
+	return httpmt_get_stream(&_ctx, filename, fn, arg, buffer, size,
+			plength, typebuf);
+}
+
+extern http_retcode
+httpmt_get_stream(http_ctx *ctx, char *filename, http_data_func fn,
+		void *arg, char *buffer, int size, off_t *plength,
+		char *typebuf)
+{
+	if (ctx == NULL || fn == NULL || (buffer && size <= 0))
+		return ERRNULL;
+
+	return http_stream_query(ctx, "GET", filename, "", NULL, fn, arg,
+			buffer, size, plength, typebuf);
+}
+
+/*
+ * Get data from the server into a buffer
+ *
+ * Like http_get, but the data is read in a buffer given instead of an
+ * allocated one. If it does not fit, ERRFULL is returned with the buffer
+ * filled.
+ *
+ * returns a negative error code or a positive code from the server
+ *
+ *	char *filename	name of the ressource to read 
+ *	char *buffer	where the data is read
+ *	int size	its size
+ *	int *plength	address of integer variable which will be set to
+ *			length of the read data, may be NULL
+ *	char *typebuf	allocated buffer where the read data type is returned.
+ *			If NULL, the type is not returned
+ */
+extern http_retcode
+http_get_into(char *filename, char *buffer, int size, int *plength,
+		char *typebuf)
+{
+	return httpmt_get_into(&_ctx, filename, buffer, size, plength, typebuf);
+}
+
+extern http_retcode
+httpmt_get_into(http_ctx *ctx, char *filename, char *buffer, int size,
+		int *plength, char *typebuf)
+{
+	http_retcode ret;
+	off_t length = 0;
+
+	if (ctx == NULL || buffer == NULL || size < 0)
+		return ERRNULL;
+
+	ret = http_stream_query(ctx, "GET", filename, "", NULL, NULL, NULL,
+			buffer, size, &length, typebuf);
+	if (plength)
+		*plength = (int) length;
 	return ret;
 }
 	
@@ -390,13 +759,9 @@ http_head(char *filename, int *plength, char *typebuf)
 extern http_retcode
 httpmt_head(http_ctx *ctx, char *filename, int *plength, char *typebuf) 
 {
-/* mostly copied from http_get : */
 	http_retcode ret;
-	 
-	char header[MAXBUF];
-	char *pc;
-	int fd;
-	int n, length=-1;
+	http_conn *c;
+	int length=-1;
 
 	if (ctx == NULL)
 		return ERRNULL;
@@ -406,40 +771,249 @@ httpmt_head(http_ctx *ctx, char *filename, int *plength, char *typebuf)
 	if (typebuf)
 		*typebuf = '\0';
 	
-	ret = http_query(ctx, "HEAD", filename, "", KEEP_OPEN, NULL, 0, &fd);
+	ret = http_query(ctx, "HEAD", filename, "", KEEP_OPEN, NULL, &c);
 
 	if (ret == OK200) {
-		while (1) {
-			n = http_read_line(fd, header, MAXBUF - 1);
-#ifdef _DEBUG
-			fputs(header, stderr);
-			putc('\n', stderr);
-#endif	
-			if (n <= 0) {
-				close(fd);
-				return ERRRDHD;
-			}
-			/* empty line ? (=> end of header) */
-			if (n > 0 && (*header) == '\0')
-				break;
-			/* try to parse some keywords : */
-			/* convert to lower case 'till a : is found or end of string */
-			for (pc = header; (*pc != ':' && *pc); pc++)
-				*pc = tolower(*pc);
-			sscanf(header, "content-length: %d", &length);
-			if (typebuf)
-				sscanf(header, "content-type: %s", typebuf);
+		if (http_read_header(c, &length, typebuf) < 0) {
+			c->keep = 0;
+			http_release(ctx, c);
+			return http_expired(ctx, ERRRDHD);
 		}
 		if (plength) 
 			*plength = length;
-		close(fd);
+		/* no body follows the header of a HEAD answer */
+		http_release(ctx, c);
 	} else if (ret >= OK0) {
-		close(fd);
+		http_skip_answer(c);
+		http_release(ctx, c);
 	}
 
-	return ret;
+	return http_expired(ctx, ret);
 }
 	
+/*
+ * Pipelined GET and HEAD requests
+ *
+ * The requests are written on one persistent connection before their
+ * answers are read, PIPE_DEPTH at most ahead, so that a batch takes about
+ * one round trip instead of one per request. If the server closes the
+ * connection before all are answered, the rest are sent again on a new
+ * one. The custom buffer EOF reader is not used.
+ *
+ * returns OK0 when all the requests have been answered, or the error 
+ * which stopped the batch (the requests not answered have it as result)
+ *
+ *	http_batch *reqs	the requests, their result, data, length
+ *				and type are set
+ *	int n			number of requests
+ */
+extern http_retcode
+http_pipeline(http_batch *reqs, int n)
+{
+	return httpmt_pipeline(&_ctx, reqs, n);
+}
+
+extern http_retcode
+httpmt_pipeline(http_ctx *ctx, http_batch *reqs, int n)
+{
+	struct iovec iov[PIPE_DEPTH];
+	http_conn *c = NULL;
+	http_batch *r;
+	char *headers, *server;
+	char buffer[MAXBUF];
+	http_retcode ret = OK0, st;
+	int proxy, port, minor, length, hlg, k, fresh = 0;
+	int sent = 0, done = 0, progress = 0;
+	long total;
+
+	if (ctx == NULL || reqs == NULL || n < 0)
+		return ERRNULL;
+
+	for (k = 0; k < n; k++) {
+		if (reqs[k].filename == NULL || reqs[k].command == NULL || 
+				(strcmp(reqs[k].command, "GET") && 
+				strcmp(reqs[k].command, "HEAD")))
+			return ERRNULL;
+		reqs[k].ret = ERRCONN;
+		reqs[k].data = NULL;
+		reqs[k].length = 0;
+		if (reqs[k].typebuf)
+			*reqs[k].typebuf = '\0';
+	}
+
+	http_arena_reset(ctx);
+	if (!(headers = (char *) http_arena_alloc(ctx, PIPE_DEPTH * MAXHDR)))
+		return ERRMEM;
+	if ((ret = http_begin(ctx)) < 0) {
+		for (k = 0; k < n; k++)
+			reqs[k].ret = ret;
+		return ret;
+	}
+
+	proxy = (ctx->proxy_server != NULL && ctx->proxy_port != 0);
+	server = proxy ? ctx->proxy_server :
+		ctx->server ? ctx->server : (char *) SERVER_DEFAULT;
+	port = proxy ? ctx->proxy_port : ctx->port;
+
+	while (done < n) {
+		if (c == NULL) {
+			/* a new connection if the previous one failed
+			 * without answering anything */
+			if (ctx->pool_max_idle > 0 && (progress > 0 || !fresh))
+				c = http_pool_get(ctx, server, port);
+			fresh = (c == NULL);
+			if (c == NULL && 
+				(c = http_connect(ctx, server, port, &ret)) == NULL)
+				break;
+			http_nonblock(c, 1);
+			c->wait = W_IDLE;
+			c->peek = 0;
+			sent = done;
+			progress = 0;
+		}
+
+		/* keep up to PIPE_DEPTH requests in flight */
+		if (sent < n && sent - done < PIPE_DEPTH) {
+			total = 0;
+			for (k = 0; sent + k < n && sent + k - done < PIPE_DEPTH; 
+					k++) {
+				r = &reqs[sent + k];
+				hlg = http_request_header(ctx, r->command, 
+					r->filename, (char *) "", 1, 
+					headers + k * MAXHDR);
+				if (hlg < 0) {
+					r->ret = ERRWRHD;
+					hlg = 0;
+				}
+				iov[k].iov_base = headers + k * MAXHDR;
+				iov[k].iov_len = hlg;
+				total += hlg;
+			}
+			if (http_send(c, iov, k, 0) != total) {
+				ret = ERRWRHD;
+				goto retry;
+			}
+			sent += k;
+		}
+
+		/* answer of the oldest request in flight */
+		r = &reqs[done];
+		if (r->ret == ERRWRHD) {
+			/* header too long, not sent */
+			done++;
+			continue;
+		}
+		st = http_read_status(c, &minor);
+		if (st == ERRPAHD) {
+			c->keep = 0;
+			ret = st;
+			break;
+		}
+		if (st < 0) {
+			ret = st;
+			goto retry;
+		}
+		c->keep = (minor >= 1);
+		c->nobody = (!strcmp(r->command, "HEAD") || st == 204 || st == 304);
+		length = -1;
+		if (http_read_header(c, &length, r->typebuf) < 0) {
+			ret = ERRRDHD;
+			goto retry;
+		}
+
+		if (st == OK200 && !c->nobody) {
+			k = http_read_data(ctx, c, length, &r->data, &r->length);
+			if (k == ERRMEM) {
+				st = ERRMEM;
+			} else if (k < 0) {
+				httpmt_free(ctx, r->data);
+				r->data = NULL;
+				r->length = 0;
+				ret = (http_retcode) k;
+				goto retry;
+			}
+		} else if (st == OK200) {
+			r->length = length > 0 ? length : 0;
+		} else if (!c->chunked && c->left < 0) {
+			/* answer up to EOF, nothing follows it */
+			c->keep = 0;
+		} else {
+			while ((k = http_read_wire(c, buffer, MAXBUF)) > 0)
+				;
+			if (k < 0)
+				c->keep = 0;
+		}
+
+		r->ret = st;
+		done++;
+		progress++;
+
+		if (!c->keep) {
+			/* server closed: the rest goes on a new connection */
+			http_release(ctx, c);
+			c = NULL;
+		}
+		continue;
+
+retry:
+		c->keep = 0;
+		http_release(ctx, c);
+		c = NULL;
+		if ((progress == 0 && fresh) || ctx->expired < 0)
+			break;
+		ret = OK0;
+	}
+
+	if (c)
+		http_release(ctx, c);
+	ret = http_expired(ctx, ret);
+	for (k = done; k < n; k++)
+		reqs[k].ret = ret;
+
+	return done == n ? OK0 : ret;
+}
+
+/*
+ * read the body of an answer in allocated memory
+ * returns OK0, ERRRDDT, ERRNOLG (no length and read error) or ERRMEM
+ *	int length	length from the header, -1 if unknown
+ *	char **pdata	address of a pointer set to the data
+ *	int *plength	address of integer variable set to its length
+ */
+extern http_retcode
+http_read_data(http_ctx *ctx, http_conn *c, int length, char **pdata,
+		int *plength)
+{
+	if (!c->chunked && length < 0) {
+		/* the server closes the connection at the end of data */
+		c->keep = 0;
+		if (http_read_buffer_eof(c, pdata, plength) == -1)
+			return ERRNOLG;
+	} else if (c->chunked || c->encoding != ENC_NONE) {
+		/* decoded straight into the allocated buffer, the length
+		 * is only known at the end */
+		if (http_read_buffer_eof(c, pdata, plength) == -1) {
+			c->keep = 0;
+			return ERRRDDT;
+		}
+	} else {
+		*plength = length;
+		if (!(*pdata = (char *) http_alloc(ctx, length > 0 ? length : 1))) {
+			*plength = 0;
+			c->keep = 0;
+			return ERRMEM;
+		}
+		if (http_read_buffer(c, *pdata, length) != length) {
+			httpmt_free(ctx, *pdata);
+			*pdata = NULL;
+			*plength = 0;
+			c->keep = 0;
+			return ERRRDDT;
+		}
+	}
+	return OK0;
+}
+
 /*
  * Delete data on the server
  *
@@ -462,7 +1036,7 @@ httpmt_delete(http_ctx *ctx, char *filename)
 	if (ctx == NULL)
 		return ERRNULL;
 	else
-		return http_query(ctx, "DELETE", filename, "", CLOSE, NULL, 0, NULL);
+		return http_query(ctx, "DELETE", filename, "", CLOSE, NULL, NULL);
 }
 	
 /*
@@ -480,352 +1054,3231 @@ extern http_retcode
 httpmt_post(http_ctx *ctx, char *filename, char *data, int length, char *type,
 			char **pdata, int *plength, char **ptype)
 {
-	int fd;
-	char *pc;
-	int n;
-	char header[MAXBUF];
-	char typebuf[MAXBUF];
-	http_retcode ret;
+	http_source src;
 
 	if (ctx == NULL)
 		return ERRNULL;
 
 	if (data == NULL || length <= 0 || pdata == NULL || plength == NULL)
 		return ERRNULL;
-	
-	*pdata = NULL;
-	*plength = 0;
 
-	header[0] = '\0';	
-	typebuf[0] = '\0';
-	
-	if (type) 
-		sprintf(header, "Content-length: %d\015\012Content-type: %.64s\015\012",
-			length, type);
-	else
-		sprintf(header, "Content-length: %d\015\012", length);
-	
-	ret = http_query(ctx, "POST", filename, header, KEEP_OPEN, data, length, &fd);
-	
-	if (ret==OK200) { 
-		while (1) {
-			n = http_read_line(fd, header, MAXBUF - 1);
-#ifdef _DEBUG
-			fputs(header, stderr);
-			putc('\n', stderr);
-#endif	
-			if (n <= 0) {
-				close(fd);
-				return ERRRDHD;
-			}
-	
-			/* empty line ? (=> end of header) */
-			if (n > 0 && (*header) =='\0')
-				break;
-	
-			/* try to parse some keywords : */
-			/* convert to lower case 'till a : is found or end of string */
-			for (pc = header; (*pc != ':' && *pc); pc++)
-				*pc = tolower(*pc);
-			sscanf(header, "content-length: %d", plength);
-			sscanf(header, "content-type: %s", typebuf);
-		}
-	
-		if (ptype)
-			*ptype = strdup(typebuf);
-		
-		if (*plength <= 0) {
-			if (ctx->reader) {
-				(*ctx->reader)(fd);
-			} else {
-				if (http_read_buffer_eof(fd, pdata, plength) == -1) {
-					ret = ERRNOLG;
-					if (ptype) {
-						free(*ptype);
-						*ptype = NULL;
-					}
-            			}
-			}
+	src.data = data;
+	src.length = length;
+	src.fd = -1;
+	src.produce = NULL;
+
+	return http_post_query(ctx, filename, &src, type, pdata, plength, ptype);
+}
+
+/*
+* post data read from a file descriptor, see http_put_fd
+*/
+extern http_retcode
+http_post_fd(char *filename, int fd, off_t length, char *type, char **pdata,
+		int *plength, char **ptype)
+{
+	return httpmt_post_fd(&_ctx, filename, fd, length, type, pdata, plength,
+				ptype);
+}
+
+extern http_retcode
+httpmt_post_fd(http_ctx *ctx, char *filename, int fd, off_t length,
+		char *type, char **pdata, int *plength, char **ptype)
+{
+	http_source src;
+
+	if (ctx == NULL)
+		return ERRNULL;
+
+	if (fd < 0 || pdata == NULL || plength == NULL)
+		return ERRNULL;
+
+	memset(&src, 0, sizeof(src));
+	src.fd = fd;
+	src.fd_length = http_fd_length(fd, length);
+
+	return http_post_query(ctx, filename, &src, type, pdata, plength, ptype);
+}
+
+/*
+ * post data made by a function, see http_put_producer
+ */
+extern http_retcode
+http_post_producer(char *filename, http_producer fn, void *arg, off_t length,
+		char *type, char **pdata, int *plength, char **ptype)
+{
+	return httpmt_post_producer(&_ctx, filename, fn, arg, length, type,
+			pdata, plength, ptype);
+}
+
+extern http_retcode
+httpmt_post_producer(http_ctx *ctx, char *filename, http_producer fn,
+		void *arg, off_t length, char *type, char **pdata, int *plength,
+		char **ptype)
+{
+	http_source src;
+
+	if (ctx == NULL)
+		return ERRNULL;
+
+	if (fn == NULL || pdata == NULL || plength == NULL)
+		return ERRNULL;
+
+	memset(&src, 0, sizeof(src));
+	src.fd = -1;
+	src.fd_length = length < 0 ? -1 : length;
+	src.produce = fn;
+	src.produce_arg = arg;
+
+	return http_post_query(ctx, filename, &src, type, pdata, plength, ptype);
+}
+
+/*
+ * post data, the answer being passed to fn piece by piece, see
+ * http_get_stream
+ */
+extern http_retcode
+http_post_stream(char *filename, char *data, int length, char *type,
+		http_data_func fn, void *arg, char *buffer, int size,
+		off_t *plength, char *typebuf)
+{
+	return httpmt_post_stream(&_ctx, filename, data, length, type, fn, arg,
+			buffer, size, plength, typebuf);
+}
+
+extern http_retcode
+httpmt_post_stream(http_ctx *ctx, char *filename, char *data, int length,
+		char *type, http_data_func fn, void *arg, char *buffer,
+		int size, off_t *plength, char *typebuf)
+{
+	http_source src;
+	char header[MAXBUF];
+	http_retcode ret;
+
+	if (ctx == NULL)
+		return ERRNULL;
+
+	if (data == NULL || length <= 0 || fn == NULL || (buffer && size <= 0))
+		return ERRNULL;
+
+	src.data = data;
+	src.length = length;
+	src.fd = -1;
+	src.produce = NULL;
+
+	header[0] = '\0';
+	if ((ret = http_source_header(ctx, &src, header, type, 0)) < 0)
+		return ret;
+
+	return http_stream_query(ctx, "POST", filename, header, &src, fn, arg,
+			buffer, size, plength, typebuf);
+}
+
+/*
+ * send a query and pass the body of a 200 answer to fn, read piece by
+ * piece in buffer, or read all of it in buffer if fn is NULL
+ * returns as http_get_stream, or ERRFULL if fn is NULL and the body does
+ * not fit in buffer
+ */
+static http_retcode
+http_stream_query(http_ctx *ctx, const char *command, char *filename,
+		const char *header, http_source *src, http_data_func fn, void *arg, char *buffer,
+		int size, off_t *plength, char *typebuf)
+{
+	http_retcode ret;
+	http_conn *c;
+	off_t total = 0;
+	int n, full = 0;
+	char probe;
+
+	if (plength) *plength = 0;
+	if (typebuf) *typebuf = '\0';
+
+	ret = http_query(ctx, command, filename, header, KEEP_OPEN, src, &c);
+	if (src)
+		httpmt_free(ctx, src->copy);
+	if (ret != OK200) {
+		if (ret >= OK0) {
+			http_skip_answer(c);
+			http_release(ctx, c);
+		}
+		return http_expired(ctx, ret);
+	}
+
+	if (http_read_header(c, NULL, typebuf) < 0) {
+		c->keep = 0;
+		http_release(ctx, c);
+		return http_expired(ctx, ERRRDHD);
+	}
+	/* the server closes the connection at the end of data */
+	if (!c->chunked && c->left < 0)
+		c->keep = 0;
+
+	/* scratch memory of the ctx, kept from a request to the next */
+	if (buffer == NULL) {
+		size = XFER_BLOCK;
+		if ((buffer = (char *) http_arena_alloc(ctx, size)) == NULL) {
+			c->keep = 0;
+			http_release(ctx, c);
+			return ERRMEM;
+		}
+	}
+
+	for (;;) {
+		if (fn)
+			n = http_read_body(c, buffer, size);
+		else if (total < size)
+			n = http_read_body(c, buffer + total, size - total);
+		else
+			/* the buffer is full, anything more does not fit */
+			n = full = http_read_body(c, &probe, 1);
+
+		if (n < 0) {
+			if (errno != ECONNRESET || c->chunked || c->left >= 0)
+				ret = ERRRDDT;
+			break;
+		}
+		if (n == 0)
+			break;
+		if (full) {
+			ret = ERRFULL;
+			break;
+		}
+		total += n;
+		if (fn && (*fn)(buffer, n, arg) != 0) {
+			ret = ERRABRT;
+			break;
+		}
+	}
+
+	if (ret != OK200)
+		c->keep = 0;
+	if (plength)
+		*plength = total;
+	http_release(ctx, c);
+	return http_expired(ctx, ret);
+}
+
+/*
+ * send a POST query and read its answer, for http_post and http_post_fd
+ */
+static http_retcode
+http_post_query(http_ctx *ctx, char *filename, http_source *src, char *type,
+			char **pdata, int *plength, char **ptype)
+{
+	http_conn *c;
+	int n;
+	char header[MAXBUF];
+	char typebuf[MAXBUF];
+	http_retcode ret;
+
+	*pdata = NULL;
+	*plength = 0;
 
-			close(fd);
+	header[0] = '\0';	
+	typebuf[0] = '\0';
+	
+	if ((ret = http_source_header(ctx, src, header, type, 0)) < 0)
+		return ret;
+	
+	ret = http_query(ctx, "POST", filename, header, KEEP_OPEN, src, &c);
+	httpmt_free(ctx, src->copy);
+	
+	if (ret==OK200) { 
+		*plength = -1;
+		if (http_read_header(c, plength, typebuf) < 0) {
+			*plength = 0;
+			c->keep = 0;
+			http_release(ctx, c);
+			return http_expired(ctx, ERRRDHD);
+		}
+	
+		if (!c->chunked && *plength < 0 && ctx->reader) {
+			/* the server closes the connection at the end of data */
+			*plength = 0;
+			c->keep = 0;
+			http_nonblock(c, 0);
+			(*ctx->reader)(c->fd);
 		} else {
-			if (!(*pdata = (char *) malloc(*plength))) {
-				close(fd);
-				if (ptype) {
-					free(*ptype);
-					*ptype = NULL;
-				}
+			n = http_read_data(ctx, c, *plength, pdata, plength);
+			if (n < 0)
+				ret = (http_retcode) n;
+		}
+		if (ptype && ret == OK200)
+			*ptype = http_strdup(ctx, typebuf);
+		http_release(ctx, c);
+	} else if (ret >= OK0) {
+		http_skip_answer(c);
+		http_release(ctx, c);
+	}
+	
+	return http_expired(ctx, ret);
+}
+
+/*
+ * header describing the data of a PUT or POST
+ *	char *header	placeholder for the header, MAXBUF long
+ *	off_t length	data length, -1 if unknown: sent in chunks
+ *	char *type	type of the data, may be NULL
+ *	int overwrite	flag to request to overwrite the ressource
+ */
+extern void
+http_data_header(char *header, off_t length, char *type, int overwrite)
+{
+	int n;
+
+	if (length >= 0)
+		n = sprintf(header, "Content-length: %lld\015\012",
+			(long long) length);
+	else
+		n = sprintf(header, "Transfer-Encoding: chunked\015\012");
+	if (type)
+		n += sprintf(header + n, "Content-type: %.64s\015\012", type);
+	if (overwrite)
+		sprintf(header + n, "Control: overwrite=1\015\012");
+}
+
+/*
+ * length of the data to send from a file descriptor: what's left of a
+ * regular file if unknown
+ */
+static off_t
+http_fd_length(int fd, off_t length)
+{
+	struct stat st;
+	off_t pos;
+
+	if (length >= 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return length;
+	if ((pos = lseek(fd, 0, SEEK_CUR)) < 0)
+		pos = 0;
+	return st.st_size > pos ? st.st_size - pos : 0;
+}
+
+/*
+ * header describing the data of a PUT or POST, see http_data_header.
+ * If asked for (http_set_upload_compression) the data is gzip compressed:
+ * in memory data up to XFER_BLOCK long here, in a copy sent with its
+ * length, the rest while it is sent, in chunks.
+ * returns OK0 or ERRMEM
+ *	http_source *src	data to send, gzip and copy are set
+ *	char *header		placeholder for the header, MAXBUF long
+ */
+static http_retcode
+http_source_header(http_ctx *ctx, http_source *src, char *header,
+		char *type, int overwrite)
+{
+	off_t length = (src->fd >= 0 || src->produce) ? src->fd_length :
+		src->length;
+#ifdef HAVE_ZLIB
+	z_stream *zs;
+	uLong bound;
+#endif
+
+	src->gzip = 0;
+	src->copy = NULL;
+#ifdef HAVE_ZLIB
+	/* nothing to gain on empty data */
+	if (ctx->upload_level > 0 && length != 0) {
+		if (src->fd < 0 && !src->produce && length <= XFER_BLOCK) {
+			if ((zs = http_deflater(ctx)) == NULL)
+				return ERRMEM;
+			bound = deflateBound(zs, length);
+			if (!(src->copy = (char *) http_alloc(ctx, bound)))
+				return ERRMEM;
+			zs->next_in = (Bytef *) src->data;
+			zs->avail_in = length;
+			zs->next_out = (Bytef *) src->copy;
+			zs->avail_out = bound;
+			if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+				httpmt_free(ctx, src->copy);
+				src->copy = NULL;
 				return ERRMEM;
 			}
+			src->data = src->copy;
+			src->length = length = zs->total_out;
+		} else {
+			src->gzip = 1;
+			length = -1;
+		}
+	}
+#endif
+	http_data_header(header, length, type, overwrite);
+	if (src->gzip || src->copy)
+		strcat(header, "Content-Encoding: gzip\015\012");
+	return OK0;
+}
+
+/**
+ * set external base64 encoder for basic auth
+ */
+extern void
+http_set_base64_encoder(http_base64_encoder enc)
+{
+	httpmt_set_base64_encoder(&_ctx, enc);
+}
+
+extern void
+httpmt_set_base64_encoder(http_ctx *ctx, http_base64_encoder enc)
+{
+	if (ctx != NULL)
+		ctx->b64_enc = enc;
+}
+
+/**
+ * set basic auth for use in all requests, calls external
+ * base64 encoder
+ */
+extern http_retcode
+http_set_basic_auth(char *user, char *pass)
+{
+	return httpmt_set_basic_auth(&_ctx, user, pass);
+}
+
+extern http_retcode
+httpmt_set_basic_auth(http_ctx *ctx, char *user, char *pass)
+{
+	http_retcode r = OK0;
+	char userpass[MAXBUF];
+	char *b64;
+
+	if (ctx == NULL)
+		return ERRNULL;
+
+	if (ctx->b64_enc == NULL || user == NULL || pass == NULL)
+		return ERRNULL;
+
+	snprintf(userpass, MAXBUF, "%s:%s", user, pass);
+	if ((*ctx->b64_enc)(userpass, &b64) == -1)
+		return ERRMEM;
+
+	if (ctx->b64_auth)
+		free(ctx->b64_auth);
+
+	ctx->b64_auth = b64;
+
+	return r;
+}
+/**
+ * set custom buffer reader, given the socket of the answers of http_get
+ * and http_post without length. See http_get_stream for data of any
+ * answer, decoded.
+ */
+extern void
+http_set_buffer_eof_reader(http_buffer_eof_reader reader)
+{
+	return httpmt_set_buffer_eof_reader(&_ctx, reader);
+}
+
+extern void
+httpmt_set_buffer_eof_reader(http_ctx *ctx, http_buffer_eof_reader reader)
+{
+	if (ctx != NULL)
+		ctx->reader = reader;
+}
 	
-			n = http_read_buffer(fd, *pdata, *plength);
-			close(fd);
-	
-			if (n != *plength) {
-				free(*pdata);
-				*pdata = NULL;
-				if (ptype) {
-					free(*ptype);
-					*ptype = NULL;
-				}
+/**
+ * enable the keep-alive pool: up to max_idle connections are kept open
+ * for max_age seconds and reused by following queries to the same server.
+ * max_idle = 0 disables it (the default), max_age <= 0 uses a default.
+ */
+extern void
+http_set_keepalive(int max_idle, int max_age)
+{
+	httpmt_set_keepalive(&_ctx, max_idle, max_age);
+}
+
+extern void
+httpmt_set_keepalive(http_ctx *ctx, int max_idle, int max_age)
+{
+	http_conn *c;
+
+	if (ctx == NULL)
+		return;
+
+	ctx->pool_max_idle = max_idle > 0 ? max_idle : 0;
+	ctx->pool_max_age = max_age > 0 ? max_age : POOL_MAX_AGE;
+
+	if (ctx->pool_max_idle == 0) {
+		while ((c = ctx->pool) != NULL) {
+			ctx->pool = c->next;
+			http_conn_close(c);
+		}
+	}
+}
+
+/**
+ * send PUT and POST data of at least min_length bytes with MSG_ZEROCOPY
+ * (Linux), the pages are not copied into the kernel. min_length = 0 
+ * disables it (the default), worth it for data of some hundreds of KB.
+ */
+extern void
+http_set_zerocopy(int min_length)
+{
+	httpmt_set_zerocopy(&_ctx, min_length);
+}
+
+extern void
+httpmt_set_zerocopy(http_ctx *ctx, int min_length)
+{
+	if (ctx != NULL)
+		ctx->zerocopy_min = min_length > 0 ? min_length : 0;
+}
+
+/**
+ * run the requests of the multi handles of the ctx with io_uring (Linux),
+ * entries is the size of the submission queue, 0 uses epoll (the 
+ * default). epoll is also used when io_uring is not available.
+ */
+extern void
+http_set_io_uring(int entries)
+{
+	httpmt_set_io_uring(&_ctx, entries);
+}
+
+extern void
+httpmt_set_io_uring(http_ctx *ctx, int entries)
+{
+	if (ctx != NULL)
+		ctx->uring_entries = entries > 0 ? entries : 0;
+}
+
+/**
+ * collect the phase times, bytes and system calls of each request of
+ * http_get, http_put, ... (not of the multi handles nor http_pipeline)
+ * into *stats, overwritten by the next request. fn, if not NULL, is
+ * called with it when a request is over. stats = NULL stops it.
+ */
+extern void
+http_set_stats(http_stats *stats, http_stats_func fn, void *arg)
+{
+	httpmt_set_stats(&_ctx, stats, fn, arg);
+}
+
+extern void
+httpmt_set_stats(http_ctx *ctx, http_stats *stats, http_stats_func fn,
+		void *arg)
+{
+	if (ctx == NULL)
+		return;
+	ctx->stats = stats;
+	ctx->stats_fn = stats ? fn : NULL;
+	ctx->stats_arg = arg;
+}
+
+/**
+ * set the deadlines of the requests, in milliseconds (0 = none): to
+ * connect, from the request sent to the first byte of the answer, 
+ * without progress sending or receiving and for the whole request.
+ * A request running out of time fails with ERRCNTO, ERRRDTO or ERRDEAD.
+ * The host name lookup is not bounded. t = NULL removes them.
+ */
+extern void
+http_set_timeouts(const http_timeouts *t)
+{
+	httpmt_set_timeouts(&_ctx, t);
+}
+
+extern void
+httpmt_set_timeouts(http_ctx *ctx, const http_timeouts *t)
+{
+	if (ctx == NULL)
+		return;
+	if (t)
+		ctx->timeouts = *t;
+	else
+		memset(&ctx->timeouts, 0, sizeof(http_timeouts));
+}
+
+/**
+ * set the deadlines of the next request only, see http_set_timeouts
+ */
+extern void
+http_set_next_timeouts(const http_timeouts *t)
+{
+	httpmt_set_next_timeouts(&_ctx, t);
+}
+
+extern void
+httpmt_set_next_timeouts(http_ctx *ctx, const http_timeouts *t)
+{
+	if (ctx == NULL)
+		return;
+	ctx->next_set = (t != NULL);
+	if (t)
+		ctx->next_timeouts = *t;
+}
+
+/**
+ * cancel the request in progress on the ctx, from any thread: it fails
+ * with ERRCANC as soon as it would wait for the server. If no request
+ * is in progress, the next one is cancelled.
+ */
+extern void
+http_cancel(void)
+{
+	httpmt_cancel(&_ctx);
+}
+
+extern void
+httpmt_cancel(http_ctx *ctx)
+{
+	unsigned long long one = 1;
+	int fd;
+
+	if (ctx == NULL)
+		return;
+	__atomic_store_n(&ctx->cancelled, 1, __ATOMIC_SEQ_CST);
+	if ((fd = __atomic_load_n(&ctx->cancel_fd, __ATOMIC_SEQ_CST)) > 0 &&
+			write(fd - 1, &one, sizeof(one)) < 0)
+		;
+}
+
+/**
+ * ask for gzip or deflate compressed answers (Accept-Encoding), which
+ * are decoded as they are received: the data, lengths and stats bytes
+ * returned are those of the decoded body, the stats also have its
+ * encoded size. A custom buffer EOF reader gets the body as sent.
+ * Does nothing if the library is built without zlib (HAVE_ZLIB).
+ */
+extern void
+http_set_compression(int on)
+{
+	httpmt_set_compression(&_ctx, on);
+}
+
+extern void
+httpmt_set_compression(http_ctx *ctx, int on)
+{
+	if (ctx == NULL)
+		return;
+#ifdef HAVE_ZLIB
+	ctx->compression = on;
+#endif
+}
+
+/**
+ * send the data of PUT and POST queries gzip compressed (Content-Encoding)
+ * at a zlib level from 1 (fastest) to 9 (smallest), or as is if level
+ * is 0. Data of unknown compressed length is sent in chunks, the server
+ * must accept them. Does nothing if the library is built without zlib
+ * (HAVE_ZLIB).
+ */
+extern void
+http_set_upload_compression(int level)
+{
+	httpmt_set_upload_compression(&_ctx, level);
+}
+
+extern void
+httpmt_set_upload_compression(http_ctx *ctx, int level)
+{
+	if (ctx == NULL)
+		return;
+#ifdef HAVE_ZLIB
+	if (level < 0)
+		level = 0;
+	ctx->upload_level = level > 9 ? 9 : level;
+#endif
+}
+
+/**
+ * keep the answers of http_get in a response cache (see http_cache_new),
+ * or not if cache is NULL. A fresh answer is returned without query and
+ * leaves no header for http_header, a stale one is asked again with
+ * If-None-Match and If-Modified-Since. The cache is not used with a
+ * buffer eof reader. http_cleanup does not free it.
+ */
+extern void
+http_set_cache(http_cache *cache)
+{
+	httpmt_set_cache(&_ctx, cache);
+}
+
+extern void
+httpmt_set_cache(http_ctx *ctx, http_cache *cache)
+{
+	if (ctx == NULL)
+		return;
+	ctx->cache = cache;
+}
+
+/**
+ * keep the answers of httpmt_get_view in a disk cache (see
+ * http_disk_cache_open), or not if dc is NULL. http_cleanup does not
+ * close it.
+ */
+extern void
+http_set_disk_cache(http_disk_cache *dc)
+{
+	httpmt_set_disk_cache(&_ctx, dc);
+}
+
+extern void
+httpmt_set_disk_cache(http_ctx *ctx, http_disk_cache *dc)
+{
+	if (ctx == NULL)
+		return;
+	ctx->disk_cache = dc;
+}
+
+/**
+ * close pooled connections and free memory owned by the ctx
+ */
+extern void
+http_cleanup(void)
+{
+	httpmt_cleanup(&_ctx);
+}
+
+extern void
+httpmt_cleanup(http_ctx *ctx)
+{
+	if (ctx == NULL)
+		return;
+
+	http_answer_release(ctx);
+	httpmt_set_keepalive(ctx, 0, 0);
+	if (ctx->cancel_fd > 0) {
+		close(ctx->cancel_fd - 1);
+		ctx->cancel_fd = 0;
+	}
+
+	httpmt_free(ctx, ctx->server);
+	ctx->server = NULL;
+	httpmt_free(ctx, ctx->proxy_server);
+	ctx->proxy_server = NULL;
+	/* from the base64 encoder */
+	free(ctx->b64_auth);
+	ctx->b64_auth = NULL;
+
+#ifdef HAVE_ZLIB
+	if (ctx->deflate) {
+		deflateEnd((z_stream *) ctx->deflate);
+		httpmt_free(ctx, ctx->deflate);
+		ctx->deflate = NULL;
+	}
+#endif
+	http_arena_reset(ctx);
+	httpmt_free(ctx, ctx->arena);
+	ctx->arena = NULL;
+}
+
+/**
+ * set the allocator of the memory owned by the ctx and of the data 
+ * returned by it (filename, GET/POST data and type), which must then be 
+ * freed with http_free. The three functions are given, or none to use
+ * malloc(3) & co. To be set before anything is allocated, i.e. before the
+ * first http_parse_url.
+ * returns OK0, or ERRNULL if only some of the functions are given
+ */
+extern http_retcode
+http_set_allocator(http_malloc_func m, http_realloc_func r, http_free_func f,
+			void *opaque)
+{
+	return httpmt_set_allocator(&_ctx, m, r, f, opaque);
+}
+
+extern http_retcode
+httpmt_set_allocator(http_ctx *ctx, http_malloc_func m, http_realloc_func r,
+			http_free_func f, void *opaque)
+{
+	/* memory of one allocator must not be given to another */
+	if (ctx == NULL || (m == NULL) != (r == NULL) || 
+			(m == NULL) != (f == NULL))
+		return ERRNULL;
+
+	ctx->malloc_fn = m;
+	ctx->realloc_fn = r;
+	ctx->free_fn = f;
+	ctx->alloc_opaque = opaque;
+	return OK0;
+}
+
+/**
+ * free memory returned by the library
+ */
+extern void
+http_free(void *ptr)
+{
+	httpmt_free(&_ctx, ptr);
+}
+
+extern void
+httpmt_free(http_ctx *ctx, void *ptr)
+{
+	if (ptr == NULL)
+		return;
+	if (ctx && ctx->free_fn)
+		(*ctx->free_fn)(ptr, ctx->alloc_opaque);
+	else
+		free(ptr);
+}
+
+extern void *
+http_alloc(http_ctx *ctx, size_t size)
+{
+	if (ctx->malloc_fn)
+		return (*ctx->malloc_fn)(size, ctx->alloc_opaque);
+	return malloc(size);
+}
+
+extern void *
+http_realloc(http_ctx *ctx, void *ptr, size_t size)
+{
+	if (ctx->realloc_fn)
+		return (*ctx->realloc_fn)(ptr, size, ctx->alloc_opaque);
+	return realloc(ptr, size);
+}
+
+extern char *
+http_strdup(http_ctx *ctx, const char *s)
+{
+	size_t n = strlen(s) + 1;
+	char *d;
+
+	if ((d = (char *) http_alloc(ctx, n)) != NULL)
+		memcpy(d, s, n);
+	return d;
+}
+
+/*
+ * get scratch memory for the current request from the ctx arena, 
+ * valid up to the next query on the ctx (http_arena_reset)
+ * returns NULL if out of memory
+ */
+static void *
+http_arena_alloc(http_ctx *ctx, size_t size)
+{
+	http_arena *a = ctx->arena;
+	size_t block;
+	void *p;
+
+	size = (size + 15) & ~(size_t) 15;
+	if (a == NULL || a->size - a->used < size) {
+		block = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+		a = (http_arena *) http_alloc(ctx, 
+			offsetof(http_arena, data) + block);
+		if (a == NULL)
+			return NULL;
+		a->next = ctx->arena;
+		a->size = block;
+		a->used = 0;
+		ctx->arena = a;
+	}
+	p = a->data + a->used;
+	a->used += size;
+	return p;
+}
+
+/*
+ * make all the arena memory available again, only the largest block is 
+ * kept so that the next requests allocate nothing
+ */
+static void
+http_arena_reset(http_ctx *ctx)
+{
+	http_arena *a, *keep = NULL;
+
+	while ((a = ctx->arena) != NULL) {
+		ctx->arena = a->next;
+		if (keep == NULL || a->size > keep->size) {
+			if (keep)
+				httpmt_free(ctx, keep);
+			keep = a;
+		} else {
+			httpmt_free(ctx, a);
+		}
+	}
+	if (keep) {
+		keep->next = NULL;
+		keep->used = 0;
+	}
+	ctx->arena = keep;
+}
+
+/*
+ * monotonic clock in seconds, used for pool ages
+ */
+static time_t
+http_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/*
+ * monotonic clock in nanoseconds, used for stats
+ */
+static long long
+http_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * account for a system call sending (out) or receiving n bytes
+ */
+static void
+http_stats_io(http_stats *st, int out, long n)
+{
+	if (out) {
+		st->send_calls++;
+		if (n > 0)
+			st->bytes_sent += n;
+		return;
+	}
+	st->recv_calls++;
+	if (n > 0) {
+		if (st->bytes_received == 0)
+			st->first_byte = http_nsec();
+		st->bytes_received += n;
+	}
+}
+
+/*
+ * the request of the ctx is over, on connection c if not NULL
+ */
+static void
+http_stats_end(http_ctx *ctx, http_conn *c)
+{
+	http_stats *st = ctx->stats;
+#if defined(TCP_INFO)
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+#endif
+
+	if (c) {
+		st = c->stats;
+		c->stats = NULL;
+#if defined(TCP_INFO)
+		memset(&ti, 0, sizeof(ti));
+		if (c->fd >= 0 && getsockopt(c->fd, IPPROTO_TCP, TCP_INFO,
+				&ti, &len) == 0) {
+			st->rtt = ti.tcpi_rtt;
+			st->rttvar = ti.tcpi_rttvar;
+			st->retransmits = ti.tcpi_total_retrans;
+			st->snd_cwnd = ti.tcpi_snd_cwnd;
+			st->snd_mss = ti.tcpi_snd_mss;
+		}
+#endif
+	}
+	st->end = http_nsec();
+	if (ctx->stats_fn)
+		ctx->stats_fn(st, ctx->stats_arg);
+}
+
+/*
+ * a request starts: its deadlines are set
+ * returns OK0, ERRCANC if it was cancelled beforehand or ERRMEM
+ */
+static http_retcode
+http_begin(http_ctx *ctx)
+{
+	int fd;
+
+	ctx->expired = OK0;
+	ctx->cur = ctx->next_set ? ctx->next_timeouts : ctx->timeouts;
+	ctx->next_set = 0;
+	ctx->deadline = ctx->cur.total > 0 ?
+		http_nsec() + ctx->cur.total * 1000000LL : 0;
+
+	/* http_cancel writes to it to end a wait */
+	if (ctx->cancel_fd == 0) {
+		if ((fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+			return ERRMEM;
+		__atomic_store_n(&ctx->cancel_fd, fd + 1, __ATOMIC_SEQ_CST);
+	}
+	if (__atomic_load_n(&ctx->cancelled, __ATOMIC_SEQ_CST))
+		return http_expired(ctx, ERRCANC);
+	return OK0;
+}
+
+/*
+ * error code of a request which failed with ret: why it stopped
+ * waiting if it ran out of time or was cancelled. Either is over once
+ * reported, the connections of the next requests can be kept.
+ */
+extern http_retcode
+http_expired(http_ctx *ctx, http_retcode ret)
+{
+	unsigned long long n;
+
+	if (ret == ERRCANC || (ret < 0 && ctx->expired == ERRCANC)) {
+		__atomic_store_n(&ctx->cancelled, 0, __ATOMIC_SEQ_CST);
+		if (read(ctx->cancel_fd - 1, &n, sizeof(n)) < 0)
+			;
+		ctx->expired = OK0;
+		return ERRCANC;
+	}
+	if (ret < 0 && ctx->expired < 0) {
+		ret = ctx->expired;
+		ctx->expired = OK0;
+	}
+	return ret;
+}
+
+/*
+ * wait for a descriptor of the request in progress, or its cancellation
+ * returns 0 when fd is ready, -1 if the time is out (ETIMEDOUT), the
+ * request cancelled (ECANCELED) or poll failed, ctx->expired is then set
+ *	short events	poll events waited for
+ *	int timeout	milliseconds, 0 = none, the deadline of the whole
+ *			request applies anyway
+ *	http_retcode why	expired code when timeout runs out
+ */
+static int
+http_poll(http_ctx *ctx, int fd, short events, int timeout, http_retcode why)
+{
+	struct pollfd pfd[2];
+	long long now, end = 0;
+	int n;
+
+	now = http_nsec();
+	if (timeout > 0)
+		end = now + timeout * 1000000LL;
+	if (ctx->deadline && (end == 0 || ctx->deadline <= end)) {
+		end = ctx->deadline;
+		why = ERRDEAD;
+	}
+
+	pfd[0].fd = fd;
+	pfd[0].events = events;
+	pfd[1].fd = ctx->cancel_fd - 1;
+	pfd[1].events = POLLIN;
+	while (1) {
+		if (__atomic_load_n(&ctx->cancelled, __ATOMIC_SEQ_CST)) {
+			ctx->expired = ERRCANC;
+			errno = ECANCELED;
+			return -1;
+		}
+		if (end && now >= end) {
+			ctx->expired = why;
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		pfd[0].revents = pfd[1].revents = 0;
+		n = poll(pfd, ctx->cancel_fd > 0 ? 2 : 1,
+			end ? (int) ((end - now + 999999) / 1000000) : -1);
+		if (n < 0 && errno != EINTR)
+			return -1;
+		if (n > 0 && pfd[0].revents)
+			return 0;
+		now = http_nsec();
+	}
+}
+
+/*
+ * wait for a descriptor of a request other than its connection, a pipe
+ * the data is read from or the error queue of the socket, under the
+ * idle deadline
+ * returns the poll events of fd, or -1 as http_poll
+ */
+static int
+http_poll_events(http_ctx *ctx, int fd, short events)
+{
+	struct pollfd pfd;
+
+	if (http_poll(ctx, fd, events, ctx->cur.idle, ERRRDTO) < 0)
+		return -1;
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) < 0)
+		return 0;
+	return pfd.revents;
+}
+
+/*
+ * wait until a connection of a request can be read (events = POLLIN)
+ * or written (POLLOUT), under the deadline of what it waits for
+ * returns 0 or -1, see http_poll
+ */
+extern int
+http_wait(http_conn *c, short events)
+{
+	http_ctx *ctx = c->ctx;
+
+	if (c->async) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (c->wait == W_CONNECT)
+		return http_poll(ctx, c->fd, events, ctx->cur.connect, ERRCNTO);
+	if (c->wait == W_FIRST && events == POLLIN)
+		return http_poll(ctx, c->fd, events, ctx->cur.first_byte,
+				ERRRDTO);
+	return http_poll(ctx, c->fd, events, ctx->cur.idle, ERRRDTO);
+}
+
+/*
+ * set or clear O_NONBLOCK on a connection
+ * the requests of the ctx wait in poll, under their deadlines, the
+ * multi handles have their own needs.
+ */
+extern void
+http_nonblock(http_conn *c, int on)
+{
+	int flags;
+
+	if (c->nonblock == on || (flags = fcntl(c->fd, F_GETFL)) < 0)
+		return;
+	if (fcntl(c->fd, F_SETFL, on ? flags | O_NONBLOCK : 
+			flags & ~O_NONBLOCK) == 0)
+		c->nonblock = on;
+}
+
+/*
+ * connect to the first address of addrs that answers, happy eyeballs
+ * style (RFC 8305): a new attempt starts every HE_DELAY ms, or as soon as
+ * one fails, while the earlier ones go on; the first one connected wins
+ * and the others are closed. The outcome of each address goes to the
+ * resolver cache, for the order of the next connections: a loser which
+ * started first counts as a failure.
+ * returns the socket, non-blocking, or -1 and the error code in *pret
+ */
+static int
+http_race(http_ctx *ctx, char *server_name, http_addrs *addrs, 
+	http_retcode *pret)
+{
+	struct pollfd pfd[HTTP_MAX_ADDRS + 1];
+	int addr[HTTP_MAX_ADDRS];
+	long long started[HTTP_MAX_ADDRS], won = 0;
+	long long now, end = 0, next_start = 0, wait;
+	http_retcode why = ERRCNTO;
+	int i, k, n = 0, next = 0, s = -1, err;
+	socklen_t len;
+
+	*pret = ERRCONN;
+	now = http_nsec();
+	if (ctx->cur.connect > 0)
+		end = now + ctx->cur.connect * 1000000LL;
+	if (ctx->deadline && (end == 0 || ctx->deadline <= end)) {
+		end = ctx->deadline;
+		why = ERRDEAD;
+	}
+
+	while (s < 0) {
+		if (__atomic_load_n(&ctx->cancelled, __ATOMIC_SEQ_CST)) {
+			ctx->expired = *pret = ERRCANC;
+			break;
+		}
+
+		/* next attempt */
+		if (next < addrs->n && (n == 0 || now >= next_start)) {
+			k = next++;
+			if ((s = socket(addrs->addr[k].ss_family, 
+					SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+				*pret = ERRSOCK;
+				continue;
+			}
+			setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, 0, 0);
+			if (connect(s, (const struct sockaddr *) &addrs->addr[k],
+					addrs->len[k]) == 0) {
+				http_dns_report(server_name, &addrs->addr[k], 1);
+				break;
+			}
+			if (errno != EINPROGRESS) {
+				http_dns_report(server_name, &addrs->addr[k], 0);
+				close(s);
+				s = -1;
+				continue;
+			}
+			pfd[n].fd = s;
+			pfd[n].events = POLLOUT;
+			started[n] = now;
+			addr[n++] = k;
+			s = -1;
+			next_start = now + HE_DELAY * 1000000LL;
+		}
+		if (n == 0)
+			break;
+		if (end && now >= end) {
+			ctx->expired = *pret = why;
+			break;
+		}
+
+		/* wait for one of them, the cancellation or the time to
+		 * start the next one */
+		wait = -1;
+		if (end)
+			wait = end - now;
+		if (next < addrs->n && (wait < 0 || next_start - now < wait))
+			wait = next_start - now;
+		pfd[n].fd = ctx->cancel_fd - 1;
+		pfd[n].events = POLLIN;
+		for (i = 0; i <= n; i++)
+			pfd[i].revents = 0;
+		if (poll(pfd, ctx->cancel_fd > 0 ? n + 1 : n, wait < 0 ? -1 :
+				(int) ((wait + 999999) / 1000000)) < 0 &&
+				errno != EINTR)
+			break;
+		now = http_nsec();
+
+		for (i = 0; i < n; i++) {
+			if (pfd[i].revents == 0)
+				continue;
+			len = sizeof(err);
+			if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err,
+					&len) < 0)
+				err = errno;
+			if (err == 0) {
+				http_dns_report(server_name, 
+					&addrs->addr[addr[i]], 1);
+				s = pfd[i].fd;
+				won = started[i];
+				pfd[i] = pfd[--n];
+				addr[i] = addr[n];
+				started[i] = started[n];
+				break;
+			}
+			/* failed: the next one can start */
+			http_dns_report(server_name, &addrs->addr[addr[i]], 0);
+			close(pfd[i].fd);
+			pfd[i] = pfd[--n];
+			addr[i] = addr[n];
+			started[i] = started[n];
+			i--;
+			next_start = now;
+		}
+	}
+
+	/* the losers */
+	for (i = 0; i < n; i++) {
+		if ((s < 0 && ctx->expired == ERRCNTO) || 
+				(s >= 0 && started[i] < won))
+			http_dns_report(server_name, &addrs->addr[addr[i]], 0);
+		close(pfd[i].fd);
+	}
+	return s;
+}
+
+/*
+ * open a new connection to server:port
+ * returns the connection or NULL and the error code in *pret
+ */
+static http_conn *
+http_connect(http_ctx *ctx, char *server_name, int port, http_retcode *pret)
+{
+	int s;
+	http_addrs addrs;
+	http_conn *c;
+
+	/* get host addresses by name (cached) :*/
+	if ((*pret = http_resolve(server_name, port, &addrs)) < 0)
+		return NULL;
+	if (ctx->stats)
+		ctx->stats->dns = http_nsec();
+
+	if ((s = http_race(ctx, server_name, &addrs, pret)) < 0)
+		return NULL;
+	if (ctx->stats)
+		ctx->stats->connect = http_nsec();
+
+	if ((c = http_conn_new(ctx, s, server_name, port)) == NULL) {
+		close(s);
+		*pret = ERRMEM;
+	} else {
+		c->nonblock = 1;
+	}
+	return c;
+}
+
+/*
+ * make a connection of a connected socket
+ * returns NULL if out of memory
+ */
+extern http_conn *
+http_conn_new(http_ctx *ctx, int fd, char *server_name, int port)
+{
+	http_conn *c;
+
+	c = (http_conn *) http_alloc(ctx, sizeof(http_conn));
+	if (c)
+		memset(c, 0, offsetof(http_conn, rbuf));
+	if (c == NULL || (c->host = http_strdup(ctx, server_name)) == NULL) {
+		httpmt_free(ctx, c);
+		return NULL;
+	}
+	c->ctx = ctx;
+	c->fd = fd;
+	c->port = port;
+	c->rpin = -1;
+
+	return c;
+}
+
+extern void
+http_conn_close(http_conn *c)
+{
+	close(c->fd);
+#ifdef HAVE_ZLIB
+	if (c->zs) {
+		inflateEnd(c->zs);
+		httpmt_free(c->ctx, c->zs);
+		c->zs = NULL;
+	}
+#endif
+	if (c->ctx->answer == c) {
+		/* its buffer holds the header of the last answer, freed by 
+		 * the next query */
+		c->fd = -1;
+		return;
+	}
+	httpmt_free(c->ctx, c->host);
+	httpmt_free(c->ctx, c);
+}
+
+/*
+ * take an idle connection to server:port out of the pool
+ * expired and stale connections met on the way are closed.
+ * returns NULL if there is none.
+ */
+extern http_conn *
+http_pool_get(http_ctx *ctx, char *server_name, int port)
+{
+	http_conn **pp, *c;
+	struct pollfd pfd;
+	time_t now;
+	int expired;
+
+	now = http_now();
+	pp = &ctx->pool;
+	while ((c = *pp) != NULL) {
+		expired = (now - c->idle_since > ctx->pool_max_age);
+		if (!expired && (c->port != port || strcmp(c->host, server_name))) {
+			pp = &c->next;
+			continue;
+		}
+
+		*pp = c->next;
+		c->next = NULL;
+		if (expired) {
+			http_conn_close(c);
+			continue;
+		}
+
+		/* nothing must be readable on an idle connection, else the
+		 * server has closed it (EOF) or sent something unexpected */
+		pfd.fd = c->fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (c->rpos != c->rlen || poll(&pfd, 1, 0) != 0) {
+			http_conn_close(c);
+			continue;
+		}
+
+		return c;
+	}
+
+	return NULL;
+}
+
+/*
+ * give back a connection after a query
+ * it goes to the pool if it can be reused, else it is closed.
+ */
+extern void
+http_release(http_ctx *ctx, http_conn *c)
+{
+	http_conn *p;
+	int n;
+
+	if (c->stats)
+		http_stats_end(ctx, c);
+
+	/* what is left of the answer of a stopped request is unknown */
+	if (ctx->expired < 0)
+		c->keep = 0;
+	if (!c->keep || ctx->pool_max_idle <= 0) {
+		http_conn_close(c);
+		return;
+	}
+
+	c->idle_since = http_now();
+	c->async = 0;
+	c->next = ctx->pool;
+	ctx->pool = c;
+
+	/* drop the least recently used ones above the limit */
+	for (n = 1, p = ctx->pool; p->next && n < ctx->pool_max_idle; n++)
+		p = p->next;
+	while ((c = p->next) != NULL) {
+		p->next = c->next;
+		http_conn_close(c);
+	}
+}
+
+/*
+ * Pseudo general http query
+ *
+ * send a command and additional headers to the http server.
+ * optionally through the proxy (if http_proxy_server and http_proxy_port are
+ * set).
+ * A pooled connection is used when the keep-alive pool is enabled and one
+ * is available, if the server closed it meanwhile the query is sent again
+ * on a new connection (a POST only if none of it was sent).
+ *
+ * Limitations: the url is truncated to first 256 chars and
+ * the server name to 128.
+ *
+ * const char *command		Command to send
+ * char *url;			url / filename queried
+ * const char *additional_header	Additional header 
+ * querymode mode; 		Type of query
+ * http_source *src		Data to send after header, from memory
+ *				or a file descriptor. If NULL, not data
+ *				is sent 
+ * http_conn **pconn		pointer to variable where to set the
+ *				connection, to give back with http_release
+ *				(KEEP_OPEN mode only)
+ */
+extern http_retcode
+http_query(http_ctx *ctx, const char *command, char *url,
+	const char *additional_header, querymode mode, http_source *src,
+	http_conn **pconn) 
+{
+	http_conn *c;
+	char header[MAXHDR];
+	char *server;
+	int hlg;
+	http_retcode ret;
+	int proxy; 
+	int port;
+	int keepalive, reused, minor;
+	int flags;
+	struct iovec iov[2];
+	long sent, total;
+
+	/* scratch memory and header of the previous request are not used
+	 * anymore */
+	http_arena_reset(ctx);
+	http_answer_release(ctx);
+	if (ctx->stats) {
+		memset(ctx->stats, 0, sizeof(http_stats));
+		ctx->stats->start = http_nsec();
+	}
+	if (pconn) *pconn = NULL;
+	if ((ret = http_begin(ctx)) < 0)
+		return ret;
+
+	proxy = (ctx->proxy_server != NULL && ctx->proxy_port != 0);
+	server = proxy ? ctx->proxy_server :
+		ctx->server ? ctx->server : (char *) SERVER_DEFAULT;
+	port = proxy ? ctx->proxy_port : ctx->port;
+	keepalive = (ctx->pool_max_idle > 0);
+	flags = 0;
+	if (src && (src->fd >= 0 || src->produce || src->gzip))
+		flags = MSG_MORE;
+#if defined(MSG_ZEROCOPY)
+	else if (src && src->data && ctx->zerocopy_min > 0 &&
+			src->length >= ctx->zerocopy_min)
+		flags = MSG_ZEROCOPY;
+#endif
+
+	hlg = http_request_header(ctx, command, url, additional_header,
+		keepalive, header);
+	if (hlg < 0)
+		return ERRWRHD;
+		
+#ifdef _DEBUG
+	fputs(header, stderr);
+	putc('\n', stderr);
+#endif	
+
+	for (reused = keepalive; ; reused = 0) {
+		c = reused ? http_pool_get(ctx, server, port) : NULL;
+		if (c == NULL) {
+			reused = 0;
+			if ((c = http_connect(ctx, server, port, &ret)) == NULL) {
+				if (ctx->stats)
+					http_stats_end(ctx, NULL);
+				return http_expired(ctx, ret);
+			}
+		}
+		if ((c->stats = ctx->stats) != NULL)
+			c->stats->reused = reused;
+		http_nonblock(c, 1);
+		c->wait = W_IDLE;
+
+		/* a custom reader gets the body straight from the socket */
+		c->peek = (mode == KEEP_OPEN && ctx->reader != NULL);
+		c->nl = 0;
+
+		/* send header and data in one go, data from a file
+		 * descriptor or compressed on the fly follows */
+		iov[0].iov_base = header;
+		iov[0].iov_len = hlg;
+		iov[1].iov_base = src ? src->data : NULL;
+		iov[1].iov_len = (src && src->data && !src->gzip) ? 
+			src->length : 0;
+		total = hlg + iov[1].iov_len;
+		sent = http_send(c, iov, 2, flags);
+		if (sent < hlg) {
+			ret = ERRWRHD;
+		} else if (sent < total || (src && http_send_source(c, src) < 0)) {
+			ret = ERRWRDT;
+		} else {
+			if (c->stats)
+				c->stats->sent = http_nsec();
+			ret = http_read_status(c, &minor);
+		}
+
+		/* data must not change before the kernel is done with it */
+		if (http_zerocopy_wait(c) < 0 && ret >= OK0)
+			ret = ERRWRDT;
+
+		if (ret >= OK0)
+			break;
+
+		/* close socket */
+		c->keep = 0;
+
+		/* a reused connection failing before any answer was closed
+		 * by the server while idle: try again on a new one, unless
+		 * data was already taken from a file descriptor or a
+		 * producer, or the server may have got a request which must
+		 * not be done twice */
+		if (!reused || ret == ERRPAHD || ctx->expired < 0 ||
+				(src && (src->fd >= 0 || src->produce) &&
+				ret != ERRWRHD) ||
+				(!http_idempotent(command) && sent > 0)) {
+			http_release(ctx, c);
+			return http_expired(ctx, ret);
+		}
+		if (c->stats) {
+			c->stats->retries++;
+			c->stats = NULL;
+		}
+		http_release(ctx, c);
+	}
+
+	c->keep = (keepalive && minor >= 1);
+	c->nobody = (!strcmp(command, "HEAD") || ret == 204 || ret == 304);
+	ctx->answer = c;
+
+	if (mode == KEEP_OPEN) {
+		*pconn = c;
+		return ret;
+	}
+
+	/* skip the answer so that the connection can be reused */
+	http_skip_answer(c);
+	http_release(ctx, c);
+	return http_expired(ctx, ret);
+}
+
+/*
+ * tells if a query can be sent again when no answer came: the server may
+ * have done it already (RFC 7230 6.3.1)
+ *	const char *command	command of the query
+ */
+extern int
+http_idempotent(const char *command)
+{
+	return (!strcmp(command, "GET") || !strcmp(command, "HEAD") ||
+		!strcmp(command, "DELETE") || !strcmp(command, "PUT"));
+}
+
+/*
+ * create the header of a query
+ * returns its length or -1 if it does not fit in MAXHDR
+ *	const char *command	command to send
+ *	char *url		url / filename queried
+ *	const char *additional_header	additional header, CRLF terminated
+ *	int keepalive		the connection is kept open after the answer
+ *	char *header		placeholder for the header, MAXHDR long
+ */
+extern int
+http_request_header(http_ctx *ctx, const char *command, char *url,
+		const char *additional_header, int keepalive, char *header)
+{
+	char host[MAXBUF];
+	char *target;
+	int hlg, proxy;
+
+	proxy = (ctx->proxy_server != NULL && ctx->proxy_port != 0);
+	target = ctx->server ? ctx->server : (char *) SERVER_DEFAULT;
+
+	/* create header, IPv6 addresses go between brackets */
+	if (strchr(target, ':'))
+		snprintf(host, sizeof(host), "[%.128s]", target);
+	else
+		snprintf(host, sizeof(host), "%.128s", target);
+	if (ctx->port != 80)
+		snprintf(host + strlen(host), sizeof(host) - strlen(host), ":%d",
+			ctx->port);
+
+	if (proxy)
+		hlg = snprintf(header, MAXHDR, "%s http://%s/%.256s",
+			command, host, url);
+	else
+		hlg = snprintf(header, MAXHDR, "%s /%.256s", command, url);
+
+	hlg += snprintf(header + hlg, MAXHDR - hlg,
+		" HTTP/1.1\015\012Host: %s\015\012User-Agent: %s\015\012%s%s%s%s%s%s\015\012",
+		host,
+		http_user_agent,
+		ctx->b64_auth ? "Authorization: Basic " : "",
+		ctx->b64_auth ? ctx->b64_auth : "",
+		ctx->b64_auth ? "\015\012" : "",
+		ctx->compression ? "Accept-Encoding: gzip, deflate\015\012" : "",
+		keepalive ? "" : "Connection: close\015\012",
+		additional_header
+		);
+	if (hlg >= MAXHDR)
+		return -1;
+
+	return hlg;
+}
+
+/*
+ * read the status line of an answer, skipping informational (1xx)
+ * answers
+ * returns the status code from the server, ERRRDHD on read error or
+ * ERRPAHD if it is not HTTP
+ *	int *pminor	set to the HTTP/1.x minor version of the answer
+ */
+extern http_retcode
+http_read_status(http_conn *c, int *pminor)
+{
+	char line[MAXBUF];
+	http_retcode ret;
+	int n;
+
+	c->wait = W_FIRST;
+	do {
+		/* nothing to keep of an earlier header */
+		c->rpin = -1;
+		n = http_read_line(c, line, MAXBUF - 1);
+		c->wait = W_IDLE;
+
+		if (n <= 0) 
+			ret = ERRRDHD;
+		else if (sscanf(line, "HTTP/1.%d %03d", pminor,
+				(int*)&ret) != 2) 
+			ret = ERRPAHD;
+		else if (ret >= 100 && ret < 200 &&
+				http_read_header(c, NULL, NULL) < 0)
+			ret = ERRRDHD;
+	} while (ret >= 100 && ret < 200);
+
+	return ret;
+}
+
+/*
+ * tells if the status line and header of an answer are in the receive
+ * buffer, so that http_read_status and http_read_header don't have to
+ * read from the socket. Informational (1xx) answers are looked through.
+ * A full buffer is reported as ready: reading it gives the error.
+ * returns 1 if ready, 0 if more data is needed.
+ */
+extern int
+http_head_buffered(http_conn *c)
+{
+	char *p = c->rbuf + c->rpos;
+	char *end = c->rbuf + c->rlen;
+	int n, status = 0, first = 1;
+
+	if (c->rpos == 0 && c->rlen == RBUF_SIZE)
+		return 1;
+
+	while (p < end) {
+		n = http_find_lf(p, end - p);
+		if (p + n == end)
+			return 0;
+		if (first) {
+			if (sscanf(p, "HTTP/1.%*d %03d", &status) != 1)
+				return 1;
+			first = 0;
+		} else if (n == 0 || (n == 1 && *p == '\015')) {
+			/* end of a header */
+			if (status < 100 || status >= 200)
+				return 1;
+			first = 1;
+		}
+		p += n + 1;
+	}
+	return 0;
+}
+
+/*
+ * tells if http_read_body can go on without reading lines of chunk
+ * framing from the socket, i.e. if they are all in the receive buffer.
+ * returns 1 if ready, 0 if more data is needed.
+ */
+extern int
+http_body_buffered(http_conn *c)
+{
+	char *p = c->rbuf + c->rpos;
+	char *end = c->rbuf + c->rlen;
+	char *num;
+	int n;
+
+	if (!c->chunked || c->chunk == CHUNK_END || c->left > 0 ||
+			(c->rpos == 0 && c->rlen == RBUF_SIZE))
+		return 1;
+
+	/* CRLF ending the previous chunk data */
+	if (c->chunk == CHUNK_DATA) {
+		n = http_find_lf(p, end - p);
+		if (p + n == end)
+			return 0;
+		p += n + 1;
+	}
+
+	/* chunk-size line */
+	n = http_find_lf(p, end - p);
+	if (p + n == end)
+		return 0;
+	for (num = p; num < p + n && *num == '0'; num++)
+		;
+	if (num == p || (num < p + n && isxdigit(*num)))
+		return 1;
+	p += n + 1;
+
+	/* last chunk, trailer up to the empty line */
+	while (p < end) {
+		n = http_find_lf(p, end - p);
+		if (p + n == end)
+			return 0;
+		if (n == 0 || (n == 1 && *p == '\015'))
+			return 1;
+		p += n + 1;
+	}
+	return 0;
+}
+
+/*
+ * read the header lines of an answer, up to the empty line
+ * sets the content length (left untouched if not found or if the body
+ * is chunked), the content type if typebuf is not NULL and the
+ * connection flags and body framing.
+ * The lines are left in the receive buffer, split in NUL terminated
+ * names and values, for http_header.
+ * returns OK0 or ERRRDHD on read error.
+ *
+ *	http_conn *c	connection to read from
+ *	int *plength	address of integer variable which will be set to
+ *			the length of the data, may be NULL
+ *	char *typebuf	allocated buffer where the data type is returned,
+ *			at most MAXTYPE long
+ */
+extern http_retcode
+http_read_header(http_conn *c, int *plength, char *typebuf)
+{
+	char *line, *value, *end;
+	int n, id, length = -1;
+	unsigned hash;
+	long l;
+
+	c->chunked = 0;
+	c->encoding = ENC_NONE;
+	c->nfields = 0;
+	memset(c->known, 0, sizeof(c->known));
+	c->rpin = c->rhend = c->rpos;
+
+	while (1) {
+		n = http_next_line(c, &line);
+		c->rhend = c->rpos;
+#ifdef _DEBUG
+		if (n >= 0) {
+			fputs(line, stderr);
+			putc('\n', stderr);
+		}
+#endif	
+		if (n < 0)
+			return ERRRDHD;
+		/* empty line ? (=> end of header) */
+		if (n == 0)
+			break;
+
+		/* name: value, the name is hashed in lower case on the way */
+		hash = 2166136261u;
+		for (value = line; *value && *value != ':'; value++)
+			hash = (hash ^ tolower(*value)) * 16777619u;
+		if (*value == '\0')
+			continue;
+		*value++ = '\0';
+		while (*value == ' ' || *value == '\t')
+			value++;
+		for (end = line + n; end > value && 
+				(end[-1] == ' ' || end[-1] == '\t'); )
+			*--end = '\0';
+
+		id = http_known_field(line, hash);
+		if (c->nfields < HTTP_MAX_FIELDS) {
+			c->fields[c->nfields].name = line - (c->rbuf + c->rpin);
+			c->fields[c->nfields].value = value - (c->rbuf + c->rpin);
+			c->nfields++;
+			if (id >= 0 && !c->known[id])
+				c->known[id] = c->nfields;
+		}
+
+		switch (id) {
+		case HTTP_H_CONTENT_LENGTH:
+			l = strtol(value, &end, 10);
+			if (end != value && l >= 0 && l <= INT_MAX)
+				length = l;
+			break;
+		case HTTP_H_CONTENT_TYPE:
+			if (typebuf) {
+				for (n = 0; n < MAXTYPE - 1 && value[n] && 
+					!isspace((unsigned char) value[n]); n++)
+					typebuf[n] = value[n];
+				typebuf[n] = '\0';
+			}
+			break;
+		case HTTP_H_CONNECTION:
+			if (strcasestr(value, "close"))
+				c->keep = 0;
+			break;
+		case HTTP_H_TRANSFER_ENCODING:
+			if (strcasestr(value, "chunked"))
+				c->chunked = 1;
+			break;
+		case HTTP_H_CONTENT_ENCODING:
+			/* only decoded if asked for */
+			if (!c->ctx->compression)
+				break;
+			if (!strcasecmp(value, "gzip") ||
+					!strcasecmp(value, "x-gzip"))
+				c->encoding = ENC_GZIP;
+			else if (!strcasecmp(value, "deflate"))
+				c->encoding = ENC_DEFLATE;
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (c->stats)
+		c->stats->header = http_nsec();
+
+	/* the chunks tell the length, not the header */
+	if (c->chunked)
+		length = -1;
+	if (length >= 0 && plength)
+		*plength = length;
+
+	if (c->nobody) {
+		c->chunked = 0;
+		c->left = 0;
+	} else {
+		c->chunk = CHUNK_SIZE;
+		c->left = c->chunked ? 0 : length;
+	}
+	/* an empty body has nothing to decode */
+	if (!c->chunked && c->left == 0)
+		c->encoding = ENC_NONE;
+	c->zinit = c->zend = c->zfull = 0;
+
+	return OK0;
+}
+
+/* names of the http_hdr fields, in lower case, and their hash */
+static const char *http_known_names[HTTP_H_KNOWN] = {
+	"content-length",
+	"content-type",
+	"transfer-encoding",
+	"connection",
+	"keep-alive",
+	"content-encoding",
+	"content-range",
+	"accept-ranges",
+	"etag",
+	"last-modified",
+	"cache-control",
+	"expires",
+	"age",
+	"date",
+	"vary",
+	"location",
+	"server"
+};
+static unsigned http_known_hash[HTTP_H_KNOWN];
+static pthread_once_t http_known_once = PTHREAD_ONCE_INIT;
+
+static void
+http_known_init(void)
+{
+	const char *p;
+	unsigned hash;
+	int i;
+
+	for (i = 0; i < HTTP_H_KNOWN; i++) {
+		hash = 2166136261u;
+		for (p = http_known_names[i]; *p; p++)
+			hash = (hash ^ *p) * 16777619u;
+		http_known_hash[i] = hash;
+	}
+}
+
+/*
+ * find a well known header field
+ * returns its http_hdr or -1
+ *	const char *name	its name, any case
+ *	unsigned hash		hash of the name in lower case (FNV-1a)
+ */
+static int
+http_known_field(const char *name, unsigned hash)
+{
+	int i;
+
+	pthread_once(&http_known_once, http_known_init);
+	for (i = 0; i < HTTP_H_KNOWN; i++) {
+		if (http_known_hash[i] == hash && 
+				!strcasecmp(name, http_known_names[i]))
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * the header of the last answer is not needed anymore, its connection
+ * is freed if it was closed meanwhile
+ */
+extern void
+http_answer_release(http_ctx *ctx)
+{
+	http_conn *c = ctx->answer;
+
+	if (c == NULL)
+		return;
+	ctx->answer = NULL;
+	c->rpin = -1;
+	if (c->fd < 0)
+		http_conn_close(c);
+}
+
+/*
+ * Header fields of the last answer
+ *
+ * Any field of the header of the last answer of http_get, http_head,
+ * http_put, ... can be looked up by name (any case) or, for the well
+ * known ones, by index. The strings are in the receive buffer of the
+ * connection, no copy is made: they are valid until the next query on
+ * the ctx. The multi request engine and http_pipeline don't set it.
+ *
+ * returns the value of the field or NULL if there is none
+ *	char *name	name of the field
+ */
+extern char *
+http_header(char *name)
+{
+	return httpmt_header(&_ctx, name);
+}
+
+extern char *
+httpmt_header(http_ctx *ctx, char *name)
+{
+	http_conn *c;
+	unsigned hash;
+	char *p;
+	int i, id;
+
+	if (ctx == NULL || name == NULL || (c = ctx->answer) == NULL ||
+			c->rpin < 0)
+		return NULL;
+
+	hash = 2166136261u;
+	for (p = name; *p; p++)
+		hash = (hash ^ tolower(*p)) * 16777619u;
+	if ((id = http_known_field(name, hash)) >= 0)
+		return httpmt_header_known(ctx, (http_hdr) id);
+
+	for (i = 0; i < c->nfields; i++) {
+		p = c->rbuf + c->rpin + c->fields[i].name;
+		if (!strcasecmp(p, name))
+			return c->rbuf + c->rpin + c->fields[i].value;
+	}
+	return NULL;
+}
+
+/*
+ * value of a well known field of the last answer, see http_header
+ *	http_hdr id	the field
+ */
+extern char *
+http_header_known(http_hdr id)
+{
+	return httpmt_header_known(&_ctx, id);
+}
+
+extern char *
+httpmt_header_known(http_ctx *ctx, http_hdr id)
+{
+	http_conn *c;
+	int i;
+
+	if (ctx == NULL || (c = ctx->answer) == NULL || c->rpin < 0 ||
+			id < 0 || id >= HTTP_H_KNOWN || (i = c->known[id]) == 0)
+		return NULL;
+	return c->rbuf + c->rpin + c->fields[i - 1].value;
+}
+
+/*
+ * field i of the last answer, in the order received, see http_header
+ * returns 1, or 0 if there is no such field
+ *	char **pname	address of a pointer set to its name
+ *	char **pvalue	address of a pointer set to its value
+ */
+extern int
+http_header_field(int i, char **pname, char **pvalue)
+{
+	return httpmt_header_field(&_ctx, i, pname, pvalue);
+}
+
+extern int
+httpmt_header_field(http_ctx *ctx, int i, char **pname, char **pvalue)
+{
+	http_conn *c;
+
+	if (ctx == NULL || (c = ctx->answer) == NULL || c->rpin < 0 ||
+			i < 0 || i >= c->nfields)
+		return 0;
+	if (pname)
+		*pname = c->rbuf + c->rpin + c->fields[i].name;
+	if (pvalue)
+		*pvalue = c->rbuf + c->rpin + c->fields[i].value;
+	return 1;
+}
+
+/*
+ * read and drop the header and body of an answer, so that the
+ * connection can be reused. Answers ending at EOF are not read, the
+ * connection is just marked as not reusable.
+ *	http_conn *c	connection to read from
+ */
+extern void
+http_skip_answer(http_conn *c)
+{
+	char buffer[MAXBUF];
+	int n;
+
+	if (!c->keep || http_read_header(c, NULL, NULL) < 0 ||
+			(!c->chunked && c->left < 0)) {
+		c->keep = 0;
+		return;
+	}
+
+	/* as sent, there is no point in decoding it */
+	while ((n = http_read_wire(c, buffer, MAXBUF)) > 0)
+		;
+	if (n < 0)
+		c->keep = 0;
+}
+
+/*
+ * read the next piece of the body of an answer, chunks and content
+ * encoding are decoded.
+ * returns the number of bytes read, 0 at the end of the body or negative
+ * on error.
+ *	http_conn *c	connection to read from
+ *	char *buffer	placeholder for data
+ *	int max		max number of bytes to read
+ */
+extern int
+http_read_body(http_conn *c, char *buffer, int max)
+{
+#ifdef HAVE_ZLIB
+	if (c->encoding != ENC_NONE)
+		return http_inflate(c, buffer, max);
+#endif
+	return http_read_wire(c, buffer, max);
+}
+
+/*
+ * tells if the body of an answer is over, i.e. if nothing more comes
+ * out of http_read_body
+ */
+extern int
+http_body_done(http_conn *c)
+{
+	if (c->encoding != ENC_NONE && !c->zend)
+		return 0;
+	return c->chunked ? c->chunk == CHUNK_END : c->left == 0;
+}
+
+/*
+ * read the next piece of the body of an answer as sent, only the chunks
+ * are decoded. Same returns as http_read_body.
+ */
+static int
+http_read_wire(http_conn *c, char *buffer, int max)
+{
+	int n;
+
+	if ((n = http_body_next(c)) <= 0)
+		return n;
+
+	/* up to EOF when there is no length */
+	if (c->left < 0)
+		return http_recv(c, buffer, max);
+
+	if (max > c->left)
+		max = c->left;
+	n = http_recv(c, buffer, max);
+	if (n == 0) {
+		/* EOF before the end */
+		errno = c->chunked ? EPROTO : EPIPE;
+		return -1;
+	}
+	if (n > 0)
+		c->left -= n;
+	return n;
+}
+
+/*
+ * get to the next body data of an answer: for a chunked body, when the
+ * current chunk is over, its end, the next chunk size and extensions or
+ * the trailer fields after the last chunk are read.
+ * returns 1 if data follows (c->left bytes, or up to EOF if c->left < 0),
+ * 0 at the end of the body or -1 on error.
+ *	http_conn *c	connection to read from
+ */
+static int
+http_body_next(http_conn *c)
+{
+	char line[MAXBUF];
+	char *end;
+	long size;
+
+	if (!c->chunked)
+		return c->left != 0;
+
+	if (c->chunk == CHUNK_END)
+		return 0;
+	if (c->left > 0)
+		return 1;
+
+	/* CRLF ending the previous chunk data */
+	if (c->chunk == CHUNK_DATA &&
+			(http_read_line(c, line, MAXBUF - 1) <= 0 || *line))
+		goto bad;
+
+	/* chunk-size [; chunk-ext] */
+	if (http_read_line(c, line, MAXBUF - 1) <= 0)
+		goto bad;
+	size = strtol(line, &end, 16);
+	if (end == line || size < 0 ||
+			(*end && *end != ';' && *end != ' ' && *end != '\t'))
+		goto bad;
+
+	if (size == 0) {
+		/* trailer fields up to the empty line */
+		do {
+			if (http_read_line(c, line, MAXBUF - 1) <= 0)
+				goto bad;
+		} while (*line);
+		c->chunk = CHUNK_END;
+		return 0;
+	}
+
+	c->chunk = CHUNK_DATA;
+	c->left = size;
+	return 1;
+
+bad:
+	errno = EPROTO;
+	return -1;
+}
+
+#ifdef HAVE_ZLIB
+/* zlib memory comes from the allocator of the ctx */
+static voidpf
+http_zalloc(voidpf opaque, uInt items, uInt size)
+{
+	return http_alloc((http_ctx *) opaque, (size_t) items * size);
+}
+
+static void
+http_zfree(voidpf opaque, voidpf ptr)
+{
+	httpmt_free((http_ctx *) opaque, ptr);
+}
+
+/*
+ * read the next piece of a gzip or deflate encoded body, inflated from
+ * the receive buffer straight into buffer as the data comes in. The
+ * inflate state stays on the connection for the next answers.
+ * returns the number of bytes decoded, 0 at the end of the body or
+ * negative on error (EPROTO if the data is not valid or ends too soon)
+ *	http_conn *c	connection to read from
+ *	char *buffer	placeholder for data
+ *	int max		max number of bytes to read
+ */
+static int
+http_inflate(http_conn *c, char *buffer, int max)
+{
+	z_stream *zs = c->zs;
+	char drop[MAXBUF];
+	int n, in, used, prior, r;
+
+	if (zs == NULL) {
+		zs = (z_stream *) http_alloc(c->ctx, sizeof(z_stream));
+		if (zs == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		memset(zs, 0, sizeof(z_stream));
+		zs->zalloc = http_zalloc;
+		zs->zfree = http_zfree;
+		zs->opaque = c->ctx;
+		/* gzip or zlib header, told apart by inflate */
+		if (inflateInit2(zs, 15 + 32) != Z_OK) {
+			httpmt_free(c->ctx, zs);
+			errno = ENOMEM;
+			return -1;
+		}
+		c->zs = zs;
+		c->zinit = 1;
+	} else if (!c->zinit) {
+		if (inflateReset2(zs, 15 + 32) != Z_OK) {
+			errno = EPROTO;
+			return -1;
+		}
+		c->zinit = 1;
+	}
+
+	zs->next_out = (Bytef *) buffer;
+	zs->avail_out = max;
+	while (!c->zend && zs->avail_out == (uInt) max) {
+		in = 0;
+		/* what is left of the last input first */
+		if (!c->zfull) {
+			/* a multi handle only reads the chunk framing once
+			 * it is in the buffer */
+			if ((!c->async || http_body_buffered(c)) &&
+					(r = http_body_next(c)) <= 0) {
+				/* end of the body before the end of the stream */
+				if (r == 0)
+					errno = EPROTO;
+				return -1;
+			}
+			if (c->rpos == c->rlen || !http_body_buffered(c)) {
+				if (http_inflate_fill(c) < 0)
+					return -1;
+				continue;
+			}
+			in = c->rlen - c->rpos;
+			if (c->left >= 0 && in > c->left)
+				in = c->left;
+		}
+
+		prior = zs->total_in;
+		if (c->encoding == ENC_DEFLATE && prior < 2)
+			memcpy(c->zhead + prior, c->rbuf + c->rpos,
+				in < 2 - prior ? in : 2 - prior);
+		zs->next_in = (Bytef *) c->rbuf + c->rpos;
+		zs->avail_in = in;
+		r = inflate(zs, Z_NO_FLUSH);
+		used = in - zs->avail_in;
+		if (r == Z_DATA_ERROR && c->encoding == ENC_DEFLATE &&
+				zs->total_out == 0 && zs->total_in <= 2) {
+			/* not a zlib header, raw deflate then: the bytes
+			 * taken from earlier chunks go again */
+			c->encoding = ENC_RAW;
+			zs->next_in = c->zhead;
+			zs->avail_in = prior;
+			if (inflateReset2(zs, -15) != Z_OK || (prior > 0 &&
+					inflate(zs, Z_NO_FLUSH) != Z_OK)) {
+				errno = EPROTO;
+				return -1;
+			}
+			continue;
+		}
+		c->rpos += used;
+		if (c->left > 0)
+			c->left -= used;
+		if (c->stats)
+			c->stats->encoded_bytes += used;
+		if (r == Z_STREAM_END) {
+			c->zend = 1;
+		} else if (r != Z_OK && r != Z_BUF_ERROR) {
+			errno = EPROTO;
+			return -1;
+		}
+		c->zfull = (zs->avail_out == 0);
+	}
+
+	n = max - zs->avail_out;
+	if (c->stats)
+		c->stats->decoded_bytes += n;
+	if (n > 0)
+		return n;
+
+	/* what follows the end of the stream is dropped */
+	do {
+		if (c->async && !http_body_buffered(c))
+			r = http_inflate_fill(c);
+		else
+			r = http_read_wire(c, drop, MAXBUF);
+	} while (r > 0);
+	return r;
+}
+
+/*
+ * read more of the body for http_inflate in the receive buffer
+ * returns the number of bytes read or -1 on error (EPROTO at EOF, EAGAIN
+ * if a multi handle must read first)
+ */
+static int
+http_inflate_fill(http_conn *c)
+{
+	int n;
+
+	if ((n = http_fill(c)) == 0 || (n < 0 && errno == ECONNRESET))
+		errno = EPROTO;
+	return n > 0 ? n : -1;
+}
+
+/*
+ * deflate state of the ctx for gzip data at its upload level, set up
+ * again for a new stream
+ * returns NULL if out of memory
+ */
+static z_stream *
+http_deflater(http_ctx *ctx)
+{
+	z_stream *zs = (z_stream *) ctx->deflate;
+
+	if (zs != NULL) {
+		if (deflateReset(zs) == Z_OK && deflateParams(zs,
+				ctx->upload_level, Z_DEFAULT_STRATEGY) == Z_OK)
+			return zs;
+		deflateEnd(zs);
+		httpmt_free(ctx, zs);
+		ctx->deflate = NULL;
+	}
+
+	if (!(zs = (z_stream *) http_alloc(ctx, sizeof(z_stream))))
+		return NULL;
+	memset(zs, 0, sizeof(z_stream));
+	zs->zalloc = http_zalloc;
+	zs->zfree = http_zfree;
+	zs->opaque = ctx;
+	/* gzip header */
+	if (deflateInit2(zs, ctx->upload_level, Z_DEFLATED, 15 + 16, 8,
+			Z_DEFAULT_STRATEGY) != Z_OK) {
+		httpmt_free(ctx, zs);
+		return NULL;
+	}
+	ctx->deflate = zs;
+	return zs;
+}
+
+/*
+ * send the data of a query gzip compressed, in chunks of up to
+ * XFER_BLOCK bytes as the compressed data comes out. Data from a file
+ * descriptor or a producer is read XFER_BLOCK bytes at a time.
+ * returns 0 or -1 on read, write or compression error or early EOF.
+ */
+static int
+http_send_gzip(http_conn *c, http_source *src)
+{
+	char *in = NULL, *out;
+	z_stream *zs;
+	off_t left = src->fd_length;
+	size_t want;
+	ssize_t n;
+	int flush = Z_NO_FLUSH, r = Z_OK;
+
+	if (!(zs = http_deflater(c->ctx)) || 
+			!(out = (char *) http_arena_alloc(c->ctx, XFER_BLOCK)))
+		return -1;
+	if (src->fd < 0 && !src->produce) {
+		zs->next_in = (Bytef *) src->data;
+		zs->avail_in = src->length;
+		flush = Z_FINISH;
+	} else if (!(in = (char *) http_arena_alloc(c->ctx, XFER_BLOCK))) {
+		return -1;
+	}
+
+	do {
+		if (zs->avail_in == 0 && flush != Z_FINISH) {
+			want = (left >= 0 && left < XFER_BLOCK) ? 
+				(size_t) left : XFER_BLOCK;
+			n = src->produce ? (*src->produce)(in, want,
+				src->produce_arg) : read(src->fd, in, want);
+			if (n < 0 && errno == EINTR && !src->produce)
+				continue;
+			/* more than asked would be read past in */
+			if (n < 0 || n > (ssize_t) want || (n == 0 && left > 0))
+				return -1;
+			if (left > 0)
+				left -= n;
+			if (n == 0 || left == 0)
+				flush = Z_FINISH;
+			zs->next_in = (Bytef *) in;
+			zs->avail_in = n;
+		}
+
+		zs->next_out = (Bytef *) out;
+		zs->avail_out = XFER_BLOCK;
+		r = deflate(zs, flush);
+		if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR)
+			return -1;
+		if ((n = XFER_BLOCK - zs->avail_out) == 0)
+			continue;
+
+		if (http_send_chunk(c, out, n) < 0)
+			return -1;
+	} while (r != Z_STREAM_END);
+
+	/* last chunk, no trailer */
+	return http_send_buffer(c, (char *) "0\015\012\015\012", 5, 0);
+}
+#endif
+
+/*
+ * write all of buffer to a file descriptor
+ * returns 0 or -1 on error
+ */
+static int
+http_write_fd(int fd, char *buffer, int length)
+{
+	int n;
+
+	while (length > 0) {
+		n = write(fd, buffer, length);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buffer += n;
+		length -= n;
+	}
+	return 0;
+}
+
+/*
+ * move length bytes from a pipe to a file descriptor, with splice(2) or
+ * read(2) + write(2) if fd does not support it (*pcopy is then set).
+ * returns 0 or -1 on error
+ */
+static int
+http_pipe_to_fd(int pipe_out, int fd, int length, char *buffer, int *pcopy)
+{
+	int n;
+
+	while (length > 0) {
+		if (!*pcopy) {
+			n = splice(pipe_out, NULL, fd, NULL, length, 
+					SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (n < 0 && errno == EINVAL) {
+				*pcopy = 1;
+				continue;
+			}
+		} else {
+			n = read(pipe_out, buffer, 
+				length < XFER_BLOCK ? length : XFER_BLOCK);
+			if (n > 0 && http_write_fd(fd, buffer, n) < 0)
+				return -1;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		length -= n;
+	}
+	return 0;
+}
+
+/*
+ * write the body of an answer to a file descriptor
+ * Data is moved from the socket with splice(2), through a pipe unless fd
+ * is one, or with read(2) + write(2) if it can't be spliced. Data already
+ * in the receive buffer is written first.
+ * returns OK0, ERRRDDT on read error, ERRWRFD on write error or ERRMEM.
+ *	http_conn *c	connection to read from
+ *	int fd		file descriptor to write to
+ *	off_t *plength	address of variable which will be set to the 
+ *			number of bytes written
+ */
+extern http_retcode
+http_body_to_fd(http_conn *c, int fd, off_t *plength)
+{
+	int p[2] = { -1, -1 };
+	char *buffer;
+	struct stat st;
+	http_retcode ret = OK0;
+	size_t want;
+	sigset_t old;
+	int pending, copy = 0;
+	int r, n;
+
+	*plength = 0;
+	if (!(buffer = (char *) http_arena_alloc(c->ctx, XFER_BLOCK)))
+		return ERRMEM;
+
+	pending = http_sigpipe_block(&old);
+	/* encoded data is decoded through the buffer */
+	if (c->encoding != ENC_NONE)
+		copy = 1;
+	else if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode))
+		p[1] = fd;
+	else if (pipe(p) < 0)
+		copy = 1;
+
+	while (1) {
+		if (copy || c->rpos < c->rlen) {
+			n = http_read_body(c, buffer, XFER_BLOCK);
+			/* a reset is how some servers end data without length */
+			if (n < 0 && errno == ECONNRESET && !c->chunked && c->left < 0)
+				n = 0;
+			if (n < 0) {
 				ret = ERRRDDT;
+				break;
+			}
+			if (n == 0)
+				break;
+			if (http_write_fd(fd, buffer, n) < 0) {
+				ret = ERRWRFD;
+				break;
 			}
+			*plength += n;
+			continue;
+		}
+
+		if ((r = http_body_next(c)) <= 0) {
+			if (r < 0)
+				ret = ERRRDDT;
+			break;
+		}
+		/* reading the chunk size may have buffered some data */
+		if (c->rpos < c->rlen)
+			continue;
+		want = (c->left < 0 || c->left > XFER_MAX) ? XFER_MAX : c->left;
+		n = splice(c->fd, NULL, p[1], NULL, want, 
+				SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (c->stats)
+			http_stats_io(c->stats, 0, n);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN && http_wait(c, POLLIN) == 0)
+			continue;
+		if (n < 0 && errno == EINVAL) {
+			copy = 1;
+			continue;
+		}
+		if (n < 0 && errno == ECONNRESET && !c->chunked && c->left < 0)
+			n = 0;
+		if (n <= 0) {
+			/* EOF ends data without length */
+			if (n < 0 || c->left >= 0)
+				ret = ERRRDDT;
+			break;
+		}
+		if (c->left > 0)
+			c->left -= n;
+		*plength += n;
+
+		if (p[1] != fd && http_pipe_to_fd(p[0], fd, n, buffer, &copy) < 0) {
+			ret = ERRWRFD;
+			break;
 		}
-	} else if (ret >= OK0) {
-		close(fd);
 	}
-	
+
+	if (p[1] != fd) {
+		close(p[0]);
+		close(p[1]);
+	}
+	http_sigpipe_restore(&old, pending);
+
 	return ret;
 }
 
-/**
- * set external base64 encoder for basic auth
+/*
+ * send buffers on a connection with as few system calls as possible,
+ * sendmsg is called again after a partial write.
+ * returns the number of bytes sent, less than the total on error.
+ *
+ *	http_conn *c		connection to send on
+ *	struct iovec *iov	buffers to send (modified)
+ *	int iovcnt		number of buffers
+ *	int flags		MSG_MORE if more data follows, 
+ *				MSG_ZEROCOPY to use it if available: the
+ *				buffers must then be kept untouched until
+ *				http_zerocopy_wait returns
  */
-extern void
-http_set_base64_encoder(http_base64_encoder enc)
+static long
+http_send(http_conn *c, struct iovec *iov, int iovcnt, int flags)
 {
-	httpmt_set_base64_encoder(&_ctx, enc);
+	struct msghdr msg;
+	ssize_t n;
+	long sent = 0;
+
+	flags |= MSG_NOSIGNAL;
+#if defined(MSG_ZEROCOPY)
+	if (flags & MSG_ZEROCOPY) {
+#if defined(SO_ZEROCOPY)
+		int one = 1;
+
+		if (c->zerocopy == 0)
+			c->zerocopy = setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY,
+						&one, sizeof(one)) == 0 ? 1 : -1;
+#endif
+		if (c->zerocopy <= 0)
+			flags &= ~MSG_ZEROCOPY;
+	}
+#endif
+
+	memset(&msg, 0, sizeof(msg));
+	while (iovcnt > 0) {
+		if (iov->iov_len == 0) {
+			iov++;
+			iovcnt--;
+			continue;
+		}
+
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		n = sendmsg(c->fd, &msg, flags);
+		if (c->stats)
+			http_stats_io(c->stats, 1, n);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN && http_wait(c, POLLOUT) == 0)
+				continue;
+#if defined(MSG_ZEROCOPY)
+			/* out of socket option memory for page pins */
+			if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+				flags &= ~MSG_ZEROCOPY;
+				continue;
+			}
+#endif
+			break;
+		}
+#if defined(MSG_ZEROCOPY)
+		if (flags & MSG_ZEROCOPY)
+			c->zc_sent++;
+#endif
+		sent += n;
+
+		/* skip what was sent */
+		while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return sent;
 }
 
-extern void
-httpmt_set_base64_encoder(http_ctx *ctx, http_base64_encoder enc)
+/*
+ * sendfile and splice have no MSG_NOSIGNAL: SIGPIPE is blocked in the
+ * thread while they run, and one they raised is discarded afterwards.
+ */
+static int
+http_sigpipe_block(sigset_t *old)
 {
-	if (ctx != NULL)
-		ctx->b64_enc = enc;
+	sigset_t set, pending;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	sigpending(&pending);
+	pthread_sigmask(SIG_BLOCK, &set, old);
+	return sigismember(&pending, SIGPIPE);
 }
 
-/**
- * set basic auth for use in all requests, calls external
- * base64 encoder
+static void
+http_sigpipe_restore(sigset_t *old, int was_pending)
+{
+	sigset_t set, pending;
+	struct timespec zero = { 0, 0 };
+
+	sigpending(&pending);
+	if (!was_pending && sigismember(&pending, SIGPIPE)) {
+		sigemptyset(&set);
+		sigaddset(&set, SIGPIPE);
+		while (sigtimedwait(&set, NULL, &zero) < 0 && errno == EINTR)
+			;
+	}
+	pthread_sigmask(SIG_SETMASK, old, NULL);
+}
+
+/*
+ * send all of buffer, see http_send
  */
-extern http_retcode
-http_set_basic_auth(char *user, char *pass)
+static int
+http_send_buffer(http_conn *c, char *buffer, int length, int flags)
 {
-	return httpmt_set_basic_auth(&_ctx, user, pass);
+	struct iovec iov;
+
+	iov.iov_base = buffer;
+	iov.iov_len = length;
+	return http_send(c, &iov, 1, flags) == length ? 0 : -1;
 }
 
-extern http_retcode
-httpmt_set_basic_auth(http_ctx *ctx, char *user, char *pass)
+/*
+ * send a chunk of chunked transfer coding
+ * returns 0 or -1 on write error.
+ */
+static int
+http_send_chunk(http_conn *c, char *buffer, int length)
 {
-	http_retcode r = OK0;
-	char userpass[MAXBUF];
-	char *b64;
+	char size[32];
+	struct iovec iov[3];
+	long total;
 
-	if (ctx == NULL)
-		return ERRNULL;
+	/* http_send changes iov, the length to send is known before */
+	total = sprintf(size, "%x\015\012", (unsigned) length);
+	iov[0].iov_base = size;
+	iov[0].iov_len = total;
+	iov[1].iov_base = buffer;
+	iov[1].iov_len = length;
+	iov[2].iov_base = (char *) "\015\012";
+	iov[2].iov_len = 2;
+	total += length + 2;
+	return http_send(c, iov, 3, MSG_MORE) == total ? 0 : -1;
+}
 
-	if (ctx->b64_enc == NULL || user == NULL || pass == NULL)
-		return ERRNULL;
+/*
+ * send length bytes read from a file descriptor
+ * sendfile(2) is used for regular files, splice(2) for pipes and 
+ * read(2) + send for the others.
+ * returns 0 or -1 on read or write error or early EOF.
+ */
+static int
+http_send_fd_length(http_conn *c, int fd, off_t length)
+{
+	char *buffer = NULL;
+	off_t left = length;
+	size_t want;
+	ssize_t n;
+	int how = 0; /* 0: sendfile, 1: splice, 2: read */
 
-	snprintf(userpass, MAXBUF, "%s:%s", user, pass);
-	if ((*ctx->b64_enc)(userpass, &b64) == -1)
-		return ERRMEM;
+	while (left > 0) {
+		want = left > XFER_MAX ? XFER_MAX : (size_t) left;
+		if (how == 0) {
+			n = sendfile(c->fd, fd, NULL, want);
+			if (c->stats)
+				http_stats_io(c->stats, 1, n);
+			if (n < 0 && (errno == EINVAL || errno == ENOSYS) &&
+					left == length) {
+				how = 1;
+				continue;
+			}
+		} else if (how == 1) {
+			n = splice(fd, NULL, c->fd, NULL, want, 
+					SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (c->stats)
+				http_stats_io(c->stats, 1, n);
+			if (n < 0 && errno == EINVAL && left == length) {
+				how = 2;
+				continue;
+			}
+		} else {
+			if (buffer == NULL && !(buffer = (char *)
+					http_arena_alloc(c->ctx, XFER_BLOCK)))
+				return -1;
+			if (want > XFER_BLOCK)
+				want = XFER_BLOCK;
+			n = read(fd, buffer, want);
+			if (n > 0 && http_send_buffer(c, buffer, n, MSG_MORE) < 0)
+				n = -1;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN && how < 2 && 
+				http_wait(c, POLLOUT) == 0)
+			continue;
+		if (n <= 0)
+			break;
+		left -= n;
+	}
 
-	if (ctx->b64_auth)
-		free(ctx->b64_auth);
+	return left == 0 ? 0 : -1;
+}
 
-	ctx->b64_auth = b64;
+/*
+ * send what is read from a file descriptor up to EOF, in chunks
+ * Pipes are spliced to the socket as data comes in, other descriptors 
+ * are read into a buffer.
+ * returns 0 or -1 on read or write error.
+ */
+static int
+http_send_fd_chunked(http_conn *c, int fd)
+{
+	char size[32];
+	char *buffer = NULL;
+	struct stat st;
+	int avail, n, r = -1;
+	int pipe_in, events;
 
+	pipe_in = (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode));
+
+	while (1) {
+		if (pipe_in) {
+			/* wait for data and see how much is there */
+			if ((events = http_poll_events(c->ctx, fd, POLLIN)) < 0)
+				break;
+			if (ioctl(fd, FIONREAD, &avail) < 0) {
+				pipe_in = 0;
+				continue;
+			}
+			if (avail == 0) {
+				if (events & (POLLHUP | POLLERR)) {
+					r = 0;	/* EOF */
+					break;
+				}
+				continue;
+			}
+			if (avail > XFER_MAX)
+				avail = XFER_MAX;
+
+			sprintf(size, "%x\015\012", avail);
+			if (http_send_buffer(c, size, strlen(size), MSG_MORE) < 0)
+				break;
+			while (avail > 0) {
+				n = splice(fd, NULL, c->fd, NULL, avail,
+						SPLICE_F_MOVE | SPLICE_F_MORE);
+				if (c->stats)
+					http_stats_io(c->stats, 1, n);
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n < 0 && errno == EAGAIN &&
+						http_wait(c, POLLOUT) == 0)
+					continue;
+				if (n <= 0)
+					break;
+				avail -= n;
+			}
+			if (avail > 0 || http_send_buffer(c, (char *) "\015\012", 2,
+					MSG_MORE) < 0)
+				break;
+		} else {
+			if (buffer == NULL && !(buffer = (char *)
+					http_arena_alloc(c->ctx, XFER_BLOCK)))
+				break;
+			n = read(fd, buffer, XFER_BLOCK);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				r = n;	/* EOF or error */
+				break;
+			}
+			if (http_send_chunk(c, buffer, n) < 0)
+				break;
+		}
+	}
+
+	/* last chunk, no trailer */
+	if (r == 0 && http_send_buffer(c, (char *) "0\015\012\015\012", 5, 0) < 0)
+		r = -1;
 	return r;
 }
-/**
- * set custom buffer reader
+
+/*
+ * send the data of a query from a file descriptor, after the header
+ * returns 0 or -1 on error
+ *	http_conn *c		connection to send on
+ *	int fd			file descriptor to read from
+ *	off_t length		bytes to send, -1 up to EOF (chunked)
  */
-extern void
-http_set_buffer_eof_reader(http_buffer_eof_reader reader)
+static int
+http_send_fd(http_conn *c, int fd, off_t length)
 {
-	return httpmt_set_buffer_eof_reader(&_ctx, reader);
+	sigset_t old;
+	int pending, r;
+
+	pending = http_sigpipe_block(&old);
+	if (length >= 0)
+		r = http_send_fd_length(c, fd, length);
+	else
+		r = http_send_fd_chunked(c, fd);
+	http_sigpipe_restore(&old, pending);
+
+	return r;
 }
 
-extern void
-httpmt_set_buffer_eof_reader(http_ctx *ctx, http_buffer_eof_reader reader)
+/*
+ * send the data of a query which does not go along with its header
+ * returns 0 or -1 on error
+ */
+static int
+http_send_source(http_conn *c, http_source *src)
 {
-	if (ctx != NULL)
-		ctx->reader = reader;
+#ifdef HAVE_ZLIB
+	if (src->gzip)
+		return http_send_gzip(c, src);
+#endif
+	if (src->fd >= 0)
+		return http_send_fd(c, src->fd, src->fd_length);
+	if (src->produce)
+		return http_send_producer(c, src);
+	return 0;
 }
-	
+
 /*
- * Pseudo general http query
- *
- * send a command and additional headers to the http server.
- * optionally through the proxy (if http_proxy_server and http_proxy_port are
- * set).
- *
- * Limitations: the url is truncated to first 256 chars and
- * the server name to 128 in case of proxy request.
- *
- * char *command		Command to send
- * char *url;			url / filename queried
- * char *additional_header	Additional header 
- * querymode mode; 		Type of query
- * char *data			Data to send after header. 
- *				If NULL, not data is sent 
- * int length			size of data
- * int *pfd			pointer to variable where to 
- *				set file descriptor value
+ * send the data of a query asked to its producer XFER_BLOCK bytes at a
+ * time, as is if its length is known, else in chunks
+ * returns 0 or -1 if the producer fails, ends early or gives more than
+ * asked, or on write error.
  */
-static http_retcode
-http_query(http_ctx *ctx, char *command, char *url, char *additional_header, 
-	querymode mode, char *data, int length, int *pfd) 
+static int
+http_send_producer(http_conn *c, http_source *src)
 {
-	int s;
-	struct hostent *hp;
-	struct sockaddr_in server;
-	char header[MAXBUF];
-	int hlg;
-	http_retcode ret;
-	int proxy; 
-	int port;
+	char *buffer;
+	off_t left = src->fd_length;
+	int want, n, r;
 
-	proxy = (ctx->proxy_server != NULL && ctx->proxy_port != 0);
-	port = proxy ? ctx->proxy_port : ctx->port;
-	 
-	if (pfd) *pfd=-1;
-	
-	/* get host info by name :*/
-	if ((hp = gethostbyname( proxy ? ctx->proxy_server 
-		: (ctx->server ? ctx->server : SERVER_DEFAULT)))) {
-		memset((char *) &server,0, sizeof(server));
-		memmove((char *) &server.sin_addr, hp->h_addr, hp->h_length);
-		server.sin_family = hp->h_addrtype;
-		server.sin_port = (unsigned short) htons( port );
-	} else {
-		return ERRHOST;
+	if (!(buffer = (char *) http_arena_alloc(c->ctx, XFER_BLOCK)))
+		return -1;
+
+	r = (left == 0) ? 0 : -1;
+	while (left != 0) {
+		want = (left >= 0 && left < XFER_BLOCK) ? (int) left : XFER_BLOCK;
+		n = (*src->produce)(buffer, want, src->produce_arg);
+		if (n < 0 || n > want || (n == 0 && left > 0))
+			break;
+		if (n == 0) {
+			/* last chunk, no trailer */
+			r = http_send_buffer(c, (char *) "0\015\012\015\012", 5, 0);
+			break;
+		}
+		if (left > 0) {
+			left -= n;
+			if (http_send_buffer(c, buffer, n, 
+					left > 0 ? MSG_MORE : 0) < 0)
+				break;
+			if (left == 0)
+				r = 0;
+			continue;
+		}
+		if (http_send_chunk(c, buffer, n) < 0)
+			break;
 	}
-	
-	/* create socket */
-	if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-		return ERRSOCK;
-	setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, 0, 0);
-	
-	/* connect to server */
-	if (connect(s, (const struct sockaddr *) &server, sizeof(server)) < 0) {
-		ret = ERRCONN;
-	} else {
-		if (pfd) *pfd = s;
-	 
-		/* create header */
-		if (proxy) {
-			if (ctx->b64_auth) {
-				sprintf(header,
-					"%s http://%.128s:%d/%.256s HTTP/1.0\015\012User-Agent: %s\015\012"
-					"Authorization: Basic %s\015\012%s\015\012",
-					command,
-					ctx->server,
-					ctx->port,
-					url,
-					http_user_agent,
-					ctx->b64_auth,
-					additional_header
-					);
-			} else {
-				sprintf(header,
-					"%s http://%.128s:%d/%.256s HTTP/1.0\015\012"
-					"User-Agent: %s\015\012%s\015\012",
-					command,
-					ctx->server,
-					ctx->port,
-					url,
-					http_user_agent,
-					additional_header
-				       );
-			}
-		} else {
-			if (ctx->b64_auth) {
-				sprintf(header,
-					"%s /%.256s HTTP/1.0\015\012User-Agent: %s\015\012"
-					"Authorization: Basic %s\015\012%s\015\012",
-					command,
-					url,
-					http_user_agent,
-					ctx->b64_auth,
-					additional_header
-					);
-			} else {
-				sprintf(header,
-					"%s /%.256s HTTP/1.0\015\012User-Agent: %s\015\012%s\015\012",
-					command,
-					url,
-					http_user_agent,
-					additional_header
-					);
+	return r;
+}
+
+/*
+ * wait until the kernel has released the buffers of all the MSG_ZEROCOPY
+ * sends of a connection, by reading completions from its error queue.
+ * If the kernel had to copy the data anyway (loopback, no device
+ * support) zerocopy is not used again on the connection.
+ * returns 0, or -1 if the request ran out of time or was cancelled: the
+ * connection is then reset so that the kernel drops the buffers
+ *	http_conn *c		connection
+ */
+static int
+http_zerocopy_wait(http_conn *c)
+{
+#if defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *ee;
+	struct linger lg = { 1, 0 };
+	int events;
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+
+	while (c->zc_done != c->zc_sent) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(c->fd, &msg, MSG_ERRQUEUE) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				break;
+			/* errors are always polled for */
+			if ((events = http_poll_events(c->ctx, c->fd, 0)) < 0) {
+				if (c->ctx->expired == OK0)
+					break;
+				setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg,
+					sizeof(lg));
+				c->keep = 0;
+				return -1;
 			}
+			if (events & (POLLHUP | POLLNVAL) && 
+					!(events & POLLERR))
+				break;
+			continue;
 		}
-	
-		hlg = strlen(header);
-		
-#ifdef _DEBUG
-		fputs(header, stderr);
-		putc('\n', stderr);
-#endif	
-	
-		/* send header */
-		if (write(s, header, hlg) != hlg) {
-			ret = ERRWRHD;
-			/* send data */
-		} else if (length && data && (write(s, data, length) != length)) {
-			ret = ERRWRDT;
-		} else {
-			/* read result & check */
-			ret = (http_retcode) http_read_line(s, header, MAXBUF - 1);
 
-			if (ret <= 0) 
-				ret = ERRRDHD;
-			else if (sscanf(header, "HTTP/1.%*d %03d", (int*)&ret) != 1) 
-				ret = ERRPAHD;
-			else if (mode == KEEP_OPEN)
-				return ret;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+				!(cm->cmsg_level == SOL_IPV6 && 
+					cm->cmsg_type == IPV6_RECVERR))
+				continue;
+			ee = (struct sock_extended_err *) CMSG_DATA(cm);
+			if (ee->ee_errno != 0 || 
+					ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			/* sends ee_info to ee_data are completed */
+			c->zc_done += ee->ee_data - ee->ee_info + 1;
+			if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				c->zerocopy = -1;
 		}
 	}
+#endif
+	return 0;
+}
 
-	/* close socket */
-	close(s);
-	return ret;
+/*
+ * find the first LF in p[0..n), 16 or 32 bytes at a time when the
+ * compiler targets SSE2 or AVX2.
+ * returns its offset or n if there is none.
+ */
+static int
+http_find_lf(const char *p, int n)
+{
+	int i = 0;
+#if defined(__AVX2__)
+	const __m256i lf32 = _mm256_set1_epi8('\012');
+	unsigned m32;
+
+	for (; i + 32 <= n; i += 32) {
+		m32 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(lf32,
+			_mm256_loadu_si256((const __m256i *) (p + i))));
+		if (m32)
+			return i + __builtin_ctz(m32);
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128i lf16 = _mm_set1_epi8('\012');
+	unsigned m16;
+
+	for (; i + 16 <= n; i += 16) {
+		m16 = _mm_movemask_epi8(_mm_cmpeq_epi8(lf16,
+			_mm_loadu_si128((const __m128i *) (p + i))));
+		if (m16)
+			return i + __builtin_ctz(m16);
+	}
+#endif
+	for (; i < n; i++)
+		if (p[i] == '\012')
+			break;
+	return i;
+}
+
+/*
+ * read more data from the socket into the receive buffer
+ * returns the number of bytes added, 0 on EOF, negative on error or
+ * if the buffer is full. The socket of an io_uring multi handle is read
+ * by the ring only: -1 with EAGAIN.
+ *	http_conn *c	connection to read from
+ */
+extern int
+http_fill(http_conn *c)
+{
+	int n, i;
+
+	if (http_compact(c) == 0)
+		return -1;
+	if (c->async && !c->nonblock) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if (!c->peek) {
+		do {
+			n = read(c->fd, c->rbuf + c->rlen, RBUF_SIZE - c->rlen);
+			if (c->stats)
+				http_stats_io(c->stats, 0, n);
+		} while (n < 0 && errno == EAGAIN && http_wait(c, POLLIN) == 0);
+		if (n > 0)
+			c->rlen += n;
+		return n;
+	}
+
+	/* look at what is there and only take it up to the empty line */
+	do {
+		n = recv(c->fd, c->rbuf + c->rlen, RBUF_SIZE - c->rlen, 
+				MSG_PEEK);
+		if (c->stats)
+			c->stats->recv_calls++;
+	} while (n < 0 && errno == EAGAIN && http_wait(c, POLLIN) == 0);
+	if (n <= 0)
+		return n;
+	for (i = 0; i < n && c->peek; i++) {
+		switch (c->rbuf[c->rlen + i]) {
+		case '\012':
+			if (c->nl)
+				c->peek = 0;
+			c->nl = 1;
+			break;
+		case '\015':
+			break;
+		default:
+			c->nl = 0;
+		}
+	}
+	n = read(c->fd, c->rbuf + c->rlen, i);
+	if (c->stats)
+		http_stats_io(c->stats, 0, n);
+	if (n > 0)
+		c->rlen += n;
+	return n;
+}
+
+/*
+ * read data from a connection, buffered data first
+ * returns the number of bytes read, 0 on EOF, negative on error
+ *	http_conn *c	connection to read from
+ *	char *buffer	placeholder for data
+ *	int length	max number of bytes to read
+ */
+static int
+http_recv(http_conn *c, char *buffer, int length)
+{
+	int n;
+
+	n = c->rlen - c->rpos;
+	if (n <= 0) {
+		/* io_uring reads, not us: the socket blocks */
+		if (c->async && !c->nonblock) {
+			errno = EAGAIN;
+			return -1;
+		}
+		do {
+			n = read(c->fd, buffer, length);
+			if (c->stats)
+				http_stats_io(c->stats, 0, n);
+		} while (n < 0 && errno == EAGAIN && http_wait(c, POLLIN) == 0);
+		return n;
+	}
+
+	if (n > length)
+		n = length;
+	memcpy(buffer, c->rbuf + c->rpos, n);
+	c->rpos += n;
+	return n;
 }
 
 /*
- * read a line from file descriptor
+ * read a line from a connection
  * returns the number of bytes read. negative if a read error occured
  * before the end of line or the max.
- * cariage returns (CR) are ignored.
- * 	int fd		File descriptor to read from
+ * cariage returns (CR) ending the line are ignored.
+ * 	http_conn *c	Connection to read from
  * 	char *buffer	Placeholder for data
  *	int max		Max number of bytes to read
  */
-static int http_read_line (int fd, char *buffer, int max) 
+static int
+http_read_line(http_conn *c, char *buffer, int max) 
 { 
-	/* not efficient on long lines (multiple unbuffered 1 char reads) */
-	int n=0;
-	while (n<max) {
-		if (read(fd,buffer,1)!=1) {
-			n= -n;
+	int n, avail, seen = 0;
+
+	while (1) {
+		avail = c->rlen - c->rpos;
+		if (avail > max)
+			avail = max;
+		n = seen + http_find_lf(c->rbuf + c->rpos + seen, avail - seen);
+		if (n < avail) {
+			/* LF is the separator */
+			memcpy(buffer, c->rbuf + c->rpos, n);
+			c->rpos += n + 1;
+			buffer[n] = 0;
+			if (n > 0 && buffer[n - 1] == '\015')
+				buffer[n - 1] = 0;
+			return n + 1;
+		}
+		if (avail == max || http_fill(c) <= 0)
 			break;
+		seen = avail;
+	}
+
+	/* no end of line before max or the end of data */
+	memcpy(buffer, c->rbuf + c->rpos, avail);
+	c->rpos += avail;
+	buffer[avail] = 0;
+	return avail == max ? max : -avail;
+}
+
+/*
+ * make room at the end of the receive buffer: the data consumed is
+ * dropped, but not the header of the last answer (from rpin), which
+ * moves to the start, followed by the data left.
+ * returns the room left
+ */
+extern int
+http_compact(http_conn *c)
+{
+	int dst = 0, hlen;
+
+	if (c->rpos < c->rlen && c->rlen < RBUF_SIZE)
+		return RBUF_SIZE - c->rlen;
+
+	if (c->rpin >= 0) {
+		hlen = c->rhend - c->rpin;
+		if (c->rpin > 0) {
+			/* the data left is after the header */
+			memmove(c->rbuf, c->rbuf + c->rpin, hlen);
+			c->rpin = 0;
+			c->rhend = hlen;
 		}
-		n++;
-		if (*buffer=='\015') continue; /* ignore CR */
-		if (*buffer=='\012') break;    /* LF is the separator */
-		buffer++;
+		dst = hlen;
+	}
+	if (c->rpos > dst) {
+		memmove(c->rbuf + dst, c->rbuf + c->rpos, c->rlen - c->rpos);
+		c->rlen -= c->rpos - dst;
+		c->rpos = dst;
+	}
+	return RBUF_SIZE - c->rlen;
+}
+
+/*
+ * get the next line of a connection where it is in the receive buffer,
+ * the end of line (LF or CRLF) is replaced by a NUL.
+ * returns the length of the line, or -1 if EOF, a read error or a line
+ * longer than the buffer comes first.
+ *	char **pline	address of a pointer set to the line
+ */
+static int
+http_next_line(http_conn *c, char **pline)
+{
+	int n, avail, seen = 0;
+	char *p;
+
+	while (1) {
+		avail = c->rlen - c->rpos;
+		n = seen + http_find_lf(c->rbuf + c->rpos + seen, avail - seen);
+		if (n < avail)
+			break;
+		seen = avail;
+		if (http_fill(c) <= 0)
+			return -1;
 	}
-	*buffer=0;
+
+	p = c->rbuf + c->rpos;
+	c->rpos += n + 1;
+	p[n] = '\0';
+	if (n > 0 && p[n - 1] == '\015')
+		p[--n] = '\0';
+	*pline = p;
 	return n;
 }
 
 /*
- * read data from file descriptor
+ * read data from a connection
  * retries reading until the number of bytes requested is read.
  * returns the number of bytes read. negative if a read error (EOF) occured
  * before the requested length.
  *
- *	int fd		file descriptor to read from
+ *	http_conn *c	connection to read from
  *	char *buffer	placeholder for data
  *	int length	number of bytes to read
  */
 static int 
-http_read_buffer(int fd, char *buffer, int length) 
+http_read_buffer(http_conn *c, char *buffer, int length) 
 {
 	int n,r;
 	for (n=0; n<length; n+=r) {
-		r=read(fd,buffer,length-n);
+		r=http_recv(c,buffer,length-n);
 		if (r<=0) return -n;
 		buffer+=r;
 	}
@@ -833,20 +4286,20 @@ http_read_buffer(int fd, char *buffer, int length)
 }
 
 /*
- * read data from file descriptor
- * retries reading until the number of bytes requested is read.
- * returns the number of bytes read or -1 if fails
+ * read a body without length from a connection, up to EOF or the last
+ * chunk. The buffer doubles as it fills, it is trimmed at the end if 
+ * much of it is left unused.
+ * returns 0 or -1 if fails
  *
- *	int fd		file descriptor to read from
+ *	http_conn *c	connection to read from
  *	char **pbuffer	placeholder for return data
  *	int *plength	number of bytes read
  */
 static int 
-http_read_buffer_eof(int fd, char **pbuffer, int *plength) 
+http_read_buffer_eof(http_conn *c, char **pbuffer, int *plength) 
 {
 	int r = 0;
 	static int page_size = 0;
-	int to_read;
 	char *data;
 	int size = 0;
 
@@ -862,26 +4315,33 @@ http_read_buffer_eof(int fd, char **pbuffer, int *plength)
 
 	do {
 		if (*plength >= size) {
-			size += page_size;
-			data = (char *) realloc(*pbuffer, size);
-			if (data == NULL) {
+			if (size > INT_MAX / 2) {
+				errno = EFBIG;
 				r = -1;
-				free(*pbuffer);
+			} else {
+				size = size ? size * 2 : page_size;
+				data = (char *) http_realloc(c->ctx, *pbuffer, size);
+				if (data == NULL)
+					r = -1;
+				else
+					*pbuffer = data;
+			}
+			if (r == -1) {
+				httpmt_free(c->ctx, *pbuffer);
+				*pbuffer = NULL;
 				*plength = 0;
 				break;
-			} else {
-				*pbuffer = data;
 			}
 		}
 
-		to_read = -1 * ((*plength % page_size) - page_size);
-		r = read(fd, *pbuffer + *plength, to_read);
+		r = http_read_body(c, *pbuffer + *plength, size - *plength);
 
 		if (r == -1) {
-			if (errno == ECONNRESET) {
+			if (errno == ECONNRESET && !c->chunked) {
 				r = 0;
 			} else {
-				free(*pbuffer);
+				httpmt_free(c->ctx, *pbuffer);
+				*pbuffer = NULL;
 				*plength = 0;
 			}
 			break;
@@ -892,5 +4352,11 @@ http_read_buffer_eof(int fd, char **pbuffer, int *plength)
 		}
 	} while (1);
 
+	/* give back the unused end if more than a quarter of the buffer */
+	if (r == 0 && size - *plength > size / 4 &&
+			(data = (char *) http_realloc(c->ctx, *pbuffer,
+				*plength > 0 ? *plength : 1)) != NULL)
+		*pbuffer = data;
+
 	return r;
 }
@@ -10,12 +10,43 @@
  *
  */
 
+#include <sys/types.h>
+
  /* declarations */
 typedef int (*http_base64_encoder)(const char *in, char **out);
 
 /* custom function to read buffer eof */
 typedef void (*http_buffer_eof_reader)(int fd);
 
+/* called with each piece of the data of an answer, see http_get_stream,
+ * returns 0 to go on or non zero to stop the transfer */
+typedef int (*http_data_func)(const char *data, int length, void *arg);
+
+/* fills buffer with the next bytes of the data of a PUT or POST, see
+ * http_put_producer, returns how many (size at most), 0 at the end or -1
+ * to stop the transfer */
+typedef int (*http_producer)(char *buffer, int size, void *arg);
+
+/* connection to a server (or proxy), kept in the ctx pool between queries */
+typedef struct _http_conn http_conn;
+
+/* allocator hooks, opaque is the pointer given to http_set_allocator */
+typedef void *(*http_malloc_func)(size_t size, void *opaque);
+typedef void *(*http_realloc_func)(void *ptr, size_t size, void *opaque);
+typedef void (*http_free_func)(void *ptr, void *opaque);
+
+/* scratch memory of the requests of a ctx */
+typedef struct _http_arena http_arena;
+
+/* many requests run by one thread, see httpmt_multi_init */
+typedef struct _httpmt_multi httpmt_multi;
+
+/* answers of http_get kept in memory, see http_cache_new */
+typedef struct _http_cache http_cache;
+
+/* answers of httpmt_get_view kept on disk, see http_disk_cache_open */
+typedef struct _http_disk_cache http_disk_cache;
+
 /* return type */
 typedef enum {
 
@@ -33,6 +64,14 @@ typedef enum {
   ERRRDDT=-11,/* Read error while reading data */
   ERRURLH=-12,/* Invalid url - must start with 'http://' */
   ERRURLP=-13,/* Invalid port in url */
+  ERRWRFD=-14,/* Write error on output file descriptor */
+  ERRCNTO=-15,/* Connect timeout */
+  ERRRDTO=-16,/* Timeout waiting for the server (first byte or idle) */
+  ERRDEAD=-17,/* Request deadline passed */
+  ERRCANC=-18,/* Request cancelled, see http_cancel */
+  ERRABRT=-19,/* Transfer stopped by a data callback */
+  ERRFULL=-20,/* Data larger than the buffer given */
+  ERRRDFD=-21,/* Read error on input file descriptor */
   
 
   /* Return code by the server */
@@ -46,10 +85,112 @@ typedef enum {
   /* Succesful results */
   OK0 = 0,   /* successfull parse */
   OK201=201, /* Ressource succesfully created */
+  OK206=206, /* Range of the ressource succesfully read */
   OK200=200  /* Ressource succesfully read */
 
 } http_retcode;
 
+/* header fields of an answer found by index, see http_header_known */
+typedef enum {
+  HTTP_H_CONTENT_LENGTH,
+  HTTP_H_CONTENT_TYPE,
+  HTTP_H_TRANSFER_ENCODING,
+  HTTP_H_CONNECTION,
+  HTTP_H_KEEP_ALIVE,
+  HTTP_H_CONTENT_ENCODING,
+  HTTP_H_CONTENT_RANGE,
+  HTTP_H_ACCEPT_RANGES,
+  HTTP_H_ETAG,
+  HTTP_H_LAST_MODIFIED,
+  HTTP_H_CACHE_CONTROL,
+  HTTP_H_EXPIRES,
+  HTTP_H_AGE,
+  HTTP_H_DATE,
+  HTTP_H_VARY,
+  HTTP_H_LOCATION,
+  HTTP_H_SERVER,
+  HTTP_H_KNOWN		/* number of them */
+} http_hdr;
+
+/* what a request did, see http_set_stats
+ * times are CLOCK_MONOTONIC nanoseconds, 0 for a phase that did not
+ * happen (no lookup nor connect on a pooled connection) */
+typedef struct {
+	long long start;	/* request started */
+	long long dns;		/* server address known */
+	long long connect;	/* connection established */
+	long long sent;		/* request header and data sent */
+	long long first_byte;	/* first byte of the answer received */
+	long long header;	/* answer header read */
+	long long end;		/* answer read, connection given back */
+
+	long long bytes_sent;	/* header and data, on the socket */
+	long long bytes_received;
+	int send_calls;		/* system calls sending on the socket */
+	int recv_calls;		/* system calls receiving from it */
+	int reused;		/* sent on a pooled connection */
+	int retries;		/* sent again on a new connection */
+
+	/* TCP_INFO of the connection at the end, 0 if not available */
+	unsigned rtt;		/* smoothed round trip time, microseconds */
+	unsigned rttvar;	/* its variation */
+	unsigned retransmits;	/* segments retransmitted */
+	unsigned snd_cwnd;	/* congestion window, in segments */
+	unsigned snd_mss;
+
+	/* body with a Content-Encoding, see http_set_compression, 0 if
+	 * it had none */
+	long long encoded_bytes;	/* as received */
+	long long decoded_bytes;	/* returned */
+} http_stats;
+
+/* deadlines of a request, in milliseconds, 0 = none */
+typedef struct {
+	int connect;		/* to establish a connection */
+	int first_byte;		/* from the request sent to the answer */
+	int idle;		/* without anything sent or received */
+	int total;		/* for the whole request */
+} http_timeouts;
+
+/* counters of a response cache, see http_cache_get_stats */
+typedef struct {
+	long long hits;		/* fresh answers returned */
+	long long misses;	/* answers not in the cache */
+	long long revalidations;	/* stale answers asked again */
+	long long not_modified;	/* of them, returned on a 304 answer */
+	long long stored;	/* answers kept */
+	long long evicted;	/* answers dropped to make room */
+	long long bytes;	/* held now, data and keys */
+	int entries;		/* answers held now */
+} http_cache_stats;
+
+/* read only answer of httpmt_get_view, see http_view_release */
+typedef struct {
+	const char *data;	/* the data */
+	off_t length;		/* its length */
+	void *map;		/* mapping of a cached file, or NULL */
+	struct _http_ctx *ctx;	/* owner of data if it is not mapped */
+} http_view;
+
+/* called with the stats of each request when it is over */
+typedef void (*http_stats_func)(http_stats *stats, void *arg);
+
+/* request of a pipelined batch, see http_pipeline */
+typedef struct {
+	char *command;		/* GET or HEAD */
+	char *filename;		/* name of the ressource */
+	char *typebuf;		/* allocated buffer for the type, may be NULL */
+	http_retcode ret;	/* result, as for http_get and http_head */
+	char *data;		/* answer of a GET, to free with http_free */
+	int length;		/* its length, or the length of a HEAD */
+} http_batch;
+
+/* called when a request of a multi handle is over, with the answer of a
+ * GET or POST (data, length and type, freed when it returns) or the 
+ * length and type of a HEAD */
+typedef void (*http_multi_done)(void *arg, http_retcode ret, char *data,
+			int length, char *type);
+
 /* CTX */
 typedef struct _http_ctx {
 	char *server;
@@ -61,6 +202,56 @@ typedef struct _http_ctx {
 	char *b64_auth;
 
 	http_buffer_eof_reader reader;
+
+	/* keep-alive pool, HTTP/1.1 persistent connections are used
+	 * when pool_max_idle > 0 */
+	int pool_max_idle;	/* max idle connections kept */
+	int pool_max_age;	/* max seconds a connection stays idle */
+	http_conn *pool;	/* idle connections, most recently used first */
+
+	/* data of at least this size is sent with MSG_ZEROCOPY, 0 = never */
+	int zerocopy_min;
+
+	/* allocator of the ctx memory and of returned data, malloc(3) & co
+	 * when NULL */
+	http_malloc_func malloc_fn;
+	http_realloc_func realloc_fn;
+	http_free_func free_fn;
+	void *alloc_opaque;
+	http_arena *arena;	/* per request bump allocator */
+
+	/* io_uring queue size of the multi handles, 0 = epoll */
+	int uring_entries;
+
+	/* connection holding the header of the last answer */
+	http_conn *answer;
+
+	/* per request stats, not collected when NULL */
+	http_stats *stats;
+	http_stats_func stats_fn;
+	void *stats_arg;
+
+	/* deadlines of the requests, and of the next one only if next_set */
+	http_timeouts timeouts;
+	http_timeouts next_timeouts;
+	int next_set;
+	/* of the request in progress */
+	http_timeouts cur;
+	long long deadline;	/* end of the whole request, 0 = none */
+	http_retcode expired;	/* why it stopped waiting, 0 if it did not */
+	int cancelled;		/* set by http_cancel */
+	int cancel_fd;		/* eventfd waking it up + 1, 0 = none yet */
+
+	/* gzip and deflate answers accepted and decoded */
+	int compression;
+	/* PUT and POST data sent gzip compressed at this zlib level (1-9),
+	 * 0 = as is */
+	int upload_level;
+	void *deflate;		/* zlib state, kept for the next uploads */
+
+	/* answers of GET kept and revalidated, NULL = none */
+	http_cache *cache;
+	http_disk_cache *disk_cache;	/* of httpmt_get_view */
 } http_ctx;
 
 /* Functions */
@@ -68,28 +259,140 @@ extern http_retcode http_parse_url(char *url, char **pfilename);
 extern http_retcode http_proxy_url(char *url);
 extern http_retcode http_put(char *filename, char *data, int length, 
 			int overwrite, char *type);
+extern http_retcode http_put_fd(char *filename, int fd, off_t length,
+			int overwrite, char *type);
+extern http_retcode http_put_producer(char *filename, http_producer fn,
+			void *arg, off_t length, int overwrite, char *type);
 extern http_retcode http_get(char *filename, char **pdata,int *plength,
 			char *typebuf);
+extern http_retcode http_get_to_fd(char *filename, int fd, off_t *plength,
+			char *typebuf);
+extern http_retcode http_get_stream(char *filename, http_data_func fn,
+			void *arg, char *buffer, int size, off_t *plength,
+			char *typebuf);
+extern http_retcode http_get_into(char *filename, char *buffer, int size,
+			int *plength, char *typebuf);
+extern http_retcode http_pipeline(http_batch *reqs, int n);
 extern http_retcode http_delete(char *filename);
 extern http_retcode http_head(char *filename, int *plength, char *typebuf);
 extern http_retcode http_post(char *filename, char *data, int length,
 			char *type, char **pdata, int *plength, char **ptype);
+extern http_retcode http_post_fd(char *filename, int fd, off_t length,
+			char *type, char **pdata, int *plength, char **ptype);
+extern http_retcode http_post_producer(char *filename, http_producer fn,
+			void *arg, off_t length, char *type, char **pdata,
+			int *plength, char **ptype);
+extern http_retcode http_post_stream(char *filename, char *data, int length,
+			char *type, http_data_func fn, void *arg, char *buffer,
+			int size, off_t *plength, char *typebuf);
 extern void http_set_base64_encoder(http_base64_encoder enc);
 extern http_retcode http_set_basic_auth(char *user, char *pass);
 extern void http_set_buffer_eof_reader(http_buffer_eof_reader reader);
+extern void http_set_keepalive(int max_idle, int max_age);
+extern void http_cleanup(void);
+extern void http_set_zerocopy(int min_length);
+extern http_retcode http_set_allocator(http_malloc_func m, http_realloc_func r,
+			http_free_func f, void *opaque);
+extern void http_free(void *ptr);
+extern void http_set_io_uring(int entries);
+extern char *http_header(char *name);
+extern char *http_header_known(http_hdr id);
+extern int http_header_field(int i, char **pname, char **pvalue);
+extern void http_set_stats(http_stats *stats, http_stats_func fn, void *arg);
+extern void http_set_timeouts(const http_timeouts *t);
+extern void http_set_next_timeouts(const http_timeouts *t);
+extern void http_cancel(void);
+extern void http_set_compression(int on);
+extern void http_set_upload_compression(int level);
+extern void http_set_dns_ttl(int ttl, int negative_ttl);
+extern void http_dns_flush(void);
+extern void http_set_cache(http_cache *cache);
+extern void http_set_disk_cache(http_disk_cache *dc);
 
 /* Multi-thread functions */
 extern http_retcode httpmt_parse_url(http_ctx *ctx, char *url, char **pfilename);
 extern http_retcode httpmt_proxy_url(http_ctx *ctx, char *url);
 extern http_retcode httpmt_put(http_ctx *ctx, char *filename, char *data, int length, 
 		int overwrite, char *type);
+extern http_retcode httpmt_put_fd(http_ctx *ctx, char *filename, int fd,
+		off_t length, int overwrite, char *type);
+extern http_retcode httpmt_put_producer(http_ctx *ctx, char *filename,
+		http_producer fn, void *arg, off_t length, int overwrite,
+		char *type);
 extern http_retcode httpmt_get(http_ctx *ctx, char *filename, char **pdata,
 		int *plength, char *typebuf);
+extern http_retcode httpmt_get_to_fd(http_ctx *ctx, char *filename, int fd,
+		off_t *plength, char *typebuf);
+extern http_retcode httpmt_get_stream(http_ctx *ctx, char *filename,
+		http_data_func fn, void *arg, char *buffer, int size,
+		off_t *plength, char *typebuf);
+extern http_retcode httpmt_get_into(http_ctx *ctx, char *filename,
+		char *buffer, int size, int *plength, char *typebuf);
+extern http_retcode httpmt_pipeline(http_ctx *ctx, http_batch *reqs, int n);
 extern http_retcode httpmt_delete(http_ctx *ctx, char *filename);
 extern http_retcode httpmt_head(http_ctx *ctx, char *filename, int *plength,
 		char *typebuf);
 extern http_retcode httpmt_post(http_ctx *ctx, char *filename, char *data, int length,
 		char *type, char **pdata, int *plength, char **ptype);
+extern http_retcode httpmt_post_fd(http_ctx *ctx, char *filename, int fd,
+		off_t length, char *type, char **pdata, int *plength, char **ptype);
+extern http_retcode httpmt_post_producer(http_ctx *ctx, char *filename,
+		http_producer fn, void *arg, off_t length, char *type,
+		char **pdata, int *plength, char **ptype);
+extern http_retcode httpmt_post_stream(http_ctx *ctx, char *filename,
+		char *data, int length, char *type, http_data_func fn,
+		void *arg, char *buffer, int size, off_t *plength,
+		char *typebuf);
 extern void httpmt_set_base64_encoder(http_ctx *ctx, http_base64_encoder enc);
 extern http_retcode httpmt_set_basic_auth(http_ctx *ctx, char *user, char *pass);
 extern void httpmt_set_buffer_eof_reader(http_ctx *ctx, http_buffer_eof_reader reader);
+extern void httpmt_set_keepalive(http_ctx *ctx, int max_idle, int max_age);
+extern void httpmt_cleanup(http_ctx *ctx);
+extern void httpmt_set_zerocopy(http_ctx *ctx, int min_length);
+extern http_retcode httpmt_set_allocator(http_ctx *ctx, http_malloc_func m,
+		http_realloc_func r, http_free_func f, void *opaque);
+extern void httpmt_free(http_ctx *ctx, void *ptr);
+extern void httpmt_set_io_uring(http_ctx *ctx, int entries);
+extern char *httpmt_header(http_ctx *ctx, char *name);
+extern char *httpmt_header_known(http_ctx *ctx, http_hdr id);
+extern int httpmt_header_field(http_ctx *ctx, int i, char **pname,
+		char **pvalue);
+extern void httpmt_set_stats(http_ctx *ctx, http_stats *stats,
+		http_stats_func fn, void *arg);
+extern void httpmt_set_timeouts(http_ctx *ctx, const http_timeouts *t);
+extern void httpmt_set_next_timeouts(http_ctx *ctx, const http_timeouts *t);
+extern void httpmt_cancel(http_ctx *ctx);
+extern void httpmt_set_compression(http_ctx *ctx, int on);
+extern void httpmt_set_upload_compression(http_ctx *ctx, int level);
+extern void httpmt_set_cache(http_ctx *ctx, http_cache *cache);
+extern void httpmt_set_disk_cache(http_ctx *ctx, http_disk_cache *dc);
+
+/* Multi request engine */
+extern httpmt_multi *httpmt_multi_init(http_ctx *ctx);
+extern http_retcode httpmt_multi_add(httpmt_multi *m, char *command,
+		char *filename, char *data, int length, char *type,
+		http_multi_done done, void *arg);
+extern int httpmt_multi_perform(httpmt_multi *m, int timeout);
+extern void httpmt_multi_cleanup(httpmt_multi *m);
+
+/* Parallel and resumable transfers */
+extern http_retcode httpmt_get_parallel(http_ctx *ctx, char *filename,
+		int streams, int fd, char **pdata, off_t *plength,
+		char *typebuf);
+extern http_retcode httpmt_get_resume(http_ctx *ctx, char *filename, int fd,
+		char *checkpoint, off_t *plength, char *typebuf);
+extern http_retcode httpmt_put_resume(http_ctx *ctx, char *filename, int fd,
+		off_t length, int overwrite, char *type, char *checkpoint);
+
+/* Response cache */
+extern http_cache *http_cache_new(size_t max_bytes);
+extern void http_cache_free(http_cache *cache);
+extern void http_cache_get_stats(http_cache *cache, http_cache_stats *stats);
+extern http_disk_cache *http_disk_cache_open(const char *dir,
+		off_t max_bytes);
+extern void http_disk_cache_close(http_disk_cache *dc);
+extern void http_disk_cache_get_stats(http_disk_cache *dc,
+		http_cache_stats *stats);
+extern http_retcode httpmt_get_view(http_ctx *ctx, char *filename,
+		http_view *view, char *typebuf);
+extern void http_view_release(http_view *view);
@@ -0,0 +1,776 @@
+/*
+ *  Http put/get/post mini lib
+ *  multi request engine
+ *  see LICENSE for terms, conditions and DISCLAIMER OF ALL WARRANTIES
+ *
+ * Description : many requests in flight from a single thread. Each
+ * request is a state machine (connect, send, status and header, body)
+ * driven by epoll(7) on non-blocking sockets, a callback is called when
+ * it is over.
+ *
+ * With io_uring (httpmt_set_io_uring), the connect, send and receive
+ * operations of all the requests are queued in a ring instead and
+ * submitted with a single system call that also waits for completions.
+ * Data is received straight into the buffer of the connection. If the
+ * ring can't be created, epoll is used.
+ *
+ * The header and chunk framing are only parsed once they are fully in
+ * the receive buffer of the connection, so the blocking readers of
+ * http_lib.c are used as is and never wait (the connections are marked
+ * async, a read which would block fails with EAGAIN). Gzip and deflate
+ * bodies are inflated from the receive buffer as they come. Connections
+ * come from and go back to the keep-alive pool of the ctx. Host names are
+ * resolved through the resolver cache, the first lookup of a host blocks.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "http_lib.h"
+#include "http_private.h"
+
+/* max events handled by one epoll_wait */
+#define MULTI_EVENTS 256
+/* first size of the buffer of a body without length */
+#define MULTI_BODY 4096
+
+typedef enum {
+	M_START,	/* not started yet */
+	M_CONNECT,	/* non-blocking connect in progress */
+	M_SEND,		/* sending header and data */
+	M_HEAD,		/* waiting for the status line and header */
+	M_BODY		/* receiving the body */
+} mstate;
+
+typedef struct _http_mreq http_mreq;
+
+struct _http_mreq {
+	http_mreq *prev, *next;	/* requests of the multi handle */
+	mstate state;
+	char *server;		/* server or proxy to connect to */
+	int port;
+	int head;		/* HEAD query, no body in the answer */
+	int answer;		/* data of the answer goes to the callback */
+	char *header;		/* query header */
+	int hlg;
+	char *data;		/* data sent after it, owned by the caller */
+	int length;
+	long sent;		/* bytes of header and data sent */
+	struct iovec iov[2];	/* what is left to send */
+	struct msghdr msg;
+	http_addrs addrs;	/* addresses to connect to, in turn */
+	int ai;
+	int idempotent;		/* can be sent twice, see http_idempotent */
+	int reused;		/* connection taken from the pool */
+	int nopool;		/* don't take one from the pool (retry) */
+	http_conn *c;
+	int pending;		/* io_uring operation in progress */
+	int eof;		/* io_uring receive got EOF */
+	int rerr;		/* or failed with this errno */
+	http_retcode ret;	/* status from the server */
+	int clength;		/* content length from the header */
+	char type[MAXBUF];
+	char *body;		/* data received */
+	int blen;
+	int bsize;
+	http_multi_done done;
+	void *arg;
+};
+
+struct _httpmt_multi {
+	http_ctx *ctx;
+	int epfd;		/* epoll, or -1 with io_uring */
+	http_uring *uring;
+	int inflight;		/* io_uring operations in progress */
+	http_mreq *reqs;	/* requests not over, newest first */
+	int running;
+	int starting;		/* requests not started yet */
+};
+
+static void multi_start(httpmt_multi *m, http_mreq *r);
+static void multi_connect(httpmt_multi *m, http_mreq *r);
+static void multi_send(httpmt_multi *m, http_mreq *r);
+static void multi_recv(httpmt_multi *m, http_mreq *r);
+static void multi_finish(httpmt_multi *m, http_mreq *r, http_retcode ret);
+static void multi_free(httpmt_multi *m, http_mreq *r);
+static int multi_watch(httpmt_multi *m, http_mreq *r, int op, int events);
+static int multi_more(httpmt_multi *m, http_mreq *r);
+static int multi_queue(httpmt_multi *m, http_mreq *r, int opcode, void *addr,
+			unsigned len, unsigned long off);
+static void multi_complete(httpmt_multi *m, http_mreq *r, int res);
+
+/*
+ * create a multi handle running the requests of ctx: its server, proxy,
+ * authentication and pool are used, the ctx must not be used by another
+ * thread as long as the handle exists. io_uring is used if set on the ctx
+ * and available.
+ * returns NULL if out of memory or if epoll is not available
+ */
+extern httpmt_multi *
+httpmt_multi_init(http_ctx *ctx)
+{
+	httpmt_multi *m;
+
+	if (ctx == NULL)
+		return NULL;
+
+	if ((m = (httpmt_multi *) http_alloc(ctx, sizeof(*m))) == NULL)
+		return NULL;
+	m->ctx = ctx;
+	m->reqs = NULL;
+	m->running = 0;
+	m->starting = 0;
+	m->inflight = 0;
+	m->epfd = -1;
+	m->uring = NULL;
+	if (ctx->uring_entries > 0)
+		m->uring = http_uring_init(ctx, ctx->uring_entries);
+	if (m->uring == NULL &&
+			(m->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		httpmt_free(ctx, m);
+		return NULL;
+	}
+
+	return m;
+}
+
+/*
+ * add a request to a multi handle, it starts at the next
+ * httpmt_multi_perform. The server is the one of the last
+ * httpmt_parse_url on the ctx.
+ * returns OK0 or a negative error code
+ *
+ *	char *command	GET, HEAD, PUT, POST or DELETE
+ *	char *filename	name of the ressource
+ *	char *data	data to PUT or POST, must stay valid until the 
+ *			request is over
+ *	int length	its length
+ *	char *type	its type, may be NULL
+ *	http_multi_done done	called when the request is over, with
+ *			the answer of a GET or POST and the length of a HEAD
+ *	void *arg	given to done
+ */
+extern http_retcode
+httpmt_multi_add(httpmt_multi *m, char *command, char *filename, char *data,
+		int length, char *type, http_multi_done done, void *arg)
+{
+	http_ctx *ctx;
+	http_mreq *r;
+	char header[MAXHDR];
+	char additional[MAXBUF];
+	int proxy, hlg, withdata;
+
+	if (m == NULL || command == NULL || filename == NULL || done == NULL)
+		return ERRNULL;
+	ctx = m->ctx;
+
+	withdata = (!strcmp(command, "PUT") || !strcmp(command, "POST"));
+	if (withdata && (data == NULL || length <= 0))
+		return ERRNULL;
+	if (!withdata && strcmp(command, "GET") && strcmp(command, "HEAD") &&
+			strcmp(command, "DELETE"))
+		return ERRNULL;
+
+	additional[0] = '\0';
+	if (withdata)
+		http_data_header(additional, length, type, 0);
+	hlg = http_request_header(ctx, command, filename, additional,
+		ctx->pool_max_idle > 0, header);
+	if (hlg < 0)
+		return ERRWRHD;
+
+	if ((r = (http_mreq *) http_alloc(ctx, sizeof(*r))) == NULL)
+		return ERRMEM;
+	memset(r, 0, sizeof(*r));
+
+	proxy = (ctx->proxy_server != NULL && ctx->proxy_port != 0);
+	r->server = http_strdup(ctx, proxy ? ctx->proxy_server :
+		ctx->server ? ctx->server : (char *) SERVER_DEFAULT);
+	r->header = (char *) http_alloc(ctx, hlg);
+	if (r->server == NULL || r->header == NULL) {
+		httpmt_free(ctx, r->server);
+		httpmt_free(ctx, r->header);
+		httpmt_free(ctx, r);
+		return ERRMEM;
+	}
+	memcpy(r->header, header, hlg);
+	r->hlg = hlg;
+	r->port = proxy ? ctx->proxy_port : ctx->port;
+	r->head = !strcmp(command, "HEAD");
+	r->idempotent = http_idempotent(command);
+	r->answer = (!strcmp(command, "GET") || !strcmp(command, "POST"));
+	r->data = withdata ? data : NULL;
+	r->length = withdata ? length : 0;
+	r->state = M_START;
+	r->done = done;
+	r->arg = arg;
+
+	r->next = m->reqs;
+	if (m->reqs)
+		m->reqs->prev = r;
+	m->reqs = r;
+	m->running++;
+	m->starting++;
+
+	return OK0;
+}
+
+/*
+ * run the requests of a multi handle: starts the new ones, then waits
+ * up to timeout milliseconds (-1 for ever) for events and handles them.
+ * Callbacks are called from here, they may add requests.
+ * returns the number of requests not over yet or -1 if epoll fails
+ */
+extern int
+httpmt_multi_perform(httpmt_multi *m, int timeout)
+{
+	struct epoll_event ev[MULTI_EVENTS];
+	http_mreq *r, *next;
+	void *data;
+	int i, n;
+
+	if (m == NULL)
+		return -1;
+
+	for (r = m->reqs; r; r = next) {
+		next = r->next;
+		if (r->state == M_START)
+			multi_start(m, r);
+	}
+
+	if (m->running == 0)
+		return 0;
+
+	/* callbacks of requests over at once added new ones */
+	if (m->starting > 0)
+		timeout = 0;
+
+	if (m->uring) {
+		if (http_uring_wait(m->uring, timeout) < 0)
+			return errno == EINTR ? m->running : -1;
+		while (http_uring_peek(m->uring, &data, &n))
+			if (data)
+				multi_complete(m, (http_mreq *) data, n);
+		return m->running;
+	}
+
+	n = epoll_wait(m->epfd, ev, MULTI_EVENTS, timeout);
+	if (n < 0)
+		return errno == EINTR ? m->running : -1;
+
+	for (i = 0; i < n; i++) {
+		r = (http_mreq *) ev[i].data.ptr;
+		switch (r->state) {
+		case M_CONNECT:
+		case M_SEND:
+			multi_send(m, r);
+			break;
+		case M_HEAD:
+		case M_BODY:
+			multi_recv(m, r);
+			break;
+		default:
+			break;
+		}
+	}
+
+	return m->running;
+}
+
+/*
+ * free a multi handle, requests not over are dropped without callback
+ */
+extern void
+httpmt_multi_cleanup(httpmt_multi *m)
+{
+	http_mreq *r;
+	void *data;
+	int res;
+
+	if (m == NULL)
+		return;
+
+	if (m->uring) {
+		/* the kernel must be done with the buffers */
+		for (r = m->reqs; r; r = r->next) {
+			if (r->pending)
+				multi_queue(m, NULL, IORING_OP_ASYNC_CANCEL, r,
+					0, 0);
+		}
+		while (m->inflight > 0 && http_uring_wait(m->uring, -1) == 0) {
+			while (http_uring_peek(m->uring, &data, &res)) {
+				if (data) {
+					((http_mreq *) data)->pending = 0;
+					m->inflight--;
+				}
+			}
+		}
+	}
+
+	while (m->reqs) {
+		if (m->reqs->c) {
+			m->reqs->c->keep = 0;
+			http_release(m->ctx, m->reqs->c);
+		}
+		multi_free(m, m->reqs);
+	}
+	if (m->uring)
+		http_uring_free(m->uring);
+	else
+		close(m->epfd);
+	httpmt_free(m->ctx, m);
+}
+
+/*
+ * start a request on a pooled connection or a new one
+ */
+static void
+multi_start(httpmt_multi *m, http_mreq *r)
+{
+	http_retcode ret;
+	http_conn *c = NULL;
+
+	m->starting--;
+	r->state = M_CONNECT;
+	if (m->ctx->pool_max_idle > 0 && !r->nopool)
+		c = http_pool_get(m->ctx, r->server, r->port);
+	if (c) {
+		r->c = c;
+		r->reused = 1;
+		r->state = M_SEND;
+		/* blocking for io_uring, non-blocking for epoll */
+		http_nonblock(c, !m->uring);
+		c->async = 1;
+		if (m->uring) {
+			multi_send(m, r);
+			return;
+		}
+		if (multi_watch(m, r, EPOLL_CTL_ADD, EPOLLOUT) < 0)
+			multi_finish(m, r, ERRSOCK);
+		return;
+	}
+
+	if ((ret = http_resolve(r->server, r->port, &r->addrs)) < 0) {
+		multi_finish(m, r, ret);
+		return;
+	}
+	r->ai = 0;
+	multi_connect(m, r);
+}
+
+/*
+ * start a non-blocking connect to the next address of the server
+ */
+static void
+multi_connect(httpmt_multi *m, http_mreq *r)
+{
+	struct sockaddr_storage *sa;
+	http_retcode ret = ERRCONN;
+	int s;
+
+	for (; r->ai < r->addrs.n; r->ai++) {
+		sa = &r->addrs.addr[r->ai];
+		if ((s = socket(sa->ss_family, SOCK_STREAM | 
+				(m->uring ? 0 : SOCK_NONBLOCK), 0)) < 0) {
+			ret = ERRSOCK;
+			continue;
+		}
+		if (!m->uring && connect(s, (const struct sockaddr *) sa, 
+				r->addrs.len[r->ai]) < 0 && errno != EINPROGRESS) {
+			http_dns_report(r->server, sa, 0);
+			close(s);
+			continue;
+		}
+
+		if (r->c == NULL &&
+			(r->c = http_conn_new(m->ctx, s, r->server, r->port)) == NULL) {
+			close(s);
+			multi_finish(m, r, ERRMEM);
+			return;
+		}
+		r->c->fd = s;
+		r->c->nonblock = !m->uring;
+		r->c->async = 1;
+		r->state = M_CONNECT;
+		if (m->uring) {
+			if (multi_queue(m, r, IORING_OP_CONNECT, sa, 0,
+					r->addrs.len[r->ai]) < 0)
+				multi_finish(m, r, ERRSOCK);
+			return;
+		}
+		if (multi_watch(m, r, EPOLL_CTL_ADD, EPOLLOUT) < 0) {
+			multi_finish(m, r, ERRSOCK);
+			return;
+		}
+		return;
+	}
+
+	multi_finish(m, r, ret);
+}
+
+/*
+ * complete the connect and send the header and data as the socket
+ * accepts them
+ */
+static void
+multi_send(httpmt_multi *m, http_mreq *r)
+{
+	http_conn *c = r->c;
+	socklen_t len;
+	int err, n;
+	long total;
+
+	if (r->state == M_CONNECT) {
+		len = sizeof(err);
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+			err = errno;
+		if (err == EINPROGRESS)
+			return;
+		http_dns_report(r->server, &r->addrs.addr[r->ai], !err);
+		if (err) {
+			/* next address, on a new socket */
+			epoll_ctl(m->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+			close(c->fd);
+			c->fd = -1;
+			r->ai++;
+			multi_connect(m, r);
+			return;
+		}
+		r->state = M_SEND;
+	}
+
+	total = r->hlg + r->length;
+	while (r->sent < total) {
+		n = 0;
+		if (r->sent < r->hlg) {
+			r->iov[n].iov_base = r->header + r->sent;
+			r->iov[n++].iov_len = r->hlg - r->sent;
+		}
+		if (r->length > 0) {
+			r->iov[n].iov_base = r->data + 
+				(r->sent > r->hlg ? r->sent - r->hlg : 0);
+			r->iov[n].iov_len = r->length - 
+				(r->sent > r->hlg ? r->sent - r->hlg : 0);
+			n++;
+		}
+		memset(&r->msg, 0, sizeof(r->msg));
+		r->msg.msg_iov = r->iov;
+		r->msg.msg_iovlen = n;
+		if (m->uring) {
+			if (multi_queue(m, r, IORING_OP_SENDMSG, &r->msg, 1, 0) < 0)
+				multi_finish(m, r, ERRWRHD);
+			return;
+		}
+		n = sendmsg(c->fd, &r->msg, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return;
+		if (n <= 0) {
+			multi_finish(m, r, r->sent < r->hlg ? ERRWRHD : ERRWRDT);
+			return;
+		}
+		r->sent += n;
+	}
+
+	c->peek = 0;
+	r->state = M_HEAD;
+	if (m->uring)
+		multi_recv(m, r);
+	else if (multi_watch(m, r, EPOLL_CTL_MOD, EPOLLIN) < 0)
+		multi_finish(m, r, ERRSOCK);
+}
+
+/*
+ * read the answer as it arrives
+ */
+static void
+multi_recv(httpmt_multi *m, http_mreq *r)
+{
+	http_conn *c = r->c;
+	char *data;
+	int n, minor;
+	http_retcode ret;
+
+	if (r->state == M_HEAD) {
+		while (!http_head_buffered(c)) {
+			n = multi_more(m, r);
+			if (n < 0 && (errno == EAGAIN || errno == EINTR))
+				return;
+			if (n <= 0) {
+				multi_finish(m, r, ERRRDHD);
+				return;
+			}
+		}
+
+		ret = http_read_status(c, &minor);
+		if (ret < 0) {
+			multi_finish(m, r, ret);
+			return;
+		}
+		c->keep = (m->ctx->pool_max_idle > 0 && minor >= 1);
+		c->nobody = (r->head || ret == 204 || ret == 304);
+		r->ret = ret;
+		r->clength = -1;
+		if (http_read_header(c, &r->clength, r->type) < 0) {
+			multi_finish(m, r, ERRRDHD);
+			return;
+		}
+		/* the server closes the connection at the end of data */
+		if (!c->chunked && c->left < 0)
+			c->keep = 0;
+		if (r->clength >= 0)
+			r->bsize = r->clength;
+		r->state = M_BODY;
+	}
+
+	while (1) {
+		if (http_body_done(c)) {
+			multi_finish(m, r, r->ret);
+			return;
+		}
+
+		/* with io_uring, nothing is read outside of the ring, decoded
+		 * data may be left from what was read though */
+		if (!http_body_buffered(c) || 
+				(m->uring && c->rpos == c->rlen && !c->zfull)) {
+			n = multi_more(m, r);
+			if (n < 0 && (errno == EAGAIN || errno == EINTR))
+				return;
+			if (n > 0)
+				continue;
+			/* end of data without length */
+			if ((n == 0 || errno == ECONNRESET) &&
+					!c->chunked && c->left < 0)
+				multi_finish(m, r, r->ret);
+			else
+				multi_finish(m, r, ERRRDDT);
+			return;
+		}
+
+		if (r->blen == r->bsize || r->body == NULL) {
+			if (r->blen == r->bsize)
+				r->bsize = r->bsize ? r->bsize * 2 : MULTI_BODY;
+			data = (char *) http_realloc(m->ctx, r->body, r->bsize);
+			if (data == NULL) {
+				multi_finish(m, r, ERRMEM);
+				return;
+			}
+			r->body = data;
+		}
+
+		n = http_read_body(c, r->body + r->blen, r->bsize - r->blen);
+		if (n > 0) {
+			r->blen += n;
+			continue;
+		}
+		/* all the data read was decoded, more is queued above */
+		if (n < 0 && errno == EAGAIN && m->uring)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		/* a reset is how some servers end data without length */
+		if (n == 0 || (errno == ECONNRESET && !c->chunked && c->left < 0))
+			multi_finish(m, r, r->ret);
+		else
+			multi_finish(m, r, ERRRDDT);
+		return;
+	}
+}
+
+/*
+ * a request is over: its connection goes back to the pool, the callback
+ * is called. A pooled connection closed by the server while idle is 
+ * replaced by a new one, once, if the request can be sent twice or none
+ * of it was sent.
+ */
+static void
+multi_finish(httpmt_multi *m, http_mreq *r, http_retcode ret)
+{
+	http_conn *c = r->c;
+
+	if (c) {
+		if (ret < 0)
+			c->keep = 0;
+		if (c->fd >= 0 && !m->uring)
+			epoll_ctl(m->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+		http_release(m->ctx, c);
+		r->c = NULL;
+	}
+
+	if (r->reused && r->state <= M_HEAD && 
+			(ret == ERRWRHD || ret == ERRWRDT || ret == ERRRDHD) &&
+			(r->idempotent || r->sent == 0)) {
+		r->state = M_START;
+		r->reused = 0;
+		r->nopool = 1;
+		r->sent = 0;
+		r->eof = 0;
+		r->rerr = 0;
+		m->starting++;
+		multi_start(m, r);
+		return;
+	}
+
+	if (ret == OK200 && r->answer)
+		(*r->done)(r->arg, ret, r->body ? r->body : (char *) "", 
+			r->blen, r->type);
+	else if (ret == OK200 && r->head)
+		(*r->done)(r->arg, ret, NULL, r->clength > 0 ? r->clength : 0,
+			r->type);
+	else
+		(*r->done)(r->arg, ret, NULL, 0, NULL);
+
+	multi_free(m, r);
+}
+
+/*
+ * remove a request from its multi handle and free it
+ */
+static void
+multi_free(httpmt_multi *m, http_mreq *r)
+{
+	if (r->state == M_START)
+		m->starting--;
+	if (r->prev)
+		r->prev->next = r->next;
+	else
+		m->reqs = r->next;
+	if (r->next)
+		r->next->prev = r->prev;
+	m->running--;
+
+	httpmt_free(m->ctx, r->server);
+	httpmt_free(m->ctx, r->header);
+	httpmt_free(m->ctx, r->body);
+	httpmt_free(m->ctx, r);
+}
+
+/*
+ * (re)register the socket of a request for events
+ */
+static int
+multi_watch(httpmt_multi *m, http_mreq *r, int op, int events)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = r;
+	return epoll_ctl(m->epfd, op, r->c->fd, &ev);
+}
+
+/*
+ * get more data in the receive buffer of the connection of a request,
+ * like http_fill. With io_uring, a receive is queued and -1 returned with
+ * errno EAGAIN, its data is there when multi_recv is called again.
+ */
+static int
+multi_more(httpmt_multi *m, http_mreq *r)
+{
+	http_conn *c = r->c;
+
+	if (!m->uring)
+		return http_fill(c);
+
+	if (r->eof)
+		return 0;
+	if (r->rerr) {
+		errno = r->rerr;
+		return -1;
+	}
+
+	if (http_compact(c) == 0) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	if (multi_queue(m, r, IORING_OP_RECV, c->rbuf + c->rlen,
+			RBUF_SIZE - c->rlen, 0) < 0)
+		return -1;
+	errno = EAGAIN;
+	return -1;
+}
+
+/*
+ * queue an io_uring operation on the socket of a request
+ * (r NULL: to cancel the operation of request addr)
+ * returns 0 or -1 if the ring is full
+ */
+static int
+multi_queue(httpmt_multi *m, http_mreq *r, int opcode, void *addr,
+		unsigned len, unsigned long off)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = http_uring_sqe(m->uring)) == NULL)
+		return -1;
+	sqe->opcode = opcode;
+	sqe->fd = r ? r->c->fd : -1;
+	sqe->addr = (unsigned long) addr;
+	sqe->len = len;
+	sqe->off = off;
+	if (opcode == IORING_OP_SENDMSG)
+		sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (unsigned long) r;
+	if (r) {
+		r->pending = 1;
+		m->inflight++;
+	}
+	return 0;
+}
+
+/*
+ * an io_uring operation of a request is over, res is its result
+ */
+static void
+multi_complete(httpmt_multi *m, http_mreq *r, int res)
+{
+	http_conn *c = r->c;
+
+	r->pending = 0;
+	m->inflight--;
+
+	switch (r->state) {
+	case M_CONNECT:
+		http_dns_report(r->server, &r->addrs.addr[r->ai], res >= 0);
+		if (res < 0) {
+			/* next address, on a new socket */
+			close(c->fd);
+			c->fd = -1;
+			r->ai++;
+			multi_connect(m, r);
+			return;
+		}
+		r->state = M_SEND;
+		multi_send(m, r);
+		break;
+	case M_SEND:
+		if (res <= 0) {
+			multi_finish(m, r, r->sent < r->hlg ? ERRWRHD : ERRWRDT);
+			return;
+		}
+		r->sent += res;
+		multi_send(m, r);
+		break;
+	case M_HEAD:
+	case M_BODY:
+		if (res > 0)
+			c->rlen += res;
+		else if (res == 0)
+			r->eof = 1;
+		else
+			r->rerr = -res;
+		multi_recv(m, r);
+		break;
+	default:
+		break;
+	}
+}
@@ -0,0 +1,210 @@
+/*
+ *  Http put/get/post mini lib
+ *  internal declarations shared by the library modules
+ *  see LICENSE for terms, conditions and DISCLAIMER OF ALL WARRANTIES
+ *
+ */
+
+#include <sys/socket.h>
+#include <time.h>
+
+#define SERVER_DEFAULT "adonis"
+/* beware that filename+type+rest of header must not exceed MAXBUF */
+/* so we limit filename to 256 and type to 64 chars in put & get */
+#define MAXBUF 512
+/* request header: request line, host, auth and additional header */
+#define MAXHDR 2048
+/* receive buffer of a connection, holds at least a header line */
+#define RBUF_SIZE 16384
+/* max length of a content type returned in typebuf */
+#define MAXTYPE 64
+/* longest ETag or Last-Modified date kept by the caches */
+#define MAXVALIDATOR 256
+/* conditional header lines of a cached answer, with both validators */
+#define MAXCOND (2 * MAXVALIDATOR + \
+		sizeof("If-None-Match: \r\nIf-Modified-Since: \r\n"))
+
+/* max addresses kept for a host */
+#define HTTP_MAX_ADDRS 8
+
+/* addresses of a host, in the order they should be tried */
+typedef struct {
+	int n;
+	struct sockaddr_storage addr[HTTP_MAX_ADDRS];
+	socklen_t len[HTTP_MAX_ADDRS];
+} http_addrs;
+
+typedef enum
+{
+	CHUNK_SIZE, /* chunk size line expected */
+	CHUNK_DATA, /* in chunk data */
+	CHUNK_END   /* last chunk and trailer read */
+} chunkstate;
+
+/* what a connection waits for, which tells its deadline */
+typedef enum
+{
+	W_IDLE,    /* more of the request or the answer */
+	W_CONNECT, /* connection established */
+	W_FIRST    /* first byte of the answer */
+} waitstate;
+
+/* Content-Encoding of an answer, decoded as the body is read */
+typedef enum
+{
+	ENC_NONE,
+	ENC_GZIP,
+	ENC_DEFLATE, /* zlib stream */
+	ENC_RAW      /* deflate without zlib header, sent by some servers */
+} encoding;
+
+struct z_stream_s;
+
+typedef enum 
+{
+	CLOSE,  /* Answer is not returned to the caller (for put) */
+	KEEP_OPEN /* Keep it open */
+} querymode;
+
+/* data sent after the header of a query */
+typedef struct {
+	char *data;		/* in memory data */
+	int length;		/* its length */
+	int fd;			/* or file descriptor to read it from, if >= 0 */
+	off_t fd_length;	/* bytes to read from fd or the producer,
+				 * -1 up to EOF */
+	http_producer produce;	/* or function making it, if not NULL */
+	void *produce_arg;
+	int gzip;		/* gzip compressed as it is sent, in chunks */
+	char *copy;		/* compressed copy of data, to free */
+} http_source;
+
+/* header field of an answer, offsets from the start of the header */
+typedef struct {
+	unsigned short name;
+	unsigned short value;
+} http_field;
+
+/* max header fields kept for http_header */
+#define HTTP_MAX_FIELDS 64
+
+/* connection to a server or proxy */
+struct _http_conn {
+	int fd;
+	char *host;		/* host connected to, server or proxy */
+	int port;
+	int keep;		/* can be reused once the response is read */
+	int nobody;		/* answer has no body (HEAD, 204, 304) */
+	int chunked;		/* answer uses chunked transfer coding */
+	long left;		/* bytes left in the body or the current
+				 * chunk, -1 when the body ends at EOF */
+	int chunk;		/* chunked body state */
+	time_t idle_since;	/* when it was put back in the pool */
+	http_conn *next;
+	http_ctx *ctx;		/* owner, for its allocator and arena */
+
+	/* received data not consumed yet is rbuf[rpos..rlen) */
+	int rpos;
+	int rlen;
+	/* peek mode: nothing past the end of the header is taken from the
+	 * socket, used when the body is left to a custom reader */
+	int peek;
+	int nl;			/* end of header scan state in peek mode */
+
+	/* stats of the request in progress on it, or NULL */
+	http_stats *stats;
+
+	int nonblock;		/* O_NONBLOCK is set */
+	int wait;		/* deadline of a wait, W_xxx */
+	int async;		/* driven by a multi handle: a read which
+				 * would block fails with EAGAIN */
+
+	/* body decoding, ENC_xxx, with zlib */
+	int encoding;
+	int zinit;		/* inflate set up for this body */
+	int zend;		/* end of the compressed stream seen */
+	int zfull;		/* decoded data may be left, the buffer
+				 * given was filled */
+	struct z_stream_s *zs;	/* inflate state, kept for the next answers */
+	unsigned char zhead[2];	/* first bytes of a deflate body, in case
+				 * they are not a zlib header */
+
+	/* header of the last answer, left in place in rbuf from rpin 
+	 * (-1 if none) to rhend, the fields are NUL terminated */
+	int rpin;
+	int rhend;
+	int nfields;
+	http_field fields[HTTP_MAX_FIELDS];
+	unsigned char known[HTTP_H_KNOWN]; /* fields index + 1, 0 if none */
+
+	/* MSG_ZEROCOPY: 1 enabled, -1 not available, 0 not tried yet */
+	int zerocopy;
+	unsigned zc_sent;	/* zerocopy sends so far */
+	unsigned zc_done;	/* zerocopy sends completed by the kernel */
+
+	char rbuf[RBUF_SIZE];
+};
+
+/* http_lib.c */
+extern void *http_alloc(http_ctx *ctx, size_t size);
+extern void *http_realloc(http_ctx *ctx, void *ptr, size_t size);
+extern char *http_strdup(http_ctx *ctx, const char *s);
+extern http_retcode http_query(http_ctx *ctx, const char *command,
+				char *url, const char *additional_header, querymode mode,
+				http_source *src, http_conn **pconn);
+extern http_retcode http_expired(http_ctx *ctx, http_retcode ret);
+extern int http_idempotent(const char *command);
+extern int http_request_header(http_ctx *ctx, const char *command,
+				char *url, const char *additional_header, int keepalive,
+				char *header);
+extern void http_data_header(char *header, off_t length, char *type,
+				int overwrite);
+extern http_conn *http_conn_new(http_ctx *ctx, int fd, char *server_name,
+				int port);
+extern http_conn *http_pool_get(http_ctx *ctx, char *server_name, int port);
+extern void http_release(http_ctx *ctx, http_conn *c);
+extern void http_conn_close(http_conn *c);
+extern int http_fill(http_conn *c);
+extern int http_compact(http_conn *c);
+extern void http_nonblock(http_conn *c, int on);
+extern int http_wait(http_conn *c, short events);
+extern int http_head_buffered(http_conn *c);
+extern int http_body_buffered(http_conn *c);
+extern http_retcode http_read_status(http_conn *c, int *pminor);
+extern http_retcode http_read_header(http_conn *c, int *plength,
+				char *typebuf);
+extern int http_read_body(http_conn *c, char *buffer, int max);
+extern int http_body_done(http_conn *c);
+extern void http_skip_answer(http_conn *c);
+extern http_retcode http_read_data(http_ctx *ctx, http_conn *c, int length,
+				char **pdata, int *plength);
+extern http_retcode http_body_to_fd(http_conn *c, int fd, off_t *plength);
+extern void http_answer_release(http_ctx *ctx);
+
+/* http_cache.c */
+extern int http_cache_key(http_ctx *ctx, char *filename, char *key);
+extern http_retcode http_cache_lookup(http_ctx *ctx, char *key, char **pdata,
+				int *plength, char *typebuf, char *cond);
+extern http_retcode http_cache_revalidated(http_ctx *ctx, char *key,
+				char *cond, char **pdata, int *plength,
+				char *typebuf);
+extern void http_cache_store(http_ctx *ctx, char *key, char *data,
+				int length, char *type);
+extern long http_cache_lifetime(http_ctx *ctx);
+extern char *http_cache_validator(http_ctx *ctx, http_hdr id);
+
+/* http_uring.c */
+typedef struct _http_uring http_uring;
+struct io_uring_sqe;
+extern http_uring *http_uring_init(http_ctx *ctx, unsigned entries);
+extern void http_uring_free(http_uring *u);
+extern struct io_uring_sqe *http_uring_sqe(http_uring *u);
+extern int http_uring_submit(http_uring *u);
+extern int http_uring_wait(http_uring *u, int timeout);
+extern int http_uring_peek(http_uring *u, void **pdata, int *pres);
+
+/* http_dns.c */
+extern http_retcode http_resolve(const char *host, int port,
+				http_addrs *addrs);
+extern void http_dns_report(const char *host, 
+				const struct sockaddr_storage *addr, int ok);
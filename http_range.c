@@ -0,0 +1,907 @@
+/*
+ *  Http put/get/post mini lib
+ *  parallel segmented download
+ *  see LICENSE for terms, conditions and DISCLAIMER OF ALL WARRANTIES
+ *
+ * Description : a ressource is fetched in byte ranges over several
+ * connections at once. A first GET asks for the first range only, its
+ * Content-Range tells the size of the whole: the rest is split between
+ * the workers, one thread each, and the caller's thread works through
+ * the first range. Every worker writes where its range goes, with
+ * pwrite(2) into a file descriptor or straight into the buffer returned.
+ *
+ * A worker with nothing left takes the second half of the range with the
+ * most left: the worker which had it stops at its middle and drops its
+ * connection. Only the caller's thread uses the caller's ctx, the other
+ * workers have a ctx of their own with the same server, proxy,
+ * authentication and deadlines, and a pool of one connection.
+ *
+ * A server which does not know ranges answers the first GET with the
+ * whole ressource, it is read as is. The later ranges are asked with
+ * If-Range, so that a ressource changing meanwhile is not mixed up.
+ *
+ * Resumable transfers keep their progress in a checkpoint file, one text
+ * line replaced with rename(2): a download goes on with Range and
+ * If-Range, an upload is sent in pieces with Content-Range, the next
+ * piece after the last one the server answered.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "http_lib.h"
+#include "http_private.h"
+
+/* first range, asked with the request telling the size */
+#define PAR_FIRST (1 << 20)
+/* smallest range taken from another worker */
+#define PAR_MIN (256 << 10)
+/* max connections of a download */
+#define PAR_MAX 64
+/* bytes read at once */
+#define PAR_BLOCK 65536
+/* longest validator sent in If-Range */
+#define PAR_VALIDATOR 256
+/* bytes of a download between checkpoints */
+#define RESUME_STEP (4 << 20)
+/* bytes of an upload piece */
+#define RESUME_PIECE (16 << 20)
+
+typedef struct _http_par http_par;
+
+typedef struct {
+	http_par *p;
+	http_ctx *ctx;		/* the caller's one or own */
+	http_ctx own;
+	pthread_t tid;
+	int thread;		/* tid is a thread to join */
+	int running;		/* thread started and not done */
+	char *buffer;		/* PAR_BLOCK bytes when writing to a fd */
+
+	/* under the lock of the download */
+	off_t pos;		/* next byte to get */
+	off_t end;		/* end of the range, lowered by a worker
+				 * taking half of it */
+	off_t reading;		/* end of the block being read */
+} http_worker;
+
+struct _http_par {
+	pthread_mutex_t lock;
+	http_ctx *ctx;		/* of the caller */
+	char *filename;
+	char validator[PAR_VALIDATOR];	/* sent in If-Range, "" if none */
+	int fd;			/* written to if >= 0 */
+	char *data;		/* or filled */
+	http_retcode ret;	/* first error, OK0 if none */
+	int n;
+	http_worker w[PAR_MAX];
+};
+
+static void *http_par_thread(void *arg);
+static void http_par_run(http_worker *w);
+static http_retcode http_par_range(http_worker *w);
+static http_retcode http_par_body(http_worker *w, http_conn *c,
+			off_t stop);
+static int http_par_steal(http_worker *w);
+static void http_par_fail(http_par *p, http_retcode ret);
+static void http_par_ctx(http_ctx *w, http_ctx *ctx);
+static int http_par_write(int fd, char *buffer, int n, off_t pos);
+static http_retcode http_par_whole(http_ctx *ctx, http_conn *c, int fd,
+			char **pdata, off_t *plength);
+static void http_range_validator(http_ctx *ctx, char *validator);
+static int http_ckpt_load(char *path, const char *kind, off_t *pdone,
+			off_t *ptotal, char *validator);
+static int http_ckpt_save(char *path, const char *kind, off_t done,
+			off_t total, char *validator);
+
+/*
+ * Get data from the server over several connections at once
+ *
+ * Like http_get and http_get_to_fd, for large ressources on links one
+ * connection can't fill. Each connection fetches a byte range, the
+ * ranges of slow ones are split for the others. If the server ignores
+ * ranges, the data comes over a single connection.
+ * returns OK200 when all the data was read, a negative error code or a
+ * positive code from the server
+ *
+ *	char *filename	name of the ressource to read
+ *	int streams	max number of connections, the ones after the
+ *			first in threads of their own
+ *	int fd		file descriptor where the data is written from
+ *			offset 0 with pwrite, it is sized to the data first.
+ *			If < 0, the data is returned in *pdata
+ *	char **pdata	address of a pointer variable set to allocated
+ *			memory with the data, to free with http_free
+ *	off_t *plength	address of variable which will be set to the
+ *			length of the data, may be NULL
+ *	char *typebuf	allocated buffer where the read data type is returned.
+ *			If NULL, the type is not returned
+ */
+extern http_retcode
+httpmt_get_parallel(http_ctx *ctx, char *filename, int streams, int fd,
+		char **pdata, off_t *plength, char *typebuf)
+{
+	http_par *p;
+	http_conn *c;
+	http_worker *w;
+	http_retcode ret;
+	char header[MAXBUF];
+	char *v;
+	long long first, last, total;
+	off_t size;
+	struct stat st;
+	int i, compression;
+
+	if (ctx == NULL || filename == NULL || (fd < 0 && pdata == NULL))
+		return ERRNULL;
+
+	if (pdata) *pdata = NULL;
+	if (plength) *plength = 0;
+	if (typebuf) *typebuf = '\0';
+	if (streams < 1)
+		streams = 1;
+	if (streams > PAR_MAX)
+		streams = PAR_MAX;
+
+	/* ranges are of the data as sent, it must not be encoded */
+	compression = ctx->compression;
+	ctx->compression = 0;
+
+	snprintf(header, sizeof(header), "Range: bytes=0-%d\015\012",
+		PAR_FIRST - 1);
+	ret = http_query(ctx, "GET", filename, header, KEEP_OPEN, NULL, &c);
+	if (ret >= OK0 && ret != OK200 && ret != OK206) {
+		http_skip_answer(c);
+		http_release(ctx, c);
+	}
+	if (ret != OK200 && ret != OK206) {
+		ctx->compression = compression;
+		return http_expired(ctx, ret);
+	}
+
+	if (http_read_header(c, NULL, typebuf) < 0) {
+		c->keep = 0;
+		http_release(ctx, c);
+		ctx->compression = compression;
+		return http_expired(ctx, ERRRDHD);
+	}
+
+	/* no range: the whole of it */
+	if (ret == OK200) {
+		ret = http_par_whole(ctx, c, fd, pdata, plength);
+		http_release(ctx, c);
+		ctx->compression = compression;
+		return http_expired(ctx, ret);
+	}
+
+	v = httpmt_header_known(ctx, HTTP_H_CONTENT_RANGE);
+	if (v == NULL || sscanf(v, "bytes %lld-%lld/%lld", &first, &last,
+			&total) != 3 || first != 0 || last < first ||
+			last >= total) {
+		c->keep = 0;
+		http_release(ctx, c);
+		ctx->compression = compression;
+		return ERRNOLG;
+	}
+
+	if (!(p = (http_par *) http_alloc(ctx, sizeof(http_par)))) {
+		c->keep = 0;
+		http_release(ctx, c);
+		ctx->compression = compression;
+		return ERRMEM;
+	}
+	memset(p, 0, sizeof(http_par));
+	pthread_mutex_init(&p->lock, NULL);
+	p->ctx = ctx;
+	p->filename = filename;
+	p->fd = fd;
+	p->ret = OK0;
+
+	http_range_validator(ctx, p->validator);
+
+	size = (off_t) total;
+	if (fd >= 0) {
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+				st.st_size != size && ftruncate(fd, size) < 0)
+			ret = ERRWRFD;
+	} else if (!(p->data = (char *) http_alloc(ctx, size))) {
+		ret = ERRMEM;
+	}
+	if (ret < 0) {
+		c->keep = 0;
+		http_release(ctx, c);
+		httpmt_free(ctx, p->data);
+		pthread_mutex_destroy(&p->lock);
+		httpmt_free(ctx, p);
+		ctx->compression = compression;
+		return ret;
+	}
+
+	/* the caller's thread reads the first range, the rest is split
+	 * evenly, not in ranges smaller than PAR_MIN */
+	if ((off_t) (size - last - 1) / PAR_MIN + 1 < streams)
+		streams = (size - last - 1) / PAR_MIN + 1;
+	p->n = streams;
+	for (i = 0; i < p->n; i++) {
+		w = &p->w[i];
+		w->p = p;
+		if (i == 0) {
+			w->ctx = ctx;
+			w->pos = 0;
+			w->end = p->n > 1 ? last + 1 : size;
+		} else {
+			w->ctx = &w->own;
+			http_par_ctx(w->ctx, ctx);
+			w->pos = last + 1 + (size - last - 1) * (i - 1) /
+				(p->n - 1);
+			w->end = last + 1 + (size - last - 1) * i / (p->n - 1);
+		}
+		w->reading = w->pos;
+	}
+	w = &p->w[0];
+	w->running = 1;
+	for (i = 1; i < p->n; i++) {
+		pthread_mutex_lock(&p->lock);
+		p->w[i].running = 1;
+		pthread_mutex_unlock(&p->lock);
+		p->w[i].thread = (pthread_create(&p->w[i].tid, NULL,
+			http_par_thread, &p->w[i]) == 0);
+		if (!p->w[i].thread) {
+			/* its range goes to the others */
+			pthread_mutex_lock(&p->lock);
+			p->w[i].running = 0;
+			pthread_mutex_unlock(&p->lock);
+		}
+	}
+
+	if ((ret = http_par_body(w, c, last + 1)) != OK0)
+		http_par_fail(p, ret);
+	http_release(ctx, c);
+	http_par_run(w);
+
+	for (i = 1; i < p->n; i++) {
+		if (p->w[i].thread)
+			pthread_join(p->w[i].tid, NULL);
+		httpmt_free(&p->w[i].own, p->w[i].buffer);
+		httpmt_cleanup(&p->w[i].own);
+	}
+	httpmt_free(ctx, w->buffer);
+	ctx->compression = compression;
+
+	ret = p->ret != OK0 ? p->ret : OK200;
+	if (ret == OK200) {
+		if (pdata)
+			*pdata = p->data;
+		if (plength)
+			*plength = size;
+	} else {
+		httpmt_free(ctx, p->data);
+	}
+	pthread_mutex_destroy(&p->lock);
+	httpmt_free(ctx, p);
+
+	return http_expired(ctx, ret);
+}
+
+/*
+ * worker thread of a download
+ */
+static void *
+http_par_thread(void *arg)
+{
+	http_par_run((http_worker *) arg);
+	return NULL;
+}
+
+/*
+ * get the range of a worker, then the ones it takes from the others,
+ * until there is nothing left or something failed
+ */
+static void
+http_par_run(http_worker *w)
+{
+	http_par *p = w->p;
+	http_retcode ret;
+
+	do {
+		if ((ret = http_par_range(w)) != OK0) {
+			http_par_fail(p, ret);
+			break;
+		}
+	} while (http_par_steal(w));
+
+	pthread_mutex_lock(&p->lock);
+	w->running = 0;
+	pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * ask for the range of a worker and read it
+ * returns OK0, a negative error code or the code of a server which did
+ * not return the range
+ */
+static http_retcode
+http_par_range(http_worker *w)
+{
+	http_par *p = w->p;
+	http_conn *c;
+	http_retcode ret;
+	char header[MAXBUF];
+	char *v;
+	long long first;
+	off_t pos, end;
+
+	pthread_mutex_lock(&p->lock);
+	pos = w->pos;
+	end = w->end;
+	pthread_mutex_unlock(&p->lock);
+	if (pos >= end)
+		return OK0;
+
+	snprintf(header, sizeof(header), "Range: bytes=%lld-%lld\015\012%s%s%s",
+		(long long) pos, (long long) end - 1,
+		p->validator[0] ? "If-Range: " : "", p->validator,
+		p->validator[0] ? "\015\012" : "");
+	ret = http_query(w->ctx, "GET", p->filename, header, KEEP_OPEN, NULL,
+		&c);
+	if (ret == OK206) {
+		if (http_read_header(c, NULL, NULL) < 0) {
+			c->keep = 0;
+			ret = ERRRDHD;
+		} else if (!(v = httpmt_header_known(w->ctx,
+				HTTP_H_CONTENT_RANGE)) || sscanf(v, "bytes %lld-",
+				&first) != 1 || first != (long long) pos) {
+			c->keep = 0;
+			ret = ERRPAHD;
+		} else {
+			ret = http_par_body(w, c, end);
+		}
+		http_release(w->ctx, c);
+	} else if (ret == OK200) {
+		/* the whole ressource, it changed since the first range: not
+		 * worth reading to reuse the connection */
+		c->keep = 0;
+		http_release(w->ctx, c);
+		ret = ERRRDDT;
+	} else if (ret >= OK0) {
+		http_skip_answer(c);
+		http_release(w->ctx, c);
+	}
+
+	return http_expired(w->ctx, ret);
+}
+
+/*
+ * read the body of the answer for the range of a worker, up to its end
+ * which may move meanwhile. The connection can't be reused if it stops
+ * before the end of the body.
+ * returns OK0 or a negative error code
+ *	off_t stop	end of the range of the answer
+ */
+static http_retcode
+http_par_body(http_worker *w, http_conn *c, off_t stop)
+{
+	http_par *p = w->p;
+	char *to;
+	off_t pos, want;
+	int n, done;
+
+	if (p->fd >= 0 && w->buffer == NULL &&
+			!(w->buffer = (char *) http_alloc(w->ctx, PAR_BLOCK)))
+		return ERRMEM;
+
+	while (1) {
+		pthread_mutex_lock(&p->lock);
+		pos = w->pos;
+		want = (w->end < stop ? w->end : stop) - pos;
+		if (want > PAR_BLOCK)
+			want = PAR_BLOCK;
+		w->reading = pos + want;
+		done = (want <= 0 || p->ret != OK0);
+		pthread_mutex_unlock(&p->lock);
+		if (done)
+			break;
+
+		/* the ctx of the caller may be cancelled meanwhile */
+		if (w->ctx == p->ctx && __atomic_load_n(&p->ctx->cancelled,
+				__ATOMIC_SEQ_CST))
+			return ERRCANC;
+
+		to = p->fd >= 0 ? w->buffer : p->data + pos;
+		if ((n = http_read_body(c, to, (int) want)) <= 0) {
+			c->keep = 0;
+			return n == 0 ? ERRPAHD : ERRRDDT;
+		}
+		if (p->fd >= 0 && http_par_write(p->fd, to, n, pos) < 0) {
+			c->keep = 0;
+			return ERRWRFD;
+		}
+
+		pthread_mutex_lock(&p->lock);
+		w->pos += n;
+		pthread_mutex_unlock(&p->lock);
+	}
+
+	if (!http_body_done(c))
+		c->keep = 0;
+	return OK0;
+}
+
+/*
+ * give a worker done with its range the range of a worker which is not
+ * running, or the second half of the range with the most left
+ * returns 1 if it got one, 0 if there is nothing to take
+ */
+static int
+http_par_steal(http_worker *w)
+{
+	http_par *p = w->p;
+	http_worker *v, *best = NULL;
+	off_t mid, from = 0;
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	for (i = 0; i < p->n && p->ret == OK0; i++) {
+		v = &p->w[i];
+		if (v == w || v->pos >= v->end)
+			continue;
+		if (!v->running) {
+			best = v;
+			from = v->pos;
+			break;
+		}
+		mid = v->pos + (v->end - v->pos) / 2;
+		if (mid < v->reading)
+			mid = v->reading;
+		if (v->end - mid >= PAR_MIN &&
+				(best == NULL || v->end - mid > best->end - from)) {
+			best = v;
+			from = mid;
+		}
+	}
+	if (best) {
+		w->pos = w->reading = from;
+		w->end = best->end;
+		best->end = from;
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return best != NULL;
+}
+
+/*
+ * the download failed: the first error is kept and the other workers
+ * stop waiting
+ */
+static void
+http_par_fail(http_par *p, http_retcode ret)
+{
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	if (p->ret == OK0) {
+		p->ret = ret;
+		for (i = 1; i < p->n; i++)
+			httpmt_cancel(&p->w[i].own);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * set up the ctx of a worker from the one of the caller
+ */
+static void
+http_par_ctx(http_ctx *w, http_ctx *ctx)
+{
+	memset(w, 0, sizeof(http_ctx));
+	w->malloc_fn = ctx->malloc_fn;
+	w->realloc_fn = ctx->realloc_fn;
+	w->free_fn = ctx->free_fn;
+	w->alloc_opaque = ctx->alloc_opaque;
+
+	w->port = ctx->port;
+	if (ctx->server)
+		w->server = http_strdup(w, ctx->server);
+	w->proxy_port = ctx->proxy_port;
+	if (ctx->proxy_server)
+		w->proxy_server = http_strdup(w, ctx->proxy_server);
+	/* from the base64 encoder */
+	if (ctx->b64_auth)
+		w->b64_auth = strdup(ctx->b64_auth);
+	w->timeouts = ctx->timeouts;
+	httpmt_set_keepalive(w, 1, ctx->pool_max_age);
+}
+
+/*
+ * write all of buffer at pos in fd
+ * returns 0 or -1 on error
+ */
+static int
+http_par_write(int fd, char *buffer, int n, off_t pos)
+{
+	ssize_t w;
+
+	while (n > 0) {
+		if ((w = pwrite(fd, buffer, n, pos)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buffer += w;
+		pos += w;
+		n -= w;
+	}
+	return 0;
+}
+
+/*
+ * read the whole body of an answer to the download target: from offset
+ * 0 of fd or in allocated memory, sized to its length if it is known or
+ * grown as it comes
+ * returns OK200 or a negative error code
+ */
+static http_retcode
+http_par_whole(http_ctx *ctx, http_conn *c, int fd, char **pdata,
+		off_t *plength)
+{
+	char *buffer, *p;
+	off_t pos = 0, size = PAR_BLOCK;
+	int n = 0, known;
+	http_retcode ret = OK200;
+
+	/* the server closes the connection at the end of data */
+	if (!c->chunked && c->left < 0)
+		c->keep = 0;
+	known = (fd < 0 && !c->chunked && c->left >= 0 &&
+		c->encoding == ENC_NONE);
+	if (known)
+		size = c->left > 0 ? (off_t) c->left : 1;
+	if (!(buffer = (char *) http_alloc(ctx, size)))
+		return ERRMEM;
+	while (1) {
+		if (fd < 0 && pos == size) {
+			if (known)
+				break;
+			if (!(p = (char *) http_realloc(ctx, buffer, size * 2))) {
+				ret = ERRMEM;
+				break;
+			}
+			buffer = p;
+			size *= 2;
+		}
+		if (fd >= 0)
+			n = http_read_body(c, buffer, PAR_BLOCK);
+		else
+			n = http_read_body(c, buffer + pos, size - pos > PAR_BLOCK ?
+				PAR_BLOCK : (int) (size - pos));
+		if (n <= 0)
+			break;
+		if (fd >= 0 && http_par_write(fd, buffer, n, pos) < 0) {
+			ret = ERRWRFD;
+			break;
+		}
+		pos += n;
+	}
+	if (n < 0 || (known && pos < size && c->left > 0))
+		ret = ERRRDDT;
+	if (ret < 0)
+		c->keep = 0;
+	if (ret == OK200 && fd < 0)
+		*pdata = buffer;
+	else
+		httpmt_free(ctx, buffer);
+	if (plength)
+		*plength = ret == OK200 || fd >= 0 ? pos : 0;
+	return ret;
+}
+
+/*
+ * validator of the last answer of ctx for If-Range: its ETag, unless
+ * weak, or its Last-Modified date, "" if none
+ *	char *validator	placeholder, PAR_VALIDATOR long
+ */
+static void
+http_range_validator(http_ctx *ctx, char *validator)
+{
+	char *v;
+
+	validator[0] = '\0';
+	v = httpmt_header_known(ctx, HTTP_H_ETAG);
+	if (v == NULL || !strncmp(v, "W/", 2))
+		v = httpmt_header_known(ctx, HTTP_H_LAST_MODIFIED);
+	if (v && strlen(v) < PAR_VALIDATOR)
+		strcpy(validator, v);
+}
+
+/*
+ * Get data from the server into a file, going on from where an earlier
+ * call stopped
+ *
+ * Like http_get_to_fd, but the data is written from offset 0 of fd with
+ * pwrite and the progress is saved in a checkpoint file every 4 MB and
+ * when the transfer fails. With a checkpoint, the rest is asked with
+ * Range, and If-Range with the ETag or Last-Modified date of the
+ * ressource: if it changed, or if the server ignores ranges, the whole
+ * of it comes again. The checkpoint is removed once all the data is
+ * written. fd must be the same file on each call.
+ * returns OK200 when all the data was written, a negative error code or
+ * a positive code from the server
+ *
+ *	char *filename	name of the ressource to read
+ *	int fd		file descriptor of a regular file to write to
+ *	char *checkpoint	path of the checkpoint file
+ *	off_t *plength	address of variable which will be set to the
+ *			length of the data in the file, may be NULL
+ *	char *typebuf	allocated buffer where the read data type is returned.
+ *			If NULL, the type is not returned
+ */
+extern http_retcode
+httpmt_get_resume(http_ctx *ctx, char *filename, int fd, char *checkpoint,
+		off_t *plength, char *typebuf)
+{
+	http_conn *c;
+	http_retcode ret;
+	char header[MAXBUF];
+	char validator[PAR_VALIDATOR];
+	char *buffer, *v;
+	long long first, last, total;
+	off_t done, size, saved;
+	int n, tries, compression;
+
+	if (ctx == NULL || filename == NULL || fd < 0 || checkpoint == NULL)
+		return ERRNULL;
+
+	if (plength) *plength = 0;
+	if (typebuf) *typebuf = '\0';
+
+	if (http_ckpt_load(checkpoint, "GET", &done, &size, validator) < 0 ||
+			(size >= 0 && done >= size))
+		done = 0;
+	if (!(buffer = (char *) http_alloc(ctx, PAR_BLOCK)))
+		return ERRMEM;
+
+	/* ranges are of the data as sent, it must not be encoded */
+	compression = ctx->compression;
+	ctx->compression = 0;
+
+	for (tries = 0; ; tries++) {
+		header[0] = '\0';
+		if (done > 0)
+			snprintf(header, sizeof(header),
+				"Range: bytes=%lld-\015\012%s%s%s",
+				(long long) done,
+				validator[0] ? "If-Range: " : "", validator,
+				validator[0] ? "\015\012" : "");
+		ret = http_query(ctx, "GET", filename, header, KEEP_OPEN, NULL,
+			&c);
+		if (ret != OK200 && ret != OK206) {
+			if (ret >= OK0) {
+				http_skip_answer(c);
+				http_release(ctx, c);
+			}
+			break;
+		}
+		if (http_read_header(c, NULL, typebuf) < 0) {
+			c->keep = 0;
+			http_release(ctx, c);
+			ret = ERRRDHD;
+			break;
+		}
+
+		if (ret == OK206) {
+			/* the rest of the same ressource, else start over */
+			v = httpmt_header_known(ctx, HTTP_H_CONTENT_RANGE);
+			if (v == NULL || sscanf(v, "bytes %lld-%lld/%lld", &first,
+					&last, &total) != 3 ||
+					first != (long long) done ||
+					(size >= 0 && total != (long long) size)) {
+				c->keep = 0;
+				http_release(ctx, c);
+				ret = ERRPAHD;
+				if (tries > 0)
+					break;
+				done = 0;
+				continue;
+			}
+			size = (off_t) total;
+		} else {
+			/* the server closes the connection at the end of data */
+			if (!c->chunked && c->left < 0)
+				c->keep = 0;
+			done = 0;
+			size = c->chunked ? -1 : c->left;
+			http_range_validator(ctx, validator);
+			if (ftruncate(fd, 0) < 0) {
+				c->keep = 0;
+				http_release(ctx, c);
+				ret = ERRWRFD;
+				break;
+			}
+		}
+
+		saved = done;
+		if (http_ckpt_save(checkpoint, "GET", done, size, validator) < 0)
+			ret = ERRWRFD;
+		while (ret >= OK0 && (n = http_read_body(c, buffer, PAR_BLOCK)) != 0) {
+			if (n < 0) {
+				ret = ERRRDDT;
+				break;
+			}
+			if (http_par_write(fd, buffer, n, done) < 0) {
+				ret = ERRWRFD;
+				break;
+			}
+			done += n;
+			/* the data first, then what says it is there */
+			if (done - saved >= RESUME_STEP) {
+				saved = done;
+				if (fdatasync(fd) < 0 || http_ckpt_save(checkpoint,
+						"GET", done, size, validator) < 0)
+					ret = ERRWRFD;
+			}
+		}
+		if (ret < 0) {
+			c->keep = 0;
+			if (fdatasync(fd) == 0)
+				http_ckpt_save(checkpoint, "GET", done, size,
+					validator);
+		} else {
+			ret = OK200;
+			unlink(checkpoint);
+		}
+		http_release(ctx, c);
+		break;
+	}
+
+	ctx->compression = compression;
+	httpmt_free(ctx, buffer);
+	if (plength)
+		*plength = done;
+	return http_expired(ctx, ret);
+}
+
+/*
+ * Put data read from a file on the server, going on from where an
+ * earlier call stopped
+ *
+ * Like http_put_fd, but the data is sent in pieces of 16 MB, each with
+ * a Content-Range, and the bytes the server took are saved in a
+ * checkpoint file after each piece. With a checkpoint, the pieces go on
+ * from there, if the length of the data is the same. The checkpoint is
+ * removed once all the data is sent. The server must accept partial PUT
+ * (an answer 2xx, or 308 to a piece before the last one).
+ * returns a negative error code or the code of the server to the last
+ * piece, the checkpoint is kept unless it is 2xx
+ *
+ *	char *filename	name of the ressource to create
+ *	int fd		file descriptor of a regular file to read the data
+ *			from, at its current offset, the same on each call
+ *	off_t length	length of the data to send, -1 for the rest of
+ *			the file
+ *	int overwrite	flag to request to overwrite the ressource if it
+ *			 was already existing
+ *	char *type	type of the data, if NULL default type is used
+ *	char *checkpoint	path of the checkpoint file
+ */
+extern http_retcode
+httpmt_put_resume(http_ctx *ctx, char *filename, int fd, off_t length,
+		int overwrite, char *type, char *checkpoint)
+{
+	http_source src;
+	http_retcode ret;
+	char header[MAXBUF];
+	struct stat st;
+	off_t base, done, total, piece;
+	int n;
+
+	if (ctx == NULL || filename == NULL || fd < 0 || checkpoint == NULL)
+		return ERRNULL;
+
+	if ((base = lseek(fd, 0, SEEK_CUR)) < 0 || fstat(fd, &st) < 0)
+		return ERRRDFD;
+	if (length < 0)
+		length = st.st_size > base ? st.st_size - base : 0;
+
+	if (http_ckpt_load(checkpoint, "PUT", &done, &total, NULL) < 0 ||
+			total != length || done >= length)
+		done = 0;
+
+	memset(&src, 0, sizeof(src));
+	src.fd = fd;
+	do {
+		piece = length - done > RESUME_PIECE ? RESUME_PIECE :
+			length - done;
+		n = 0;
+		if (length > 0)
+			n = sprintf(header, "Content-Range: bytes %lld-%lld/%lld\015\012",
+				(long long) done, (long long) (done + piece - 1),
+				(long long) length);
+		http_data_header(header + n, piece, type, overwrite);
+
+		if (lseek(fd, base + done, SEEK_SET) < 0)
+			return ERRRDFD;
+		src.fd_length = piece;
+		ret = http_query(ctx, "PUT", filename, header, CLOSE, &src, NULL);
+		/* 308 to the last piece: the server still misses some */
+		if (ret < 200 || (ret >= 300 && ret != 308) ||
+				(ret == 308 && done + piece == length))
+			break;
+
+		done += piece;
+		if (done < length && http_ckpt_save(checkpoint, "PUT", done,
+				length, NULL) < 0)
+			return ERRWRFD;
+	} while (done < length);
+
+	if (done == length)
+		unlink(checkpoint);
+	return ret;
+}
+
+/*
+ * read a checkpoint: "http-tiny <kind> <done> <total> <validator>"
+ * returns 0 or -1 if there is none or it is of another kind
+ *	char *validator	placeholder, PAR_VALIDATOR long, may be NULL
+ */
+static int
+http_ckpt_load(char *path, const char *kind, off_t *pdone, off_t *ptotal,
+		char *validator)
+{
+	char line[PAR_VALIDATOR + 128];
+	char what[8];
+	long long done, total;
+	FILE *f;
+	int n = 0, ok;
+
+	if (validator)
+		validator[0] = '\0';
+	if (!(f = fopen(path, "r")))
+		return -1;
+	ok = (fgets(line, sizeof(line), f) != NULL &&
+		sscanf(line, "http-tiny %7s %lld %lld %n", what, &done, &total,
+			&n) == 3 && n > 0 && !strcmp(what, kind) && done >= 0);
+	fclose(f);
+	if (!ok)
+		return -1;
+
+	line[strcspn(line, "\n")] = '\0';
+	if (validator && strlen(line + n) < PAR_VALIDATOR)
+		strcpy(validator, line + n);
+	*pdone = (off_t) done;
+	*ptotal = (off_t) total;
+	return 0;
+}
+
+/*
+ * replace a checkpoint, written next to it then renamed
+ * returns 0 or -1 on error
+ */
+static int
+http_ckpt_save(char *path, const char *kind, off_t done, off_t total,
+		char *validator)
+{
+	char tmp[MAXBUF];
+	char line[PAR_VALIDATOR + 128];
+	int fd, n, r;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp))
+		return -1;
+	n = snprintf(line, sizeof(line), "http-tiny %s %lld %lld %s\n", kind,
+		(long long) done, (long long) total, validator ? validator : "");
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		return -1;
+	r = (write(fd, line, n) == n && fdatasync(fd) == 0) ? 0 : -1;
+	close(fd);
+	if (r == 0 && rename(tmp, path) < 0)
+		r = -1;
+	if (r < 0)
+		unlink(tmp);
+	return r;
+}
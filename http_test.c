@@ -0,0 +1,1384 @@
+/*
+ *  Http mini lib tests, against an in process loopback server
+ *  see LICENSE for terms, conditions and DISCLAIMER OF ALL WARRANTIES
+ *
+ *  Each test asks the server for answers written in pieces, with pauses
+ *  between them, and checks what the library makes of them: chunked
+ *  bodies cut at each byte, gzip and deflate bodies, ranges and
+ *  If-Range, through http_get, http_get_stream and the multi handles.
+ *  One line per test on stdout, the exit code is the number of failed
+ *  tests.
+ *
+ *  usage: http_test [name]
+ *	name	only run the tests whose name starts with it
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "http_lib.h"
+
+/* loopback server buffers */
+#define SRVBUF 65536
+/* pieces of an answer */
+#define MAXPIECES 256
+/* answers cut in pieces, see srv_answers */
+#define MAXANSWERS 8
+/* ressource of the range tests, more than a first range of
+ * httpmt_get_parallel */
+#define RES_SIZE ((3 << 20) + 12345)
+
+/* an answer, sent piece by piece */
+typedef struct {
+	const char *data[MAXPIECES];	/* NUL terminated, or binary: */
+	int length[MAXPIECES];		/* its length if not 0 */
+	int pause[MAXPIECES];		/* milliseconds, before the piece */
+	int n;
+	char head[1024];		/* header made by a route */
+} srv_answer;
+
+/* answers of the server by path prefix */
+typedef void (*srv_route)(const char *path, const char *request,
+			srv_answer *a);
+
+typedef struct {
+	const char *path;
+	srv_route route;
+} srv_path;
+
+/* whole answer of /a/<name>/<cut>, and the data it carries */
+typedef struct {
+	const char *name;
+	char *answer;
+	int length;
+	const char *data;
+	int dlength;
+} srv_canned;
+
+static int port;
+static int accepted;		/* connections */
+static srv_canned canned[MAXANSWERS];
+static int ncanned;
+static char *res;		/* data of the range tests */
+
+static void
+piece(srv_answer *a, int pause, const char *data, int length)
+{
+	if (a->n == MAXPIECES)
+		return;
+	a->pause[a->n] = pause;
+	a->data[a->n] = data;
+	a->length[a->n] = length;
+	a->n++;
+}
+
+/* value of a header field of a request, or NULL */
+static char *
+req_field(const char *request, const char *name, char *value, int max)
+{
+	const char *p = request;
+	int n = strlen(name);
+
+	while ((p = strchr(p, '\n')) != NULL) {
+		p++;
+		if (!strncasecmp(p, name, n) && p[n] == ':') {
+			p += n + 1;
+			while (*p == ' ')
+				p++;
+			for (n = 0; n < max - 1 && p[n] && p[n] != '\r' &&
+					p[n] != '\n'; n++)
+				value[n] = p[n];
+			value[n] = '\0';
+			return value;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Routes
+ */
+
+/* chunked body, the first chunk size line ends a read, then a pause */
+static void
+route_stall(const char *path, const char *request, srv_answer *a)
+{
+	piece(a, 0, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+		"5\r\n", 0);
+	piece(a, 1000, "hello\r\n0\r\n\r\n", 0);
+}
+
+static void
+route_quick(const char *path, const char *request, srv_answer *a)
+{
+	piece(a, 200, "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nquick", 0);
+}
+
+/*
+ * /a/<name>/<cut>: a canned answer, in two pieces cut at byte cut, one
+ * piece if 0, or a piece per byte if -1
+ */
+static void
+route_canned(const char *path, const char *request, srv_answer *a)
+{
+	char name[32];
+	srv_canned *k = NULL;
+	int i, cut;
+
+	if (sscanf(path, "/a/%31[^/]/%d", name, &cut) != 2)
+		return;
+	for (i = 0; i < ncanned; i++)
+		if (!strcmp(canned[i].name, name))
+			k = &canned[i];
+	if (k == NULL)
+		return;
+
+	if (cut < 0) {
+		for (i = 0; i < k->length; i++)
+			piece(a, i ? 1 : 0, k->answer + i, 1);
+	} else if (cut > 0 && cut < k->length) {
+		piece(a, 0, k->answer, cut);
+		piece(a, 2, k->answer + cut, k->length - cut);
+	} else {
+		piece(a, 0, k->answer, k->length);
+	}
+}
+
+/*
+ * /range: RES_SIZE bytes with ETag "v1", Range honored. /range/changed:
+ * a request with If-Range gets all of it again with ETag "v2", as if it
+ * changed, and the second half a second later. /range/none: Range is
+ * ignored.
+ */
+static void
+route_range(const char *path, const char *request, srv_answer *a)
+{
+	char range[64], cond[64];
+	long first = 0, last = RES_SIZE - 1;
+	int ranged, changed, n;
+
+	changed = strstr(path, "changed") &&
+		req_field(request, "If-Range", cond, sizeof(cond));
+	ranged = !changed && !strstr(path, "none") &&
+		req_field(request, "Range", range, sizeof(range)) &&
+		sscanf(range, "bytes=%ld-%ld", &first, &last) >= 1;
+	if (!ranged) {
+		first = 0;
+		last = RES_SIZE - 1;
+	}
+	if (last >= RES_SIZE)
+		last = RES_SIZE - 1;
+
+	if (ranged)
+		n = snprintf(a->head, sizeof(a->head), "HTTP/1.1 206 Partial "
+			"Content\r\nContent-Length: %ld\r\n"
+			"Content-Range: bytes %ld-%ld/%d\r\nETag: \"v1\"\r\n\r\n",
+			last - first + 1, first, last, RES_SIZE);
+	else
+		n = snprintf(a->head, sizeof(a->head), "HTTP/1.1 200 OK\r\n"
+			"Content-Length: %d\r\nETag: \"%s\"\r\n\r\n", RES_SIZE,
+			changed ? "v2" : "v1");
+	piece(a, 0, a->head, n);
+	if (changed) {
+		piece(a, 0, res, RES_SIZE / 2);
+		piece(a, 1000, res + RES_SIZE / 2, RES_SIZE - RES_SIZE / 2);
+	} else {
+		piece(a, 0, res + first, last - first + 1);
+	}
+}
+
+/*
+ * /resume: like /range, but an answer without Range stops in the middle
+ * of the data and the connection is closed
+ */
+static void
+route_resume(const char *path, const char *request, srv_answer *a)
+{
+	char range[64];
+
+	route_range(path, request, a);
+	if (!req_field(request, "Range", range, sizeof(range))) {
+		a->length[1] = RES_SIZE / 2;
+		piece(a, 0, NULL, 0);
+	}
+}
+
+/* a partial PUT always missing some of the data */
+static void
+route_missing(const char *path, const char *request, srv_answer *a)
+{
+	piece(a, 0, "HTTP/1.1 308 Resume Incomplete\r\nRange: bytes=0-0\r\n"
+		"Content-Length: 0\r\n\r\n", 0);
+}
+
+/* /cc/<value>: an answer with that Cache-Control */
+static void
+route_cc(const char *path, const char *request, srv_answer *a)
+{
+	int n;
+
+	n = snprintf(a->head, sizeof(a->head), "HTTP/1.1 200 OK\r\n"
+		"Cache-Control: %s\r\nContent-Length: 4\r\n\r\ndata",
+		path + 4);
+	piece(a, 0, a->head, n);
+}
+
+/*
+ * /long: an answer to revalidate, with an ETag and a Last-Modified date
+ * of the longest length the caches keep, 304 to its ETag
+ */
+static void
+route_long(const char *path, const char *request, srv_answer *a)
+{
+	char etag[256], modified[256], cond[512];
+	int n;
+
+	memset(etag, 'e', 255);
+	etag[0] = etag[254] = '"';
+	etag[255] = '\0';
+	memset(modified, 'm', 255);
+	modified[255] = '\0';
+	if (req_field(request, "If-None-Match", cond, sizeof(cond)) &&
+			!strcmp(cond, etag))
+		n = snprintf(a->head, sizeof(a->head), "HTTP/1.1 304 Not "
+			"Modified\r\nETag: %s\r\n\r\n", etag);
+	else
+		n = snprintf(a->head, sizeof(a->head), "HTTP/1.1 200 OK\r\n"
+			"Cache-Control: no-cache\r\nETag: %s\r\n"
+			"Last-Modified: %s\r\nContent-Length: 4\r\n\r\ndata",
+			etag, modified);
+	piece(a, 0, a->head, n);
+}
+
+/* /tab: a fresh answer with a tab in its ETag */
+static void
+route_tab(const char *path, const char *request, srv_answer *a)
+{
+	piece(a, 0, "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\n"
+		"ETag: \"a\tb\"\r\nLast-Modified: date\r\n"
+		"Content-Length: 4\r\n\r\ndata", 0);
+}
+
+static srv_path routes[] = {
+	{ "/stall", route_stall },
+	{ "/quick", route_quick },
+	{ "/a/", route_canned },
+	{ "/range", route_range },
+	{ "/resume", route_resume },
+	{ "/missing", route_missing },
+	{ "/cc/", route_cc },
+	{ "/long", route_long },
+	{ "/tab", route_tab },
+};
+#define NROUTES (int) (sizeof(routes) / sizeof(routes[0]))
+
+/*
+ * Loopback server
+ * the request body is dropped, the answer comes from the route of the
+ * path, 404 if none.
+ */
+
+static int
+srv_send(int fd, const char *p, long n)
+{
+	long r;
+
+	while (n > 0) {
+		if ((r = send(fd, p, n, MSG_NOSIGNAL)) <= 0)
+			return -1;
+		p += r;
+		n -= r;
+	}
+	return 0;
+}
+
+static void *
+srv_conn(void *arg)
+{
+	int fd = (int) (long) arg;
+	char *buf, *end, *p, path[256];
+	long have = 0, n, skip;
+	int i, r, one = 1;
+	srv_answer *a;
+
+	/* each piece is a segment of its own */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	buf = (char *) malloc(SRVBUF + 1);
+	a = (srv_answer *) malloc(sizeof(srv_answer));
+	while (buf && a) {
+		/* header */
+		buf[have] = '\0';
+		while ((end = strstr(buf, "\r\n\r\n")) == NULL) {
+			if (have == SRVBUF ||
+			    (r = recv(fd, buf + have, SRVBUF - have, 0)) <= 0)
+				goto out;
+			have += r;
+			buf[have] = '\0';
+		}
+		end += 4;
+		if (sscanf(buf, "%*s %255s", path) != 1)
+			goto out;
+		skip = 0;
+		if ((p = strcasestr(buf, "\ncontent-length:")) && p < end)
+			skip = atol(p + 16);
+
+		memset(a, 0, sizeof(srv_answer));
+		end[-1] = '\0';
+		for (i = 0; i < NROUTES; i++) {
+			if (!strncmp(path, routes[i].path,
+					strlen(routes[i].path))) {
+				(*routes[i].route)(path, buf, a);
+				break;
+			}
+		}
+		end[-1] = '\n';
+		if (a->n == 0)
+			piece(a, 0, "HTTP/1.1 404 Not Found\r\n"
+				"Content-Length: 0\r\n\r\n", 0);
+
+		/* drop the request body */
+		n = have - (end - buf);
+		if (n >= skip) {
+			memmove(buf, end + skip, n - skip);
+			have = n - skip;
+		} else {
+			for (skip -= n, have = 0; skip > 0; skip -= r)
+				if ((r = recv(fd, buf, skip > SRVBUF ?
+						SRVBUF : skip, 0)) <= 0)
+					goto out;
+		}
+
+		/* answer, a piece without data closes the connection */
+		for (i = 0; i < a->n; i++) {
+			if (a->pause[i])
+				usleep(a->pause[i] * 1000);
+			if (a->data[i] == NULL)
+				goto out;
+			if (srv_send(fd, a->data[i], a->length[i] ?
+					a->length[i] : strlen(a->data[i])) < 0)
+				goto out;
+		}
+	}
+ out:
+	free(a);
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+static void *
+srv_accept(void *arg)
+{
+	int lfd = (int) (long) arg, fd;
+	pthread_t tid;
+
+	while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+		__atomic_add_fetch(&accepted, 1, __ATOMIC_SEQ_CST);
+		if (pthread_create(&tid, NULL, srv_conn, (void *) (long) fd))
+			close(fd);
+		else
+			pthread_detach(tid);
+	}
+	return NULL;
+}
+
+/* starts the server on 127.0.0.1, returns its port or -1 */
+static int
+srv_start(void)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	pthread_t tid;
+	int lfd, one = 1;
+
+	if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(lfd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+	    listen(lfd, 64) < 0 ||
+	    getsockname(lfd, (struct sockaddr *) &sin, &len) < 0 ||
+	    pthread_create(&tid, NULL, srv_accept, (void *) (long) lfd)) {
+		close(lfd);
+		return -1;
+	}
+	pthread_detach(tid);
+	return ntohs(sin.sin_port);
+}
+
+/* adds a canned answer: header, then body, chunked in pieces of chunk
+ * bytes if chunk > 0 */
+static void
+srv_can(const char *name, const char *header, const char *body, int blen,
+	int chunk, const char *data, int dlength)
+{
+	srv_canned *k = &canned[ncanned++];
+	char *p;
+	int i, n;
+
+	k->name = name;
+	k->data = data;
+	k->dlength = dlength;
+	k->answer = p = (char *) malloc(strlen(header) + 64 + blen +
+		(chunk > 0 ? (blen / chunk + 1) * 16 : 0));
+	if (chunk <= 0) {
+		p += sprintf(p, "%sContent-Length: %d\r\n\r\n", header, blen);
+		memcpy(p, body, blen);
+		p += blen;
+	} else {
+		p += sprintf(p, "%sTransfer-Encoding: chunked\r\n\r\n",
+			header);
+		for (i = 0; i < blen; i += n) {
+			n = blen - i < chunk ? blen - i : chunk;
+			p += sprintf(p, "%x\r\n", n);
+			memcpy(p, body + i, n);
+			p += n;
+			p += sprintf(p, "\r\n");
+		}
+		p += sprintf(p, "0\r\nTrailer: x\r\n\r\n");
+	}
+	k->length = p - k->answer;
+}
+
+#ifdef HAVE_ZLIB
+/* compresses data, windowbits as for deflateInit2: 31 gzip, 15 zlib, -15
+ * raw deflate. returns its length */
+static int
+srv_deflate(const char *data, int length, int windowbits, char *out, int max)
+{
+	z_stream zs;
+	int n;
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, 6, Z_DEFLATED, windowbits, 8,
+			Z_DEFAULT_STRATEGY) != Z_OK)
+		return -1;
+	zs.next_in = (Bytef *) data;
+	zs.avail_in = length;
+	zs.next_out = (Bytef *) out;
+	zs.avail_out = max;
+	n = deflate(&zs, Z_FINISH) == Z_STREAM_END ? max - zs.avail_out : -1;
+	deflateEnd(&zs);
+	return n;
+}
+#endif
+
+/* sets up the canned answers and the ressource of the range tests */
+static int
+srv_answers(void)
+{
+	static const char chunked[] = "4\r\nWiki\r\n5;ext=1\r\npedia\r\n"
+		"E\r\n in\r\n\r\nchunks.\r\n0\r\nTrailer: x\r\n\r\n";
+	static char text[8192];
+	int i, n;
+
+	if (!(res = (char *) malloc(RES_SIZE)))
+		return -1;
+	for (i = 0; i < RES_SIZE; i++)
+		res[i] = (char) (i * 7 + i / 65536);
+
+	/* one built by hand, with an extension and a trailer */
+	canned[ncanned].name = "chunked";
+	canned[ncanned].answer = (char *) malloc(256);
+	canned[ncanned].length = sprintf(canned[ncanned].answer,
+		"HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+		"Transfer-Encoding: chunked\r\n\r\n%s", chunked);
+	canned[ncanned].data = "Wikipedia in\r\n\r\nchunks.";
+	canned[ncanned].dlength = 23;
+	ncanned++;
+
+	for (i = n = 0; n < (int) sizeof(text) - 64; i++)
+		n += sprintf(text + n, "line %d of the text, %d\n", i, i * i % 97);
+
+#ifdef HAVE_ZLIB
+	{
+		static char gz[sizeof(text)], zl[sizeof(text)], raw[sizeof(text)];
+		int lgz, lzl, lraw;
+
+		lgz = srv_deflate(text, n, 31, gz, sizeof(gz));
+		lzl = srv_deflate(text, n, 15, zl, sizeof(zl));
+		lraw = srv_deflate(text, n, -15, raw, sizeof(raw));
+		if (lgz < 0 || lzl < 0 || lraw < 0)
+			return -1;
+		srv_can("gzip", "HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\n",
+			gz, lgz, 0, text, n);
+		srv_can("gzipchunked", "HTTP/1.1 200 OK\r\n"
+			"Content-Encoding: gzip\r\n", gz, lgz, 100, text, n);
+		srv_can("deflate", "HTTP/1.1 200 OK\r\n"
+			"Content-Encoding: deflate\r\n", zl, lzl, 0, text, n);
+		srv_can("rawdeflate", "HTTP/1.1 200 OK\r\n"
+			"Content-Encoding: deflate\r\n", raw, lraw, 37, text, n);
+	}
+#endif
+	return 0;
+}
+
+/*
+ * Tests
+ */
+
+static char msg[256];		/* what failed */
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* sets up a ctx for the server, with keep-alive */
+static void
+ctx_init(http_ctx *ctx, char **pfilename)
+{
+	char url[64];
+
+	memset(ctx, 0, sizeof(*ctx));
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/", port);
+	httpmt_parse_url(ctx, url, pfilename);
+	httpmt_set_keepalive(ctx, 4, 30);
+}
+
+static void
+ctx_free(http_ctx *ctx, char *filename)
+{
+	httpmt_free(ctx, filename);
+	httpmt_cleanup(ctx);
+}
+
+/* a request of a multi handle */
+typedef struct {
+	http_retcode ret;
+	char *data;
+	int length;
+	double end;		/* when it was over, ms */
+} multi_result;
+
+static void
+multi_done(void *arg, http_retcode ret, char *data, int length, char *type)
+{
+	multi_result *r = (multi_result *) arg;
+
+	r->ret = ret;
+	r->length = length;
+	if (data && (r->data = (char *) malloc(length + 1)) != NULL)
+		memcpy(r->data, data, length);
+	r->end = now_ms();
+}
+
+/* ways of getting an answer */
+enum { GET, STREAM, EPOLL, URING };
+static const char *ways[] = { "get", "stream", "epoll", "uring" };
+
+/* http_get_stream callback, appends to a multi_result */
+static int
+stream_piece(const char *data, int length, void *arg)
+{
+	multi_result *r = (multi_result *) arg;
+	char *p;
+
+	if (!(p = (char *) realloc(r->data, r->length + length + 1)))
+		return 1;
+	memcpy(p + r->length, data, length);
+	r->data = p;
+	r->length += length;
+	return 0;
+}
+
+/* gets a ressource one way, into r (r->data to free) */
+static void
+fetch(http_ctx *ctx, int way, const char *filename, multi_result *r)
+{
+	httpmt_multi *m;
+	char buffer[3];
+	off_t length;
+	int n;
+
+	memset(r, 0, sizeof(*r));
+	switch (way) {
+	case GET:
+		r->ret = httpmt_get(ctx, (char *) filename, &r->data, &n, NULL);
+		r->length = n;
+		break;
+	case STREAM:
+		/* a few bytes at a time */
+		r->ret = httpmt_get_stream(ctx, (char *) filename, stream_piece,
+			r, buffer, sizeof(buffer), &length, NULL);
+		if (r->ret == 200 && length != r->length)
+			r->ret = ERRNOLG;
+		break;
+	default:
+		httpmt_set_io_uring(ctx, way == URING ? 64 : 0);
+		if ((m = httpmt_multi_init(ctx)) == NULL) {
+			r->ret = ERRMEM;
+			break;
+		}
+		httpmt_multi_add(m, (char *) "GET", (char *) filename, NULL, 0,
+			NULL, multi_done, r);
+		while (httpmt_multi_perform(m, 2000) > 0)
+			;
+		httpmt_multi_cleanup(m);
+		break;
+	}
+}
+
+/* release the data of a GET, from the allocator of ctx or malloc */
+static void
+fetch_free(http_ctx *ctx, int way, multi_result *r)
+{
+	if (way == GET)
+		httpmt_free(ctx, r->data);
+	else
+		free(r->data);
+	r->data = NULL;
+}
+
+/*
+ * a canned answer cut at each byte, or in bytes (cut -1), must give its
+ * data, and the connection must be usable for the next one
+ */
+static const char *
+test_canned(int way, const char *name, int step, int compression)
+{
+	http_ctx ctx;
+	multi_result r;
+	srv_canned *k = NULL;
+	char *filename = NULL, path[64];
+	const char *err = NULL;
+	int i, cut;
+
+	for (i = 0; i < ncanned; i++)
+		if (!strcmp(canned[i].name, name))
+			k = &canned[i];
+	if (k == NULL)
+		return NULL;	/* without zlib */
+
+	ctx_init(&ctx, &filename);
+	httpmt_set_compression(&ctx, compression);
+	for (cut = step > 1 ? 0 : -1; cut < k->length && !err; cut += step) {
+		snprintf(path, sizeof(path), "a/%s/%d", name, cut);
+		fetch(&ctx, way, path, &r);
+		if (r.ret != 200 || r.length != k->dlength ||
+				memcmp(r.data, k->data, k->dlength)) {
+			snprintf(msg, sizeof(msg), "%s cut at %d: %d, %d bytes",
+				ways[way], cut, r.ret, r.length);
+			err = msg;
+		}
+		fetch_free(&ctx, way, &r);
+		if (step <= 1 && cut < 0)
+			cut = 0;
+	}
+	ctx_free(&ctx, filename);
+	return err;
+}
+
+static const char *
+test_chunked(void)
+{
+	const char *err = NULL;
+	int way;
+
+	for (way = GET; way <= URING && !err; way++)
+		err = test_canned(way, "chunked", 1, 0);
+	return err;
+}
+
+static const char *
+test_gzip(void)
+{
+	static const char *names[] = { "gzip", "gzipchunked", "deflate",
+		"rawdeflate" };
+	const char *err = NULL;
+	unsigned i;
+	int way;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]) && !err; i++)
+		for (way = GET; way <= URING && !err; way++)
+			err = test_canned(way, names[i], 13, 1);
+	return err;
+}
+
+/*
+ * a multi handle waiting for the rest of a chunk must not stop the
+ * other requests
+ */
+static const char *
+test_multi_stall(int uring)
+{
+	http_ctx ctx;
+	httpmt_multi *m;
+	multi_result stall, quick;
+	char *filename = NULL;
+	const char *err = NULL;
+	double start;
+
+	ctx_init(&ctx, &filename);
+	if (uring)
+		httpmt_set_io_uring(&ctx, 64);
+	memset(&stall, 0, sizeof(stall));
+	memset(&quick, 0, sizeof(quick));
+	m = httpmt_multi_init(&ctx);
+	httpmt_multi_add(m, (char *) "GET", (char *) "stall", NULL, 0, NULL,
+		multi_done, &stall);
+	httpmt_multi_add(m, (char *) "GET", (char *) "quick", NULL, 0, NULL,
+		multi_done, &quick);
+	start = now_ms();
+	while (httpmt_multi_perform(m, 2000) > 0)
+		;
+	httpmt_multi_cleanup(m);
+	ctx_free(&ctx, filename);
+
+	if (stall.ret != 200 || stall.length != 5 ||
+			memcmp(stall.data, "hello", 5))
+		err = "chunked answer wrong";
+	else if (quick.ret != 200 || quick.length != 5 ||
+			memcmp(quick.data, "quick", 5))
+		err = "other answer wrong";
+	else if (quick.end - start > 700)
+		err = "other answer waited for the chunk";
+	free(stall.data);
+	free(quick.data);
+	return err;
+}
+
+static const char *
+test_multi_stall_epoll(void)
+{
+	return test_multi_stall(0);
+}
+
+static const char *
+test_multi_stall_uring(void)
+{
+	return test_multi_stall(1);
+}
+
+/*
+ * once a request which ran out of time is reported, the connections of
+ * the next ones on the ctx go back to the pool
+ */
+static const char *
+test_expired_pool(void)
+{
+	http_ctx ctx;
+	http_timeouts t;
+	multi_result r;
+	char *filename = NULL;
+	const char *err = NULL;
+	int n;
+
+	ctx_init(&ctx, &filename);
+	memset(&t, 0, sizeof(t));
+	t.first_byte = 50;
+	httpmt_set_next_timeouts(&ctx, &t);
+	fetch(&ctx, GET, "quick", &r);
+	fetch_free(&ctx, GET, &r);
+	if (r.ret != ERRRDTO) {
+		snprintf(msg, sizeof(msg), "timeout: %d", r.ret);
+		err = msg;
+	}
+
+	n = __atomic_load_n(&accepted, __ATOMIC_SEQ_CST);
+	fetch(&ctx, EPOLL, "quick", &r);
+	fetch_free(&ctx, EPOLL, &r);
+	fetch(&ctx, EPOLL, "quick", &r);
+	fetch_free(&ctx, EPOLL, &r);
+	n = __atomic_load_n(&accepted, __ATOMIC_SEQ_CST) - n;
+	if (!err && (r.ret != 200 || n != 1)) {
+		snprintf(msg, sizeof(msg), "%d, %d connections", r.ret, n);
+		err = msg;
+	}
+	ctx_free(&ctx, filename);
+	return err;
+}
+
+/* a temporary file, removed once opened */
+static int
+tmp_file(void)
+{
+	char path[] = "/tmp/http_test.XXXXXX";
+	int fd;
+
+	if ((fd = mkstemp(path)) >= 0)
+		unlink(path);
+	return fd;
+}
+
+/* tells if the file fd holds the ressource of the range tests */
+static int
+file_is_res(int fd)
+{
+	char *buffer;
+	off_t n;
+	int ok;
+
+	if (lseek(fd, 0, SEEK_END) != RES_SIZE ||
+			!(buffer = (char *) malloc(RES_SIZE)))
+		return 0;
+	n = pread(fd, buffer, RES_SIZE, 0);
+	ok = (n == RES_SIZE && !memcmp(buffer, res, RES_SIZE));
+	free(buffer);
+	return ok;
+}
+
+/* ranges over several connections, or the whole ressource over one,
+ * in memory and in a file */
+static const char *
+test_range(const char *name)
+{
+	http_ctx ctx;
+	char *filename = NULL, *data;
+	const char *err = NULL;
+	off_t length;
+	http_retcode ret;
+	int fd;
+
+	ctx_init(&ctx, &filename);
+	ret = httpmt_get_parallel(&ctx, (char *) name, 4, -1, &data,
+		&length, NULL);
+	if (ret != 200 || length != RES_SIZE || memcmp(data, res, RES_SIZE))
+		err = "in memory";
+	if (ret == 200)
+		httpmt_free(&ctx, data);
+
+	fd = tmp_file();
+	ret = httpmt_get_parallel(&ctx, (char *) name, 4, fd, NULL,
+		&length, NULL);
+	if (!err && (ret != 200 || length != RES_SIZE || !file_is_res(fd)))
+		err = "in a file";
+	close(fd);
+	ctx_free(&ctx, filename);
+	return err;
+}
+
+static const char *
+test_range_parallel(void)
+{
+	return test_range("range");
+}
+
+static const char *
+test_range_none(void)
+{
+	return test_range("range/none");
+}
+
+/*
+ * If-Range: later ranges of a ressource which changed fail the download,
+ * without waiting for the rest of it
+ */
+static const char *
+test_range_changed(void)
+{
+	http_ctx ctx;
+	char *filename = NULL, *data = NULL;
+	off_t length;
+	http_retcode ret;
+	double start;
+
+	ctx_init(&ctx, &filename);
+	start = now_ms();
+	ret = httpmt_get_parallel(&ctx, (char *) "range/changed", 4, -1,
+		&data, &length, NULL);
+	if (ret == 200)
+		httpmt_free(&ctx, data);
+	ctx_free(&ctx, filename);
+
+	if (ret >= 0) {
+		snprintf(msg, sizeof(msg), "got %d", ret);
+		return msg;
+	}
+	if (now_ms() - start > 700)
+		return "read the changed ressource";
+	return NULL;
+}
+
+/*
+ * a download cut in the middle goes on from the checkpoint with Range,
+ * or from the start if the ressource changed
+ */
+static const char *
+test_resume(const char *name)
+{
+	http_ctx ctx;
+	char *filename = NULL, ckpt[64];
+	const char *err = NULL;
+	off_t length;
+	http_retcode ret;
+	int fd;
+
+	snprintf(ckpt, sizeof(ckpt), "/tmp/http_test.%d.ckpt", (int) getpid());
+	unlink(ckpt);
+	fd = tmp_file();
+	ctx_init(&ctx, &filename);
+
+	ret = httpmt_get_resume(&ctx, (char *) name, fd, ckpt, &length, NULL);
+	if (ret >= 0 || access(ckpt, F_OK) < 0)
+		err = "first part";
+	ret = httpmt_get_resume(&ctx, (char *) name, fd, ckpt, &length, NULL);
+	if (!err && (ret != 200 || length != RES_SIZE || !file_is_res(fd) ||
+			access(ckpt, F_OK) == 0)) {
+		snprintf(msg, sizeof(msg), "rest: %d, %lld bytes", ret,
+			(long long) length);
+		err = msg;
+	}
+
+	ctx_free(&ctx, filename);
+	close(fd);
+	unlink(ckpt);
+	return err;
+}
+
+static const char *
+test_resume_range(void)
+{
+	return test_resume("resume");
+}
+
+static const char *
+test_resume_changed(void)
+{
+	return test_resume("resume/changed");
+}
+
+/*
+ * a resumed PUT fails on a 308 to the last piece, keeping the
+ * checkpoint, and on a descriptor it can't seek
+ */
+static const char *
+test_put_resume(void)
+{
+	http_ctx ctx;
+	char *filename = NULL, ckpt[64], line[64];
+	const char *err = NULL;
+	http_retcode ret;
+	int fd, p[2];
+	FILE *f;
+
+	snprintf(ckpt, sizeof(ckpt), "/tmp/http_test.%d.ckpt", (int) getpid());
+	snprintf(line, sizeof(line), "http-tiny PUT 0 %d \n", 1000);
+	if ((f = fopen(ckpt, "w")) == NULL)
+		return "checkpoint";
+	fputs(line, f);
+	fclose(f);
+	fd = tmp_file();
+	if (write(fd, res, 1000) != 1000 || lseek(fd, 0, SEEK_SET) < 0)
+		err = "file";
+	ctx_init(&ctx, &filename);
+
+	ret = httpmt_put_resume(&ctx, (char *) "missing", fd, -1, 1, NULL,
+		ckpt);
+	if (!err && (ret != 308 || access(ckpt, F_OK) < 0)) {
+		snprintf(msg, sizeof(msg), "308 to the last piece: %d", ret);
+		err = msg;
+	}
+	if (!err && pipe(p) == 0) {
+		ret = httpmt_put_resume(&ctx, (char *) "missing", p[0], 1000, 1,
+			NULL, ckpt);
+		close(p[0]);
+		close(p[1]);
+		if (ret != ERRRDFD) {
+			snprintf(msg, sizeof(msg), "from a pipe: %d", ret);
+			err = msg;
+		}
+	}
+
+	ctx_free(&ctx, filename);
+	close(fd);
+	unlink(ckpt);
+	return err;
+}
+
+/* base64 of "user:secret", the only credentials of the tests */
+static int
+test_b64(const char *in, char **out)
+{
+	return (*out = strdup("dXNlcjpzZWNyZXQ=")) ? 0 : -1;
+}
+
+/*
+ * the response cache, shared by several ctx, keeps neither private
+ * answers nor answers to credentials unless public
+ */
+static const char *
+test_cache_shared(void)
+{
+	static const struct {
+		const char *path;
+		int auth;
+		int kept;
+	} cases[] = {
+		{ "cc/max-age=60", 0, 1 },
+		{ "cc/private,max-age=60", 0, 0 },
+		{ "cc/max-age=60", 1, 0 },
+		{ "cc/public,max-age=60", 1, 1 },
+		{ "cc/s-maxage=60", 1, 1 },
+	};
+	http_ctx ctx;
+	http_cache *cache;
+	http_cache_stats st;
+	multi_result r;
+	char *filename = NULL;
+	const char *err = NULL;
+	unsigned i;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]) && !err; i++) {
+		if ((cache = http_cache_new(1 << 20)) == NULL)
+			return "cache";
+		filename = NULL;
+		ctx_init(&ctx, &filename);
+		httpmt_set_cache(&ctx, cache);
+		httpmt_set_base64_encoder(&ctx, test_b64);
+		if (cases[i].auth)
+			httpmt_set_basic_auth(&ctx, (char *) "user",
+				(char *) "secret");
+		fetch(&ctx, GET, cases[i].path, &r);
+		fetch_free(&ctx, GET, &r);
+		http_cache_get_stats(cache, &st);
+		if (r.ret != 200 || st.stored != cases[i].kept) {
+			snprintf(msg, sizeof(msg), "%s%s: %d, %lld stored",
+				cases[i].path, cases[i].auth ? " with credentials" :
+				"", r.ret, (long long) st.stored);
+			err = msg;
+		}
+		ctx_free(&ctx, filename);
+		http_cache_free(cache);
+	}
+	return err;
+}
+
+/* a producer giving more than asked, once */
+static int
+produce_over(char *buffer, int size, void *arg)
+{
+	int *calls = (int *) arg;
+
+	if ((*calls)++)
+		return 0;
+	memset(buffer, 'x', size);
+	return size + 1;
+}
+
+/* data of a producer past what was asked fails the upload, compressed
+ * or not */
+static const char *
+test_producer_over(void)
+{
+	http_ctx ctx;
+	char *filename = NULL;
+	const char *err = NULL;
+	http_retcode ret;
+	int level, calls;
+
+	for (level = 0; level <= 6 && !err; level += 6) {
+		filename = NULL;
+		ctx_init(&ctx, &filename);
+		httpmt_set_upload_compression(&ctx, level);
+		calls = 0;
+		ret = httpmt_put_producer(&ctx, (char *) "cc/no-store",
+			produce_over, &calls, -1, 1, NULL);
+		if (ret >= 0) {
+			snprintf(msg, sizeof(msg), "level %d: %d", level, ret);
+			err = msg;
+		}
+		ctx_free(&ctx, filename);
+	}
+	return err;
+}
+
+/* answers with the longest validators kept are revalidated */
+static const char *
+test_cache_validators(void)
+{
+	http_ctx ctx;
+	http_cache *cache;
+	http_cache_stats st;
+	multi_result r;
+	char *filename = NULL;
+	const char *err = NULL;
+	int i;
+
+	if ((cache = http_cache_new(1 << 20)) == NULL)
+		return "cache";
+	ctx_init(&ctx, &filename);
+	httpmt_set_cache(&ctx, cache);
+	for (i = 0; i < 2 && !err; i++) {
+		fetch(&ctx, GET, "long", &r);
+		if (r.ret != 200 || r.length != 4 || memcmp(r.data, "data", 4))
+			err = "answer";
+		fetch_free(&ctx, GET, &r);
+	}
+	http_cache_get_stats(cache, &st);
+	if (!err && (st.stored != 1 || st.not_modified != 1)) {
+		snprintf(msg, sizeof(msg), "%lld stored, %lld not modified",
+			(long long) st.stored, (long long) st.not_modified);
+		err = msg;
+	}
+	ctx_free(&ctx, filename);
+	http_cache_free(cache);
+	return err;
+}
+
+/* gets filename as a view, checks it is "data" */
+static const char *
+view_data(http_ctx *ctx, const char *filename)
+{
+	http_view view;
+	http_retcode ret;
+
+	ret = httpmt_get_view(ctx, (char *) filename, &view, NULL);
+	if (ret != 200 || view.length != 4 || memcmp(view.data, "data", 4)) {
+		snprintf(msg, sizeof(msg), "%s: %d", filename, ret);
+		return msg;
+	}
+	http_view_release(&view);
+	return NULL;
+}
+
+/*
+ * the disk cache revalidates answers with the longest validators (a 304
+ * stores the entry again), and
+ * keeps a line of its index per answer whatever their header values
+ */
+static const char *
+test_disk_validators(void)
+{
+	http_ctx ctx;
+	http_disk_cache *dc;
+	http_cache_stats st;
+	char dir[] = "/tmp/http_test.XXXXXX", path[64], *filename = NULL;
+	char line[2048];
+	const char *err = NULL, *p;
+	int tabs;
+	FILE *f;
+
+	if (mkdtemp(dir) == NULL ||
+			(dc = http_disk_cache_open(dir, 1 << 20)) == NULL)
+		return "cache";
+	ctx_init(&ctx, &filename);
+	httpmt_set_disk_cache(&ctx, dc);
+	if (!(err = view_data(&ctx, "long")) &&
+			!(err = view_data(&ctx, "long")))
+		err = view_data(&ctx, "tab");
+	http_disk_cache_get_stats(dc, &st);
+	if (!err && (st.stored != 3 || st.not_modified != 1)) {
+		snprintf(msg, sizeof(msg), "%lld stored, %lld not modified",
+			(long long) st.stored, (long long) st.not_modified);
+		err = msg;
+	}
+	ctx_free(&ctx, filename);
+	http_disk_cache_close(dc);
+
+	snprintf(path, sizeof(path), "%s/index", dir);
+	if (!err && (f = fopen(path, "r")) != NULL) {
+		fgets(line, sizeof(line), f);
+		while (!err && fgets(line, sizeof(line), f)) {
+			for (tabs = 0, p = line; (p = strchr(p, '\t')); p++)
+				tabs++;
+			if (tabs != 7)
+				err = "index line with fields shifted";
+		}
+		fclose(f);
+	}
+	snprintf(line, sizeof(line), "rm -rf %s", dir);
+	if (system(line) != 0)
+		err = "rm";
+	return err;
+}
+
+static void *
+cancel_later(void *arg)
+{
+	usleep(200 * 1000);
+	httpmt_cancel((http_ctx *) arg);
+	return NULL;
+}
+
+/*
+ * an upload from a pipe whose writer stalls stops at the deadline of
+ * the request, or when it is cancelled
+ */
+static const char *
+test_pipe_stall(void)
+{
+	http_ctx ctx;
+	http_timeouts t;
+	pthread_t tid;
+	char *filename = NULL;
+	const char *err = NULL;
+	http_retcode ret;
+	double start;
+	int p[2], cancel;
+
+	for (cancel = 0; cancel < 2 && !err; cancel++) {
+		if (pipe(p) < 0)
+			return "pipe";
+		if (write(p[1], "some", 4) != 4)
+			err = "pipe";
+		filename = NULL;
+		ctx_init(&ctx, &filename);
+		memset(&t, 0, sizeof(t));
+		if (cancel)
+			pthread_create(&tid, NULL, cancel_later, &ctx);
+		else
+			t.total = 200;
+		httpmt_set_timeouts(&ctx, &t);
+		start = now_ms();
+		ret = httpmt_put_fd(&ctx, (char *) "cc/no-store", p[0], -1, 1,
+			NULL);
+		if (cancel)
+			pthread_join(tid, NULL);
+		if (!err && (ret != (cancel ? ERRCANC : ERRDEAD) ||
+				now_ms() - start > 1000)) {
+			snprintf(msg, sizeof(msg), "%s: %d after %.0f ms",
+				cancel ? "cancel" : "deadline", ret,
+				now_ms() - start);
+			err = msg;
+		}
+		ctx_free(&ctx, filename);
+		close(p[0]);
+		close(p[1]);
+	}
+	return err;
+}
+
+/* tells if a file holds text */
+static int
+file_is(const char *path, const char *text)
+{
+	char buffer[64];
+	FILE *f;
+	int n;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return 0;
+	n = fread(buffer, 1, sizeof(buffer), f);
+	fclose(f);
+	return n == (int) strlen(text) && !memcmp(buffer, text, n);
+}
+
+/*
+ * http batch, with lines separated by spaces and JSON ones: the answers
+ * of GET and POST go to their output file, the output file of other
+ * methods is left alone
+ */
+static const char *
+test_batch(void)
+{
+	char dir[] = "/tmp/http_test.XXXXXX", path[5][64], cmd[256];
+	const char *err = NULL;
+	FILE *f;
+	int i, r;
+
+	if (access("./http", X_OK) < 0)
+		return "./http not built";
+	if (mkdtemp(dir) == NULL)
+		return "directory";
+	for (i = 0; i < 5; i++)
+		snprintf(path[i], sizeof(path[i]), "%s/%d", dir, i);
+	for (i = 2; i < 4; i++)
+		if ((f = fopen(path[i], "w")) != NULL) {
+			fputs("kept", f);
+			fclose(f);
+		}
+	if ((f = fopen(path[4], "w")) == NULL)
+		return "batch file";
+	fprintf(f, "# a comment\n"
+		"GET http://127.0.0.1:%d/cc/no-store - %s\n"
+		"{ \"method\": \"POST\", \"url\": \"http://127.0.0.1:%d/cc/x\", "
+		"\"output\": \"%s\" }\n"
+		"HEAD http://127.0.0.1:%d/cc/x - %s\n"
+		"{\"method\":\"BREW\",\"url\":\"http://127.0.0.1:%d/cc/x\","
+		"\"output\":\"%s\"}\n",
+		port, path[0], port, path[1], port, path[2], port, path[3]);
+	fclose(f);
+
+	snprintf(cmd, sizeof(cmd), "./http batch %s 2 >/dev/null 2>&1",
+		path[4]);
+	r = system(cmd);
+	/* BREW fails */
+	if (!WIFEXITED(r) || WEXITSTATUS(r) != 6) {
+		snprintf(msg, sizeof(msg), "exit status %d", r);
+		err = msg;
+	} else if (!file_is(path[0], "data") || !file_is(path[1], "data")) {
+		err = "GET or POST output";
+	} else if (!file_is(path[2], "kept") || !file_is(path[3], "kept")) {
+		err = "HEAD or unknown method output changed";
+	}
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	if (system(cmd) != 0)
+		err = "rm";
+	return err;
+}
+
+typedef struct {
+	const char *name;
+	const char *(*fn)(void);
+} test;
+
+static test tests[] = {
+	{ "chunked", test_chunked },
+	{ "gzip", test_gzip },
+	{ "multi_stall_epoll", test_multi_stall_epoll },
+	{ "multi_stall_uring", test_multi_stall_uring },
+	{ "expired_pool", test_expired_pool },
+	{ "range_parallel", test_range_parallel },
+	{ "range_none", test_range_none },
+	{ "range_changed", test_range_changed },
+	{ "resume_range", test_resume_range },
+	{ "resume_changed", test_resume_changed },
+	{ "put_resume", test_put_resume },
+	{ "cache_shared", test_cache_shared },
+	{ "cache_validators", test_cache_validators },
+	{ "disk_validators", test_disk_validators },
+	{ "producer_over", test_producer_over },
+	{ "pipe_stall", test_pipe_stall },
+	{ "batch", test_batch },
+};
+
+int main(int argc, char *argv[])
+{
+	const char *err;
+	unsigned i;
+	int failed = 0;
+
+	if (argc > 2) {
+		fprintf(stderr, "usage: http_test [name]\n");
+		return 1;
+	}
+	if (srv_answers() < 0 || (port = srv_start()) < 0) {
+		perror("http_test");
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		if (argc == 2 && strncmp(tests[i].name, argv[1],
+				strlen(argv[1])))
+			continue;
+		if ((err = (*tests[i].fn)()) != NULL) {
+			printf("FAIL %s: %s\n", tests[i].name, err);
+			failed++;
+		} else {
+			printf("ok   %s\n", tests[i].name);
+		}
+		fflush(stdout);
+	}
+	return failed;
+}
@@ -0,0 +1,262 @@
+/*
+ *  Http put/get/post mini lib
+ *  io_uring submission and completion rings
+ *  see LICENSE for terms, conditions and DISCLAIMER OF ALL WARRANTIES
+ *
+ * Description : a minimal io_uring(7) ring over the raw system calls,
+ * for the multi request engine: requests queue their connect, send and
+ * receive operations and a single io_uring_enter submits all of them and
+ * waits for completions.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "http_lib.h"
+#include "http_private.h"
+
+struct _http_uring {
+	http_ctx *ctx;
+	int fd;
+	unsigned features;
+
+	/* submission queue */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_entries;
+	unsigned queued;	/* sqes filled, not submitted yet */
+
+	/* completion queue */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	struct __kernel_timespec ts;	/* of the pending wait */
+};
+
+static int
+uring_enter(int fd, unsigned submit, unsigned complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, complete, flags,
+		NULL, 0);
+}
+
+/*
+ * create a ring of entries submission entries
+ * returns NULL if io_uring is not available (old kernel, disabled,
+ * out of memory)
+ */
+extern http_uring *
+http_uring_init(http_ctx *ctx, unsigned entries)
+{
+	struct io_uring_params p;
+	http_uring *u;
+	char *sq, *cq;
+
+	if ((u = (http_uring *) http_alloc(ctx, sizeof(*u))) == NULL)
+		return NULL;
+	memset(u, 0, sizeof(*u));
+	u->ctx = ctx;
+
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd < 0) {
+		httpmt_free(ctx, u);
+		return NULL;
+	}
+	u->features = p.features;
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = p.cq_off.cqes + 
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_size > u->sq_ring_size)
+			u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = u->sq_ring_size;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) {
+			u->cq_ring = NULL;
+			goto fail;
+		}
+	}
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = (struct io_uring_sqe *) mmap(NULL, u->sqes_size,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+		IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto fail;
+	}
+
+	sq = (char *) u->sq_ring;
+	u->sq_head = (unsigned *) (sq + p.sq_off.head);
+	u->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *) (sq + p.sq_off.array);
+	u->sq_entries = p.sq_entries;
+
+	cq = (char *) u->cq_ring;
+	u->cq_head = (unsigned *) (cq + p.cq_off.head);
+	u->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	return u;
+
+fail:
+	http_uring_free(u);
+	return NULL;
+}
+
+extern void
+http_uring_free(http_uring *u)
+{
+	if (u == NULL)
+		return;
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sq_ring && u->sq_ring != MAP_FAILED)
+		munmap(u->sq_ring, u->sq_ring_size);
+	close(u->fd);
+	httpmt_free(u->ctx, u);
+}
+
+/*
+ * get a cleared submission entry, the queued ones are submitted first
+ * if the queue is full
+ * returns NULL if it can't be submitted
+ */
+extern struct io_uring_sqe *
+http_uring_sqe(http_uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, head;
+
+	head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	tail = *u->sq_tail;
+	if (tail - head >= u->sq_entries) {
+		if (http_uring_submit(u) < 0)
+			return NULL;
+		head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head >= u->sq_entries)
+			return NULL;
+	}
+
+	sqe = &u->sqes[tail & *u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->queued++;
+
+	return sqe;
+}
+
+/*
+ * submit the queued entries without waiting
+ * returns 0 or -1 on error
+ */
+extern int
+http_uring_submit(http_uring *u)
+{
+	int n;
+
+	while (u->queued > 0) {
+		n = uring_enter(u->fd, u->queued, 0, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		u->queued -= n;
+	}
+	return 0;
+}
+
+/*
+ * submit the queued entries and wait up to timeout milliseconds (-1 for
+ * ever) for at least one completion, with a single system call
+ * returns 0 or -1 on error
+ */
+extern int
+http_uring_wait(http_uring *u, int timeout)
+{
+	struct io_uring_sqe *sqe;
+	int n;
+
+	if (http_uring_peek(u, NULL, NULL))
+		timeout = 0;
+
+	if (timeout >= 0) {
+		/* done after one completion or the timeout */
+		if ((sqe = http_uring_sqe(u)) == NULL)
+			return -1;
+		u->ts.tv_sec = timeout / 1000;
+		u->ts.tv_nsec = (timeout % 1000) * 1000000L;
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = (unsigned long) &u->ts;
+		sqe->len = 1;
+		sqe->off = 1;
+		sqe->user_data = 0;
+	}
+
+	do {
+		n = uring_enter(u->fd, u->queued, 1, IORING_ENTER_GETEVENTS);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return -1;
+	u->queued -= n;
+	return 0;
+}
+
+/*
+ * take the next completion
+ * returns 1 and its user data and result, or 0 if there is none. 
+ * pdata NULL only tells if there is one.
+ */
+extern int
+http_uring_peek(http_uring *u, void **pdata, int *pres)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head;
+
+	head = *u->cq_head;
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+	if (pdata == NULL)
+		return 1;
+
+	cqe = &u->cqes[head & *u->cq_mask];
+	*pdata = (void *) (unsigned long) cqe->user_data;
+	*pres = cqe->res;
+	__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}